@@ -0,0 +1,512 @@
+/*
+ * Copyright (C) 2013 Przemyslaw Pawelczyk <przemoc@gmail.com>
+ *
+ * This software is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ * See <http://www.gnu.org/licenses/gpl-2.0.txt>.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if !__WIN32__
+# include <sys/wait.h>
+#endif
+
+#include "common.h"
+#include "batch.h"
+#include "io.h"
+#include "ui.h"
+
+#if !__WIN32__
+
+/* ==== Defines and Macros ================================================== */
+
+/** Longest line of manifest. */
+#define LINE_SIZE 4096
+/** Characters separating fields of manifest. */
+#define SEPARATORS " \t\r\n"
+
+/** Image listed in manifest. */
+typedef struct batch_image {
+	char *in;
+	char *out;          /**< Output file or NULL (in place). */
+	uint32_t new_msize; /**< New size in megabytes or 0 (information only). */
+	unsigned line;      /**< Line of manifest. */
+	int result;
+} batch_image_t;
+
+/** Outcome of image sent by child process through pipe. */
+typedef struct batch_result {
+	int result;
+	uint64_t peak_rss;
+	io_stats_t io;
+} batch_result_t;
+
+/** Image being processed. */
+typedef struct batch_job {
+	pid_t pid;          /**< Child process or 0 if job slot is free. */
+	unsigned image;     /**< Index of image. */
+	int pipe;           /**< Read end of pipe with result. */
+	FILE *log;          /**< Output of child process. */
+	FILE *stats;        /**< Statistics of child process (JSON) or NULL. */
+	uint64_t start;
+} batch_job_t;
+
+/** Whole batch. */
+typedef struct batch {
+	const batch_opts_t *opts;
+	batch_image_fn_t fn;
+	batch_image_t *images;
+	unsigned count;
+	unsigned done;      /**< Images processed so far. */
+	unsigned failed;
+	unsigned reported;  /**< Images in JSON report so far. */
+	uint64_t peak_rss;  /**< Highest peak memory usage of single image. */
+	io_stats_t io;      /**< I/O of all images. */
+	FILE *report;       /**< JSON report or NULL. */
+	int split;          /**< Whether bandwidth is split between jobs
+	                         (if it cannot be shared). */
+} batch_t;
+
+/* ==== Non-exposed functions definitions =================================== */
+
+static int parse_size(const char *str, uint32_t *val)
+{
+	char *tmp;
+	long long v;
+
+	if (!strcmp(str, "-")) {
+		*val = 0;
+		return SUCCESS;
+	}
+	v = strtoll(str, &tmp, 10);
+	if (*tmp != '\0' || v <= 0 || v > UINT32_MAX)
+		return FAILURE;
+	*val = v;
+
+	return SUCCESS;
+}
+
+static int add_image(batch_t *b, const char *in, const char *out,
+                     uint32_t new_msize, unsigned line)
+{
+	batch_image_t *img;
+
+	/* Grow array whenever count reaches power of 2. */
+	if (!(b->count & (b->count - 1))) {
+		img = realloc(b->images, max_u32(b->count * 2, 1) * sizeof(*img));
+		if (!img)
+			return FAILURE;
+		b->images = img;
+	}
+	img = &b->images[b->count];
+	img->in = strdup(in);
+	img->out = out ? strdup(out) : NULL;
+	img->new_msize = new_msize;
+	img->line = line;
+	img->result = FAILURE;
+	if (!img->in || (out && !img->out)) {
+		free(img->out);
+		free(img->in);
+		return FAILURE;
+	}
+	b->count++;
+
+	return SUCCESS;
+}
+
+static int read_manifest(batch_t *b, const char *path)
+{
+	FILE *f;
+	char line[LINE_SIZE];
+	char *in, *size, *out;
+	uint32_t new_msize;
+	unsigned no = 0;
+	int res = SUCCESS;
+
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return FAILURE;
+	}
+	while (res == SUCCESS && fgets(line, sizeof(line), f)) {
+		no++;
+		res = FAILURE;
+		if (!strchr(line, '\n') && !feof(f)) {
+			fprintf(stderr, "%s:%u: Line is too long!\n", path, no);
+			break;
+		}
+		in = strtok(line, SEPARATORS);
+		if (!in || *in == '#') {
+			res = SUCCESS;
+			continue;
+		}
+		size = strtok(NULL, SEPARATORS);
+		out = size ? strtok(NULL, SEPARATORS) : NULL;
+		if (!size || (out && strtok(NULL, SEPARATORS))) {
+			fprintf(stderr, "%s:%u: Expected INPUT_FILE NEW_SIZE_IN_MB"
+			                " [OUTPUT_FILE]!\n", path, no);
+		} else if (parse_size(size, &new_msize) != SUCCESS) {
+			fprintf(stderr, "%s:%u: Incorrect size!\n", path, no);
+		} else if (out && !new_msize) {
+			fprintf(stderr, "%s:%u: Output file makes no sense without"
+			                " new size!\n", path, no);
+		} else if (add_image(b, in, out, new_msize, no) != SUCCESS) {
+			fprintf(stderr, "Cannot allocate list of images!\n");
+		} else {
+			res = SUCCESS;
+		}
+	}
+	if (res == SUCCESS && ferror(f)) {
+		perror(path);
+		res = FAILURE;
+	}
+	fclose(f);
+	if (res == SUCCESS && !b->count) {
+		fprintf(stderr, "%s: No images in manifest!\n", path);
+		res = FAILURE;
+	}
+
+	return res;
+}
+
+static void free_images(batch_t *b)
+{
+	unsigned i;
+
+	for (i = 0; i < b->count; i++) {
+		free(b->images[i].out);
+		free(b->images[i].in);
+	}
+	free(b->images);
+}
+
+/* Copies what was written to \p from, prefixing every line with \p indent. */
+static void copy_lines(FILE *from, FILE *to, const char *indent)
+{
+	char buf[LINE_SIZE];
+	int bol = 1;
+
+	rewind(from);
+	while (fgets(buf, sizeof(buf), from)) {
+		if (bol)
+			fputs(indent, to);
+		fputs(buf, to);
+		bol = !!strchr(buf, '\n');
+	}
+	if (!bol)
+		fputc('\n', to);
+}
+
+/* Processes image in child process (never returns). */
+static void run_child(batch_t *b, batch_job_t *job, int fd)
+{
+	batch_image_t *img = &b->images[job->image];
+	batch_result_t res;
+
+	memset(&res, 0, sizeof(res));
+	if (dup2(fileno(job->log), STDOUT_FILENO) < 0 ||
+	    dup2(fileno(job->log), STDERR_FILENO) < 0)
+		_exit(FAILURE);
+	if (b->split)
+		io_opts.bandwidth = max_u64(io_opts.bandwidth / b->opts->jobs, 1);
+	ui = &ui_batch;
+	if (b->opts->stats) {
+		ui_stats_start(ui);
+		ui = &ui_stats;
+	}
+
+	res.result = b->fn(img->in, img->out, img->new_msize);
+
+	if (b->opts->stats)
+		ui_stats_write_json(job->stats, res.result);
+	io_stats_get(&res.io);
+	get_peak_rss(&res.peak_rss);
+	fflush(NULL);
+	if (write(fd, &res, sizeof(res)) != sizeof(res))
+		_exit(FAILURE);
+	_exit(res.result);
+}
+
+static void close_job(batch_job_t *job)
+{
+	if (job->stats)
+		fclose(job->stats);
+	if (job->log)
+		fclose(job->log);
+	job->stats = NULL;
+	job->log = NULL;
+	job->pid = 0;
+}
+
+static int start_job(batch_t *b, batch_job_t *job, unsigned image)
+{
+	int fds[2];
+
+	job->image = image;
+	job->log = tmpfile();
+	job->stats = b->opts->stats ? tmpfile() : NULL;
+	if (!job->log || (b->opts->stats && !job->stats)) {
+		perror("Cannot create temporary file");
+		close_job(job);
+		return FAILURE;
+	}
+	if (pipe(fds)) {
+		perror("Cannot create pipe");
+		close_job(job);
+		return FAILURE;
+	}
+	/* Child must not inherit anything waiting in buffers. */
+	fflush(NULL);
+	job->start = gettimeofday_us();
+	job->pid = fork();
+	if (job->pid < 0) {
+		perror("Cannot start process");
+		close(fds[1]);
+		close(fds[0]);
+		close_job(job);
+		return FAILURE;
+	}
+	if (!job->pid) {
+		close(fds[0]);
+		run_child(b, job, fds[1]);
+	}
+	close(fds[1]);
+	job->pipe = fds[0];
+
+	return SUCCESS;
+}
+
+static void report_image(batch_t *b, batch_job_t *job, uint64_t wall)
+{
+	batch_image_t *img = &b->images[job->image];
+
+	if (!b->report)
+		return;
+	fprintf(b->report, "%s\n    {\n      \"line\": %u,\n      \"input\": ",
+	        b->reported++ ? "," : "", img->line);
+	ui_json_string(b->report, img->in);
+	fprintf(b->report, ",\n      \"output\": ");
+	if (img->out)
+		ui_json_string(b->report, img->out);
+	else
+		fprintf(b->report, "null");
+	fprintf(b->report, ",\n"
+	                   "      \"new_size_mb\": %u,\n"
+	                   "      \"result\": \"%s\",\n"
+	                   "      \"wall_us\": %"PRIu64",\n"
+	                   "      \"stats\":",
+	        img->new_msize, img->result == SUCCESS ? "success" : "failure",
+	        wall);
+	fseek(job->stats, 0, SEEK_END);
+	if (ftell(job->stats) > 0) {
+		fputc('\n', b->report);
+		copy_lines(job->stats, b->report, "      ");
+		fprintf(b->report, "    }");
+	} else {
+		fprintf(b->report, " null\n    }");
+	}
+}
+
+/* Gathers outcome of finished child process and shows its output. */
+static void finish_job(batch_t *b, batch_job_t *job, int status)
+{
+	batch_image_t *img = &b->images[job->image];
+	uint64_t wall = gettimeofday_us() - job->start;
+	batch_result_t res;
+
+	memset(&res, 0, sizeof(res));
+	if (read(job->pipe, &res, sizeof(res)) != sizeof(res) ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) != res.result) {
+		memset(&res, 0, sizeof(res));
+		res.result = FAILURE;
+	}
+	close(job->pipe);
+	img->result = res.result;
+	b->done++;
+	if (res.result != SUCCESS)
+		b->failed++;
+	b->peak_rss = max_u64(b->peak_rss, res.peak_rss);
+	b->io.read_bytes += res.io.read_bytes;
+	b->io.write_bytes += res.io.write_bytes;
+	b->io.kernel_bytes += res.io.kernel_bytes;
+
+	printf("==> [%u/%u] %s\n", b->done, b->count, img->in);
+	copy_lines(job->log, stdout, "");
+	if (WIFSIGNALED(status))
+		printf("Process killed by signal %d\n", WTERMSIG(status));
+	printf("<== [%u/%u] %s: %s (%"PRIu64" ms)\n\n", b->done, b->count,
+	       img->in, res.result == SUCCESS ? "success" : "failure",
+	       wall / 1000);
+	fflush(stdout);
+	report_image(b, job, wall);
+	close_job(job);
+}
+
+/* Processes images keeping up to opts->jobs child processes running. */
+static void schedule(batch_t *b)
+{
+	batch_job_t *jobs;
+	unsigned next = 0, running = 0;
+	unsigned i;
+	int status;
+	pid_t pid;
+
+	jobs = calloc(b->opts->jobs, sizeof(*jobs));
+	if (!jobs) {
+		fprintf(stderr, "Cannot allocate jobs!\n");
+		return;
+	}
+	while (next < b->count || running) {
+		for (i = 0; i < b->opts->jobs && next < b->count; i++) {
+			if (jobs[i].pid)
+				continue;
+			if (start_job(b, &jobs[i], next++) == SUCCESS) {
+				running++;
+			} else {
+				b->done++;
+				b->failed++;
+				printf("<== [%u/%u] %s: failure (not started)\n\n", b->done,
+				       b->count, b->images[next - 1].in);
+			}
+		}
+		if (!running)
+			continue;
+		pid = waitpid(-1, &status, 0);
+		if (pid < 0) {
+			perror("Cannot wait for process");
+			break;
+		}
+		for (i = 0; i < b->opts->jobs; i++) {
+			if (jobs[i].pid == pid) {
+				finish_job(b, &jobs[i], status);
+				running--;
+				break;
+			}
+		}
+	}
+	free(jobs);
+}
+
+static void print_summary(batch_t *b, uint64_t wall)
+{
+	unsigned i;
+
+	ui->log("Batch finished\n"
+	        "     %21u image(s)\n"
+	        "     %21u succeeded\n"
+	        "     %21u failed\n",
+	        b->count, b->count - b->failed, b->failed);
+	ui->log("Wall time\n"
+	        "     %21"PRIu64" ms\n", wall / 1000);
+	ui->log("Data read\n"
+	        "     %21"PRIu64" bytes (%15"PRIu64" MB)\n",
+	        b->io.read_bytes, b->io.read_bytes / _1MB);
+	ui->log("Data written\n"
+	        "     %21"PRIu64" bytes (%15"PRIu64" MB)\n",
+	        b->io.write_bytes, b->io.write_bytes / _1MB);
+	ui->log("Data copied by kernel\n"
+	        "     %21"PRIu64" bytes (%15"PRIu64" MB)\n",
+	        b->io.kernel_bytes, b->io.kernel_bytes / _1MB);
+	ui->log("Peak memory usage of single image\n"
+	        "     %21"PRIu64" bytes (%15"PRIu64" MB)\n",
+	        b->peak_rss, b->peak_rss / _1MB);
+	if (!b->failed)
+		return;
+	ui->log("Failed images\n");
+	for (i = 0; i < b->count; i++)
+		if (b->images[i].result != SUCCESS)
+			ui->log("     line %5u: %s\n", b->images[i].line,
+			        b->images[i].in);
+}
+
+static void finish_report(batch_t *b, uint64_t wall)
+{
+	fprintf(b->report, "%s],\n"
+	                   "  \"result\": \"%s\",\n"
+	                   "  \"wall_us\": %"PRIu64",\n"
+	                   "  \"jobs\": %u,\n"
+	                   "  \"bandwidth_bytes_per_s\": %"PRIu64",\n"
+	                   "  \"images\": %u,\n"
+	                   "  \"succeeded\": %u,\n"
+	                   "  \"failed\": %u,\n"
+	                   "  \"read_bytes\": %"PRIu64",\n"
+	                   "  \"write_bytes\": %"PRIu64",\n"
+	                   "  \"kernel_copy_bytes\": %"PRIu64",\n"
+	                   "  \"peak_rss_bytes\": %"PRIu64"\n"
+	                   "}\n",
+	        b->reported ? "\n  " : "", b->failed ? "failure" : "success", wall,
+	        b->opts->jobs, io_opts.bandwidth, b->count, b->count - b->failed,
+	        b->failed, b->io.read_bytes, b->io.write_bytes,
+	        b->io.kernel_bytes, b->peak_rss);
+	if (b->report != stderr)
+		fclose(b->report);
+	else
+		fflush(b->report);
+}
+
+/* ==== Exposed functions definitions ======================================= */
+
+int batch_run(const char *manifest, const batch_opts_t *opts,
+              batch_image_fn_t fn)
+{
+	batch_t b;
+	uint64_t start = gettimeofday_us();
+
+	memset(&b, 0, sizeof(b));
+	b.opts = opts;
+	b.fn = fn;
+	if (read_manifest(&b, manifest) != SUCCESS) {
+		free_images(&b);
+		return FAILURE;
+	}
+	if (opts->stats) {
+		b.report = opts->stats_file ? fopen(opts->stats_file, "w") : stderr;
+		if (!b.report) {
+			perror(opts->stats_file);
+			free_images(&b);
+			return FAILURE;
+		}
+		fprintf(b.report, "{\n  \"results\": [");
+	}
+
+	/* Children take turns from one schedule, so the limit is their total
+	 * and share of idle ones isn't wasted. */
+	if (io_opts.bandwidth && opts->jobs > 1 &&
+	    io_share_throttle() != SUCCESS) {
+		ui->log("NOTE    Bandwidth cannot be shared, each of %u jobs"
+		        " gets 1/%u of it.\n", opts->jobs, opts->jobs);
+		b.split = 1;
+	}
+	schedule(&b);
+	if (b.done < b.count)
+		b.failed += b.count - b.done;
+	print_summary(&b, gettimeofday_us() - start);
+	if (b.report)
+		finish_report(&b, gettimeofday_us() - start);
+	free_images(&b);
+
+	return b.failed ? FAILURE : SUCCESS;
+}
+
+#else /* __WIN32__ */
+
+int batch_run(const char *manifest, const batch_opts_t *opts,
+              batch_image_fn_t fn)
+{
+	(void)manifest;
+	(void)opts;
+	(void)fn;
+	fprintf(stderr, "Batch mode is not supported on this platform!\n");
+
+	return FAILURE;
+}
+
+#endif /* __WIN32__ */
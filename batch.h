@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2013 Przemyslaw Pawelczyk <przemoc@gmail.com>
+ *
+ * This software is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ * See <http://www.gnu.org/licenses/gpl-2.0.txt>.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/** \file batch.h
+ * Batch mode.
+ *
+ * Images listed in manifest are processed without asking any questions,
+ * each one in its own child process, so a failing image cannot take others
+ * down and no state is shared between them. At most given number of images
+ * is processed at once. Bandwidth limit (see io_opts) is split evenly
+ * between them, so the total stays within it.
+ *
+ * Manifest has one image per line: input file, new size in megabytes (or
+ * "-" to only show information about image) and optional output file,
+ * separated by whitespace. Empty lines and lines starting with '#' are
+ * skipped.
+ *
+ * Output of every image is shown as a whole once it's processed, followed
+ * by aggregated report of all of them.
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "common.h"
+
+/** Processes single image: resizes \p in to \p new_msize megabytes (or only
+ * shows information about it if \p new_msize is 0), writing it to \p out
+ * (or in place if \p out is NULL).
+ *
+ * \return \a SUCCESS or \a FAILURE
+ */
+typedef int (*batch_image_fn_t)(const char *in, const char *out,
+                                uint32_t new_msize);
+
+/** Batch mode options. */
+typedef struct batch_opts {
+	unsigned jobs;          /**< Images processed at once. */
+	int stats;              /**< Whether JSON report is written. */
+	const char *stats_file; /**< File for JSON report (stderr if NULL). */
+} batch_opts_t;
+
+/** Processes images listed in \p manifest with \p fn.
+ *
+ * \return \a SUCCESS if all images were processed successfully,
+ *         \a FAILURE otherwise
+ */
+int batch_run(const char *manifest, const batch_opts_t *opts,
+              batch_image_fn_t fn);
+
+#endif /* BATCH_H */
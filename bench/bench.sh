@@ -0,0 +1,137 @@
+#!/bin/sh
+
+# Copyright (C) 2013 Przemyslaw Pawelczyk <przemoc@gmail.com>
+#
+# This software is free software; you can redistribute it and/or modify it
+# under the terms of the GNU General Public License version 2.
+# See <http://www.gnu.org/licenses/gpl-2.0.txt>.
+#
+# This software is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+# or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+# for more details.
+
+# vidma benchmark harness
+#
+# Generates synthetic images with vdi-gen and times resize scenarios in every
+# directory from BENCH_DIRS (tmpfs and real disk by default). Results are
+# written as JSON to standard output (progress goes to standard error), with
+# statistics of every run coming from vidma --stats=json, so runs of two
+# builds can be compared directly.
+#
+# Environment variables (defaults in brackets):
+#   VIDMA         vidma binary [./vidma]
+#   VDI_GEN       vdi-gen binary [./vdi-gen]
+#   VIDMA_OPTS    additional vidma options, e.g. "-e uring -b 4" []
+#   BENCH_DIRS    directories to run in [/dev/shm /var/tmp]
+#   BENCH_RUNS    runs of every scenario [3]
+#   BENCH_SIZE    disk size in megabytes [1024]
+#   BENCH_BLOCK   block size [1048576]
+#   BENCH_EXTRA   block extra data [0]
+#   BENCH_FILL    percent of allocated blocks (dynamic images) [60]
+#   BENCH_ZERO    percent of zero blocks [10]
+#   BENCH_FRAG    percent of blocks not in disk order [20]
+
+set -e
+
+VIDMA="${VIDMA:-./vidma}"
+VDI_GEN="${VDI_GEN:-./vdi-gen}"
+VIDMA_OPTS="${VIDMA_OPTS:-}"
+BENCH_DIRS="${BENCH_DIRS:-/dev/shm /var/tmp}"
+BENCH_RUNS="${BENCH_RUNS:-3}"
+BENCH_SIZE="${BENCH_SIZE:-1024}"
+BENCH_BLOCK="${BENCH_BLOCK:-1048576}"
+BENCH_EXTRA="${BENCH_EXTRA:-0}"
+BENCH_FILL="${BENCH_FILL:-60}"
+BENCH_ZERO="${BENCH_ZERO:-10}"
+BENCH_FRAG="${BENCH_FRAG:-20}"
+
+GEN_OPTS="-s $BENCH_SIZE -B $BENCH_BLOCK -x $BENCH_EXTRA -f $BENCH_FILL"
+GEN_OPTS="$GEN_OPTS -z $BENCH_ZERO -F $BENCH_FRAG"
+
+WORK=
+cleanup() {
+	[ -z "$WORK" ] || rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+log() {
+	echo "$*" >&2
+}
+
+# scenario NAME GEN_OPTIONS
+# Runs vidma with ARGS, where IMAGE and COPY are replaced with paths.
+scenario() {
+	name="$1"
+	gen="$2"
+
+	log "  $name: generating image"
+	"$VDI_GEN" $GEN_OPTS $gen "$WORK/pristine.vdi"
+	run=1
+	while [ $run -le "$BENCH_RUNS" ]; do
+		log "  $name: run $run of $BENCH_RUNS"
+		rm -f "$WORK/image.vdi" "$WORK/copy.vdi" "$WORK/stats.json"
+		cp "$WORK/pristine.vdi" "$WORK/image.vdi"
+		sync
+		set --
+		for arg in $ARGS; do
+			case "$arg" in
+			IMAGE) set -- "$@" "$WORK/image.vdi" ;;
+			COPY)  set -- "$@" "$WORK/copy.vdi" ;;
+			*)     set -- "$@" "$arg" ;;
+			esac
+		done
+		yes | "$VIDMA" $VIDMA_OPTS -S json --stats-file="$WORK/stats.json" \
+		    "$@" >/dev/null 2>&1 || log "  $name: vidma failed"
+		[ $FIRST ] || printf ',\n'
+		FIRST=
+		printf '    { "scenario": "%s", "dir": "%s", "run": %d, "stats":\n' \
+		       "$name" "$DIR" $run
+		if [ -f "$WORK/stats.json" ]; then
+			sed 's/^/      /' "$WORK/stats.json"
+		else
+			printf '      null\n'
+		fi
+		printf '    }'
+		run=$((run + 1))
+	done
+}
+
+printf '{\n'
+printf '  "vidma": "%s",\n' "$("$VIDMA" | sed -n '1s/.*, //p')"
+printf '  "vidma_opts": "%s",\n' "$VIDMA_OPTS"
+printf '  "image": { "size_mb": %d, "block_size": %d, "extra": %d, ' \
+       "$BENCH_SIZE" "$BENCH_BLOCK" "$BENCH_EXTRA"
+printf '"fill": %d, "zero": %d, "frag": %d },\n' \
+       "$BENCH_FILL" "$BENCH_ZERO" "$BENCH_FRAG"
+printf '  "results": [\n'
+FIRST=1
+GROW=$((BENCH_SIZE * 3 / 2))
+GROW_BAM=$((BENCH_SIZE * 4))
+SHRINK=$((BENCH_SIZE / 2))
+for DIR in $BENCH_DIRS; do
+	if [ ! -d "$DIR" ] || [ ! -w "$DIR" ]; then
+		log "Skipping $DIR"
+		continue
+	fi
+	WORK="$(mktemp -d "$DIR/vidma-bench.XXXXXX")"
+	log "Benchmarking in $DIR"
+
+	# Fixed image grown in place: data moves if BAM outgrows its area.
+	ARGS="IMAGE $GROW"
+	scenario resize-in-place "-t fixed -a 512"
+	# Dynamic image grown into another file.
+	ARGS="IMAGE $GROW COPY"
+	scenario resize-by-copy "-t dynamic"
+	# Dynamic image without room for BAM grown in place, so leading
+	# blocks are relocated past the last one.
+	ARGS="IMAGE $GROW_BAM"
+	scenario grow-with-bam-move "-t dynamic -a 512"
+	# Dynamic image shrunk in place.
+	ARGS="IMAGE $SHRINK"
+	scenario shrink "-t dynamic"
+
+	rm -rf "$WORK"
+	WORK=
+done
+printf '\n  ]\n}\n'
@@ -0,0 +1,295 @@
+/*
+ * Copyright (C) 2013 Przemyslaw Pawelczyk <przemoc@gmail.com>
+ *
+ * This software is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ * See <http://www.gnu.org/licenses/gpl-2.0.txt>.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/* Generator of synthetic VDI images used by benchmarks. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "vdi.h"
+
+const char vdi_gen_usage_string[] =
+	"Usage: %s [OPTION]... OUTPUT_FILE\n"
+	"\n"
+	"Generates synthetic VDI image filled with pseudo-random data.\n"
+	"\n"
+	"Options:\n"
+	"  -t, --type=TYPE         dynamic or fixed (default: dynamic)\n"
+	"  -s, --size=MB           disk size in megabytes (default: 1024)\n"
+	"  -B, --block-size=BYTES  block size, power of 2 (default: 1048576)\n"
+	"  -x, --extra=BYTES       extra data of each block, 0 or power of 2\n"
+	"                          (default: 0)\n"
+	"  -a, --align=BYTES       alignment of data offset (default: 1048576),\n"
+	"                          512 leaves no room for growing BAM\n"
+	"  -f, --fill=PERCENT      blocks allocated in dynamic image"
+	" (default: 60)\n"
+	"  -z, --zero=PERCENT      allocated blocks filled with zeros"
+	" (default: 10)\n"
+	"  -F, --frag=PERCENT      allocated blocks not in disk order"
+	" (default: 0)\n"
+	"  -r, --seed=N            seed of pseudo-random generator (default: 1)\n";
+
+static const struct option long_options[] = {
+	{ "type",       required_argument, NULL, 't' },
+	{ "size",       required_argument, NULL, 's' },
+	{ "block-size", required_argument, NULL, 'B' },
+	{ "extra",      required_argument, NULL, 'x' },
+	{ "align",      required_argument, NULL, 'a' },
+	{ "fill",       required_argument, NULL, 'f' },
+	{ "zero",       required_argument, NULL, 'z' },
+	{ "frag",       required_argument, NULL, 'F' },
+	{ "seed",       required_argument, NULL, 'r' },
+	{ NULL,         0,                 NULL, 0   }
+};
+
+/** Size of batches of blocks written at once. */
+#define WRITE_BATCH (8 * _1MB)
+
+static uint64_t rnd_state;
+
+static uint64_t rnd()
+{
+	/* xorshift64* */
+	rnd_state ^= rnd_state >> 12;
+	rnd_state ^= rnd_state << 25;
+	rnd_state ^= rnd_state >> 27;
+	return rnd_state * UINT64_C(2685821657736338717);
+}
+
+/* Returns 1 with probability of \p percent %. */
+static int chance(uint32_t percent)
+{
+	return rnd() % 100 < percent;
+}
+
+static int parse_u32(const char *str, uint32_t *val, uint32_t max)
+{
+	char *tmp;
+	long long v = strtoll(str, &tmp, 10);
+
+	if (*str == '\0' || *tmp != '\0' || v < 0 || v > max)
+		return FAILURE;
+	*val = v;
+
+	return SUCCESS;
+}
+
+static void fill_block(char *buf, uint32_t ebs, int zero)
+{
+	uint64_t v;
+	uint32_t i;
+
+	if (zero) {
+		memset(buf, 0, ebs);
+		return;
+	}
+	for (i = 0; i < ebs; i += sizeof(v)) {
+		v = rnd();
+		memcpy(buf + i, &v, min_u32(sizeof(v), ebs - i));
+	}
+	/* Make sure no block is accidentally a zero one. */
+	buf[0] |= 1;
+}
+
+static int write_all(int fd, const void *buf, size_t len, uint64_t off)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = pwrite(fd, p, len, off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return FAILURE;
+		p += n;
+		len -= n;
+		off += n;
+	}
+
+	return SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t type = VDI_DYNAMIC;
+	uint32_t size_mb = 1024;
+	uint32_t blk_size = _1MB;
+	uint32_t extra = 0;
+	uint32_t align = _1MB;
+	uint32_t fill = 60, zero = 10, frag = 0;
+	uint32_t seed = 1;
+	uint32_t blk_count, alloc, ebs, per_batch, i, j, n, tmp;
+	vdi_bam_entry_t *bam, *p2v;
+	vdi_start_t vdi;
+	uint64_t off;
+	char *buf;
+	int opt, fd;
+
+	while ((opt = getopt_long(argc, argv, "t:s:B:x:a:f:z:F:r:", long_options,
+	                          NULL)) != -1) {
+		int res = SUCCESS;
+
+		switch (opt) {
+		case 't':
+			if (!strcmp(optarg, "dynamic"))
+				type = VDI_DYNAMIC;
+			else if (!strcmp(optarg, "fixed"))
+				type = VDI_FIXED;
+			else
+				res = FAILURE;
+			break;
+		case 's':
+			res = parse_u32(optarg, &size_mb, UINT32_MAX);
+			break;
+		case 'B':
+			res = parse_u32(optarg, &blk_size, 1U << 30);
+			break;
+		case 'x':
+			res = parse_u32(optarg, &extra, 1U << 30);
+			break;
+		case 'a':
+			res = parse_u32(optarg, &align, 1U << 30);
+			break;
+		case 'f':
+			res = parse_u32(optarg, &fill, 100);
+			break;
+		case 'z':
+			res = parse_u32(optarg, &zero, 100);
+			break;
+		case 'F':
+			res = parse_u32(optarg, &frag, 100);
+			break;
+		case 'r':
+			res = parse_u32(optarg, &seed, UINT32_MAX);
+			break;
+		default:
+			exit(FAILURE);
+		}
+		if (res != SUCCESS) {
+			fprintf(stderr, "Incorrect value of -%c option!\n", opt);
+			exit(FAILURE);
+		}
+	}
+	if (argc - optind != 1) {
+		printf(vdi_gen_usage_string, argv[0]);
+		exit(argc == 1 ? SUCCESS : FAILURE);
+	}
+	if (!IS_POSITIVE_POWER_OF_2(blk_size) || blk_size < 8 ||
+	    (extra && !IS_POSITIVE_POWER_OF_2(extra)) ||
+	    !IS_POSITIVE_POWER_OF_2(align) || align < VDI_SECTOR_SIZE) {
+		fprintf(stderr, "Sizes must be powers of 2!\n");
+		exit(FAILURE);
+	}
+	if ((uint64_t)size_mb * _1MB / blk_size > UINT32_MAX / 2) {
+		fprintf(stderr, "Too many blocks!\n");
+		exit(FAILURE);
+	}
+	blk_count = (uint64_t)size_mb * _1MB / blk_size;
+	ebs = blk_size + extra;
+	rnd_state = UINT64_C(0x9e3779b97f4a7c15) ^ seed;
+
+	bam = malloc(VDI_BAM_SIZE((size_t)max_u32(blk_count, 1)));
+	p2v = malloc(VDI_BAM_SIZE((size_t)max_u32(blk_count, 1)));
+	per_batch = max_u32(WRITE_BATCH / ebs, 1);
+	buf = malloc((size_t)per_batch * ebs);
+	if (!bam || !p2v || !buf) {
+		fprintf(stderr, "Out of memory!\n");
+		exit(FAILURE);
+	}
+
+	/* Allocate blocks in disk order, then scatter given part of them. */
+	for (i = alloc = 0; i < blk_count; i++) {
+		if (type == VDI_FIXED || chance(fill)) {
+			bam[i] = alloc;
+			p2v[alloc++] = i;
+		} else {
+			bam[i] = VDI_BLK_NONE;
+		}
+	}
+	for (i = 0; i < alloc; i++) {
+		if (!chance(frag))
+			continue;
+		j = rnd() % alloc;
+		tmp = p2v[i];
+		p2v[i] = p2v[j];
+		p2v[j] = tmp;
+		bam[p2v[i]] = i;
+		bam[p2v[j]] = j;
+	}
+
+	memset(&vdi, 0, sizeof(vdi));
+	snprintf(vdi.pre.file_info, sizeof(vdi.pre.file_info),
+	         "<<< vidma synthetic Disk Image >>>\n");
+	vdi.pre.signature = VDI_SIGNATURE;
+	vdi.version = (1 << 16) | 1;
+	vdi.header.size = sizeof(vdi_header_t);
+	vdi.header.type = type;
+	snprintf(vdi.header.comment, sizeof(vdi.header.comment),
+	         "type=%s size=%u block=%u extra=%u fill=%u zero=%u frag=%u",
+	         type == VDI_FIXED ? "fixed" : "dynamic", size_mb, blk_size,
+	         extra, fill, zero, frag);
+	off = ALIGN2((uint64_t)sizeof(vdi_start_t) +
+	             VDI_BAM_SIZE((uint64_t)blk_count), (uint64_t)align);
+	if (off > UINT32_MAX) {
+		fprintf(stderr, "Block allocation map is too big!\n");
+		exit(FAILURE);
+	}
+	vdi.header.offset.bam = sizeof(vdi_start_t);
+	vdi.header.offset.data = off;
+	vdi.header.pchs.sector_size = VDI_SECTOR_SIZE;
+	vdi.header.disk.size = (uint64_t)blk_count * blk_size;
+	vdi.header.disk.blk_size = blk_size;
+	vdi.header.disk.blk_extra_data = extra;
+	vdi.header.disk.blk_count = blk_count;
+	vdi.header.disk.blk_count_alloc = alloc;
+	vdi.header.lchs.sector_size = VDI_SECTOR_SIZE;
+
+	fd = open(argv[optind], O_CREAT | O_TRUNC | O_WRONLY | O_BINARY,
+	          S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH);
+	if (fd < 0) {
+		perror(argv[optind]);
+		exit(FAILURE);
+	}
+	if (write_all(fd, &vdi, sizeof(vdi), 0) != SUCCESS ||
+	    write_all(fd, bam, VDI_BAM_SIZE((size_t)blk_count),
+	              vdi.header.offset.bam) != SUCCESS)
+		goto fail;
+	for (i = 0; i < alloc; i += n) {
+		n = min_u32(per_batch, alloc - i);
+		for (j = 0; j < n; j++)
+			fill_block(buf + (uint64_t)j * ebs, ebs, chance(zero));
+		if (write_all(fd, buf, (size_t)n * ebs, off) != SUCCESS)
+			goto fail;
+		off += (uint64_t)n * ebs;
+	}
+	if (ftruncate(fd, off) || close(fd))
+		goto fail;
+
+	free(buf);
+	free(p2v);
+	free(bam);
+
+	return SUCCESS;
+
+fail:
+	perror(argv[optind]);
+	exit(FAILURE);
+}
@@ -21,6 +21,7 @@
 #include <stddef.h>
 #include <inttypes.h>
 #include <sys/time.h>
+#include <sys/types.h>
 
 /** Value denoting success. */
 #define SUCCESS	0
@@ -89,14 +90,24 @@ static inline uint64_t max_u64(uint64_t a, uint64_t b)
 # define S_IROTH 0
 
 # define fsync _commit
+# define fdatasync _commit
 # define lseek lseek64
 
 /** Returns \a SUCCESS if file behind \p fd1 and \p fd2 is one and the same. */
 int same_file_behind_fds_win(int fd1, int fd2);
 int get_volume_free_space_win(int fd, uint64_t *bytes);
+int get_peak_rss_win(uint64_t *bytes);
+ssize_t pread_win(int fd, void *buf, size_t count, uint64_t offset);
+ssize_t pwrite_win(int fd, const void *buf, size_t count, uint64_t offset);
+void *alloc_aligned_win(size_t alignment, size_t size);
 
 # define same_file_behind_fds same_file_behind_fds_win
 # define get_volume_free_space get_volume_free_space_win
+# define get_peak_rss get_peak_rss_win
+# define pread pread_win
+# define pwrite pwrite_win
+# define alloc_aligned alloc_aligned_win
+# define free_aligned _aligned_free
 
 #else /* !__WIN32__ ~= POSIX */
 
@@ -104,12 +115,21 @@ int get_volume_free_space_win(int fd, uint64_t *bytes);
 # define O_BINARY 0
 # endif
 
+# if __APPLE__
+#  define fdatasync fsync
+# endif
+
 /** Returns \a SUCCESS if file behind \p fd1 and \p fd2 is one and the same. */
 int same_file_behind_fds_posix(int fd1, int fd2);
 int get_volume_free_space_posix(int fd, uint64_t *bytes);
+int get_peak_rss_posix(uint64_t *bytes);
+void *alloc_aligned_posix(size_t alignment, size_t size);
 
 # define same_file_behind_fds same_file_behind_fds_posix
 # define get_volume_free_space get_volume_free_space_posix
+# define get_peak_rss get_peak_rss_posix
+# define alloc_aligned alloc_aligned_posix
+# define free_aligned free
 
 #endif /* __WIN32 __ */
 
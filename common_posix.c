@@ -13,6 +13,9 @@
 
 #include "common.h"
 
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 
@@ -40,3 +43,31 @@ int get_volume_free_space_posix(int fd, uint64_t *bytes)
 
 	return !res ? SUCCESS : FAILURE;
 }
+
+int get_peak_rss_posix(uint64_t *bytes)
+{
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage))
+		return FAILURE;
+#ifdef __APPLE__
+	*bytes = usage.ru_maxrss;
+#else
+	*bytes = (uint64_t)usage.ru_maxrss * 1024;
+#endif
+
+	return SUCCESS;
+}
+
+void *alloc_aligned_posix(size_t alignment, size_t size)
+{
+	void *ptr;
+	int err = posix_memalign(&ptr, alignment, size);
+
+	if (err) {
+		errno = err;
+		return NULL;
+	}
+
+	return ptr;
+}
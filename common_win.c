@@ -12,7 +12,10 @@
  */
 
 #include "common.h"
+#include <errno.h>
+#include <string.h>
 #include <winternl.h>
+#include <psapi.h>
 
 int same_file_behind_fds_win(int fd1, int fd2)
 {
@@ -43,3 +46,73 @@ int get_volume_free_space_win(int fd, uint64_t *bytes)
 
 	return !res ? SUCCESS : FAILURE;
 }
+
+int get_peak_rss_win(uint64_t *bytes)
+{
+	PROCESS_MEMORY_COUNTERS pmc;
+
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+		return FAILURE;
+	*bytes = pmc.PeakWorkingSetSize;
+
+	return SUCCESS;
+}
+
+/* Offset is given to ReadFile()/WriteFile() directly, so (unlike lseek()
+ * followed by read()/write()) threads sharing descriptor don't race for
+ * its position. */
+static void set_offset(OVERLAPPED *ov, uint64_t offset)
+{
+	memset(ov, 0, sizeof(*ov));
+	ov->Offset = (DWORD)offset;
+	ov->OffsetHigh = (DWORD)(offset >> 32);
+}
+
+ssize_t pread_win(int fd, void *buf, size_t count, uint64_t offset)
+{
+	HANDLE handle = (HANDLE)_get_osfhandle(fd);
+	OVERLAPPED ov;
+	DWORD done;
+
+	if (handle == INVALID_HANDLE_VALUE) {
+		errno = EBADF;
+		return -1;
+	}
+	if (count > 0x40000000)
+		count = 0x40000000;
+	set_offset(&ov, offset);
+	if (!ReadFile(handle, buf, (DWORD)count, &done, &ov)) {
+		if (GetLastError() == ERROR_HANDLE_EOF)
+			return 0;
+		errno = EIO;
+		return -1;
+	}
+
+	return done;
+}
+
+ssize_t pwrite_win(int fd, const void *buf, size_t count, uint64_t offset)
+{
+	HANDLE handle = (HANDLE)_get_osfhandle(fd);
+	OVERLAPPED ov;
+	DWORD done;
+
+	if (handle == INVALID_HANDLE_VALUE) {
+		errno = EBADF;
+		return -1;
+	}
+	if (count > 0x40000000)
+		count = 0x40000000;
+	set_offset(&ov, offset);
+	if (!WriteFile(handle, buf, (DWORD)count, &done, &ov)) {
+		errno = GetLastError() == ERROR_DISK_FULL ? ENOSPC : EIO;
+		return -1;
+	}
+
+	return done;
+}
+
+void *alloc_aligned_win(size_t alignment, size_t size)
+{
+	return _aligned_malloc(size, alignment);
+}
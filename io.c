@@ -0,0 +1,1607 @@
+/*
+ * Copyright (C) 2013 Przemyslaw Pawelczyk <przemoc@gmail.com>
+ *
+ * This software is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ * See <http://www.gnu.org/licenses/gpl-2.0.txt>.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#if __linux__
+# define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "io.h"
+#include "simd.h"
+#include "trace.h"
+#include "ui.h"
+
+#if !__WIN32__
+# include <sys/mman.h>
+#endif
+#if __linux__
+# include <sys/ioctl.h>
+# include <sys/sendfile.h>
+# include <linux/falloc.h>
+# include <linux/fs.h>
+#endif
+
+#if __linux__ && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  include <linux/io_uring.h>
+#  include <sys/mman.h>
+#  include <sys/syscall.h>
+#  include <sys/uio.h>
+#  ifdef __NR_io_uring_setup
+#   define HAVE_IO_URING 1
+#  endif
+# endif
+#endif
+
+io_opts_t io_opts = {
+	.window  = IO_DEFAULT_WINDOW,
+	.buffers = IO_DEFAULT_BUFFERS,
+	.threads = 1,
+	.engine  = IO_ENGINE_SYNC,
+	.copy    = IO_COPY_AUTO,
+	.durability = IO_DURABILITY_FULL,
+};
+
+io_stats_t io_stats;
+
+/* ==== Defines and Macros ================================================== */
+
+#define IO_BUFFER_ALIGNMENT 4096
+
+/** Adds \p n to given field of \a io_stats. */
+#define STAT_ADD(field, n) \
+	__atomic_add_fetch(&io_stats.field, (n), __ATOMIC_RELAXED)
+
+/** Maximum number of O_DIRECT descriptors. */
+#define IO_MAX_TWINS 16
+/** Maximum number of buffers kept for reuse. */
+#define IO_POOL_SIZE 8
+
+/** O_DIRECT descriptor of the same file as ordinary one. */
+typedef struct io_twin {
+	int fd;
+	int direct_fd;
+} io_twin_t;
+
+static io_twin_t twins[IO_MAX_TWINS];
+static unsigned twin_count = 0;
+/** Guards twins, as images opened by library come and go at any time. */
+static pthread_rwlock_t twins_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/** Buffer kept for reuse. */
+typedef struct io_pooled {
+	void *buf;
+	uint64_t size;
+} io_pooled_t;
+
+static io_pooled_t pool[IO_POOL_SIZE];
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Schedule of transfers kept by throttle(). */
+typedef struct io_throttle {
+	uint64_t next;          /**< Time when next transfer may start
+	                             (in microseconds). */
+	pthread_mutex_t lock;
+} io_throttle_t;
+
+static io_throttle_t throttle_own = { 0, PTHREAD_MUTEX_INITIALIZER };
+/** Schedule used by throttle(), shared with other processes after
+ * io_share_throttle(). */
+static io_throttle_t *throttle_sched = &throttle_own;
+
+/** Single copy request split into windows. */
+typedef struct io_job {
+	int fin;
+	int fout;
+	uint64_t src;
+	uint64_t dst;
+	uint64_t len;
+	uint64_t window;
+	uint64_t windows;   /**< Number of windows. */
+	uint64_t done;      /**< Bytes written so far. */
+	uint32_t unit;
+	int same_file;
+	int backward;       /**< Windows are processed from the end. */
+	int sparse;         /**< Zero units are not written. */
+	uint32_t *map;      /**< New indices of units, if they are packed. */
+	uint32_t kept;      /**< Non-zero units so far. */
+	int err;            /**< errno of failed operation. */
+	int err_write;      /**< Whether failed operation was write. */
+	uint64_t err_off;   /**< Offset of failed operation. */
+	uint64_t err_len;   /**< Length of failed operation. */
+	uint64_t wb_off;    /**< Offset of range being written back. */
+	uint64_t wb_len;    /**< Length of range being written back. */
+	struct io_job *parent; /**< Job split into shards, if this is one. */
+	ui_ops_t *ui;       /**< UI of thread which started job. */
+	int failed;         /**< Set when job (or any of its shards) failed. */
+} io_job_t;
+
+/** Ring of buffers shared by reader thread and writer. */
+typedef struct io_ring {
+	io_job_t *job;
+	char **buf;
+	unsigned slots;
+	uint64_t filled;    /**< Windows read so far. */
+	uint64_t drained;   /**< Windows written so far. */
+	int failed;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} io_ring_t;
+
+/* ==== Non-exposed functions definitions =================================== */
+
+static void stat_max(uint64_t *field, uint64_t val)
+{
+	uint64_t cur = __atomic_load_n(field, __ATOMIC_RELAXED);
+
+	while (cur < val &&
+	       !__atomic_compare_exchange_n(field, &cur, val, 1,
+	                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* Locks schedule of transfers. Shared one may be left locked by process
+ * which died, what only means its last reservation may be lost. */
+static void lock_throttle()
+{
+#if !__WIN32__
+	if (pthread_mutex_lock(&throttle_sched->lock) == EOWNERDEAD)
+		pthread_mutex_consistent(&throttle_sched->lock);
+#else
+	pthread_mutex_lock(&throttle_sched->lock);
+#endif
+}
+
+/* Keeps transfers within io_opts.bandwidth. Every transfer of \p n bytes
+ * reserves time it takes at given rate and waits until its turn comes. */
+static void throttle(uint64_t n)
+{
+	struct timespec ts;
+	uint64_t now, at;
+	int err = errno;
+
+	if (!io_opts.bandwidth || !n)
+		return;
+	lock_throttle();
+	now = gettimeofday_us();
+	at = max_u64(throttle_sched->next, now);
+	throttle_sched->next = at + n * 1000000 / io_opts.bandwidth;
+	pthread_mutex_unlock(&throttle_sched->lock);
+	if (at <= now)
+		return;
+	ts.tv_sec = (at - now) / 1000000;
+	ts.tv_nsec = (at - now) % 1000000 * 1000;
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+	errno = err;
+}
+
+/* Returns O_DIRECT twin of fd, if there is one and request is aligned
+ * enough for it, or -1. */
+static int direct_fd(int fd, const void *buf, uint64_t len, uint64_t off)
+{
+	unsigned i;
+	int dfd = -1;
+
+	if (!__atomic_load_n(&twin_count, __ATOMIC_RELAXED) ||
+	    (((uintptr_t)buf | len | off) & (IO_BUFFER_ALIGNMENT - 1)))
+		return -1;
+	pthread_rwlock_rdlock(&twins_lock);
+	for (i = 0; i < twin_count; i++) {
+		if (twins[i].fd == fd) {
+			dfd = twins[i].direct_fd;
+			break;
+		}
+	}
+	pthread_rwlock_unlock(&twins_lock);
+
+	return dfd;
+}
+
+/* Asks kernel to drop given range from page cache (in direct mode only).
+ * Dirty pages are written back first, so they go away a bit later. */
+static void drop_cache(int fd, uint64_t off, uint64_t len)
+{
+#ifdef POSIX_FADV_DONTNEED
+	if (!io_opts.direct)
+		return;
+	posix_fadvise(fd, off, len, POSIX_FADV_DONTNEED);
+	STAT_ADD(other_calls, 1);
+#endif
+}
+
+/* Flushes fd (only data and metadata needed to retrieve it, if data_only is
+ * set), measuring how long it took. */
+static int sync_fd(int fd, int data_only)
+{
+	uint64_t start = gettimeofday_us();
+	uint64_t took;
+	int res = data_only ? fdatasync(fd) : fsync(fd);
+	int err = errno;
+
+	took = gettimeofday_us() - start;
+	trace_span("sync", data_only ? "fdatasync" : "fsync", start, 0, 0);
+	drop_cache(fd, 0, 0);
+	STAT_ADD(fsyncs, 1);
+	STAT_ADD(fsync_us, took);
+	stat_max(&io_stats.fsync_max_us, took);
+	errno = err;
+
+	return !res ? SUCCESS : FAILURE;
+}
+
+static inline uint64_t window_size(uint32_t unit)
+{
+	if (!unit)
+		return io_opts.window;
+
+	return max_u64(io_opts.window / unit, 1) * unit;
+}
+
+static void window_at(io_job_t *job, uint64_t k, uint64_t *off, uint64_t *n)
+{
+	uint64_t done = k * job->window;
+
+	*n = min_u64(job->window, job->len - done);
+	*off = job->backward ? job->len - done - *n : done;
+}
+
+static int job_fail(io_job_t *job, int write, uint64_t off, uint64_t n)
+{
+	job->err = errno;
+	job->err_write = write;
+	job->err_off = off;
+	job->err_len = n;
+
+	return FAILURE;
+}
+
+static int job_read(io_job_t *job, char *buffer, uint64_t k)
+{
+	uint64_t off, n;
+
+	window_at(job, k, &off, &n);
+	if (io_pread(job->fin, buffer, n, job->src + off) != SUCCESS)
+		return job_fail(job, 0, job->src + off, n);
+
+	return SUCCESS;
+}
+
+/* Starts writeback of range just written and waits for the previous one,
+ * so dirty pages don't pile up behind write cursor and final sync is short.
+ */
+static void job_writeback(io_job_t *job, uint64_t off, uint64_t len)
+{
+#if __linux__ && defined(SYNC_FILE_RANGE_WRITE)
+	uint64_t start;
+
+	if (io_opts.durability == IO_DURABILITY_NONE || !len)
+		return;
+	start = trace_now();
+	if (job->wb_len) {
+		sync_file_range(job->fout, job->wb_off, job->wb_len,
+		                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+		                SYNC_FILE_RANGE_WAIT_AFTER);
+		STAT_ADD(other_calls, 1);
+		drop_cache(job->fout, job->wb_off, job->wb_len);
+	}
+	sync_file_range(job->fout, off, len, SYNC_FILE_RANGE_WRITE);
+	STAT_ADD(other_calls, 1);
+	trace_span("sync", "writeback", start, job->wb_off, job->wb_len);
+	job->wb_off = off;
+	job->wb_len = len;
+#endif
+}
+
+static void job_progress(io_job_t *job, uint64_t n)
+{
+	uint64_t done;
+
+	job->done += n;
+	if (job->parent)
+		done = __atomic_add_fetch(&job->parent->done, n, __ATOMIC_RELAXED);
+	else
+		done = job->done;
+	ui_add_step_bytes(n);
+	if (job->unit)
+		ui->set_step_prog_val(done / job->unit);
+}
+
+/* Whether shard should give up, because one of its siblings failed. */
+static inline int job_stopped(io_job_t *job)
+{
+	return job->parent &&
+	       __atomic_load_n(&job->parent->failed, __ATOMIC_RELAXED);
+}
+
+static int punch_hole(int fd, uint64_t off, uint64_t len)
+{
+#if __linux__ && defined(FALLOC_FL_PUNCH_HOLE)
+	uint64_t start = trace_now();
+	int res;
+
+	res = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len);
+	STAT_ADD(other_calls, 1);
+	trace_span("io", "punch", start, off, len);
+
+	return !res ? SUCCESS : FAILURE;
+#else
+	return FAILURE;
+#endif
+}
+
+/* Writes runs of non-zero units, while runs of zero units are punched out
+ * of destination or, if units are packed, simply skipped. */
+static int job_write_sparse(io_job_t *job, char *buffer, uint64_t k)
+{
+	uint64_t off, n, at, len;
+	uint32_t i, j, u;
+	uint32_t unit = job->unit;
+	uint32_t units;
+	uint32_t first;
+	uint32_t kept = job->kept;
+	int zero;
+
+	window_at(job, k, &off, &n);
+	units = n / unit;
+	first = off / unit;
+	for (i = 0; i < units; i = j) {
+		zero = mem_is_zero(buffer + (uint64_t)i * unit, unit);
+		for (j = i + 1; j < units; j++)
+			if (mem_is_zero(buffer + (uint64_t)j * unit, unit) != zero)
+				break;
+		len = (uint64_t)(j - i) * unit;
+
+		if (job->map) {
+			for (u = i; u < j; u++)
+				job->map[first + u] = zero ? IO_ZERO_UNIT
+				                           : job->kept + (u - i);
+			at = job->dst + (uint64_t)job->kept * unit;
+			if (zero)
+				continue;
+		} else {
+			at = job->dst + off + (uint64_t)i * unit;
+			if (zero && punch_hole(job->fout, at, len) == SUCCESS)
+				continue;
+		}
+		if (io_pwrite(job->fout, buffer + (uint64_t)i * unit, len, at) != SUCCESS)
+			return job_fail(job, 1, at, len);
+		if (!zero)
+			job->kept += j - i;
+	}
+	if (job->map)
+		job_writeback(job, job->dst + (uint64_t)kept * unit,
+		              (uint64_t)(job->kept - kept) * unit);
+	else
+		job_writeback(job, job->dst + off, n);
+	job_progress(job, n);
+
+	return SUCCESS;
+}
+
+static int job_write(io_job_t *job, char *buffer, uint64_t k)
+{
+	uint64_t off, n;
+
+	if (job->sparse)
+		return job_write_sparse(job, buffer, k);
+
+	window_at(job, k, &off, &n);
+	if (io_pwrite(job->fout, buffer, n, job->dst + off) != SUCCESS)
+		return job_fail(job, 1, job->dst + off, n);
+	job_writeback(job, job->dst + off, n);
+	job_progress(job, n);
+
+	return SUCCESS;
+}
+
+static int copy_sequential(io_job_t *job)
+{
+	char *buffer;
+	uint64_t size = min_u64(job->window, job->len);
+	uint64_t k;
+	int res = SUCCESS;
+
+	buffer = io_buf_alloc(size);
+	if (!buffer)
+		return job_fail(job, 0, job->src, job->window);
+
+	for (k = 0; k < job->windows && res == SUCCESS; k++) {
+		if (job_stopped(job))
+			break;
+		res = job_read(job, buffer, k);
+		if (res == SUCCESS)
+			res = job_write(job, buffer, k);
+	}
+	io_buf_free(buffer, size);
+
+	return res;
+}
+
+static void *shard_worker(void *arg)
+{
+	io_job_t *shard = arg;
+
+	ui = shard->ui;
+	if (copy_sequential(shard) != SUCCESS) {
+		shard->failed = 1;
+		__atomic_store_n(&shard->parent->failed, 1, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+/* Splits windows into contiguous shards copied by separate threads, each
+ * with its own buffer and writeback. Used only between different files and
+ * when units are not packed, as shards cannot depend on each other.
+ */
+static int copy_parallel(io_job_t *job)
+{
+	unsigned n = min_u64(io_opts.threads, job->windows);
+	uint64_t per = job->windows / n;
+	uint64_t first = 0, off;
+	io_job_t *shards;
+	pthread_t *threads;
+	unsigned i, started;
+	int res = SUCCESS;
+
+	shards = calloc(n, sizeof(*shards));
+	threads = calloc(n, sizeof(*threads));
+	if (!shards || !threads) {
+		free(threads);
+		free(shards);
+		return job_fail(job, 0, job->src, job->window);
+	}
+	for (i = 0; i < n; i++) {
+		shards[i] = *job;
+		off = first * job->window;
+		shards[i].parent = job;
+		shards[i].src += off;
+		shards[i].dst += off;
+		shards[i].windows = per + (i < job->windows % n);
+		shards[i].len = min_u64(shards[i].windows * job->window,
+		                        job->len - off);
+		shards[i].done = 0;
+		shards[i].kept = 0;
+		first += shards[i].windows;
+	}
+
+	for (started = 0; started < n; started++) {
+		errno = pthread_create(&threads[started], NULL, shard_worker,
+		                       &shards[started]);
+		if (errno) {
+			res = job_fail(job, 0, shards[started].src, shards[started].len);
+			__atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+		if (shards[i].failed && res == SUCCESS) {
+			job->err = shards[i].err;
+			job->err_write = shards[i].err_write;
+			job->err_off = shards[i].err_off;
+			job->err_len = shards[i].err_len;
+			res = FAILURE;
+		}
+		job->kept += shards[i].kept;
+	}
+	free(threads);
+	free(shards);
+
+	return res;
+}
+
+static void *ring_reader(void *arg)
+{
+	io_ring_t *ring = arg;
+	uint64_t k;
+	int failed;
+
+	for (k = 0; k < ring->job->windows; k++) {
+		pthread_mutex_lock(&ring->lock);
+		while (!ring->failed && k - ring->drained >= ring->slots)
+			pthread_cond_wait(&ring->cond, &ring->lock);
+		failed = ring->failed;
+		pthread_mutex_unlock(&ring->lock);
+		if (failed)
+			break;
+
+		failed = job_read(ring->job, ring->buf[k % ring->slots], k);
+
+		pthread_mutex_lock(&ring->lock);
+		if (failed)
+			ring->failed = 1;
+		else
+			ring->filled++;
+		pthread_cond_broadcast(&ring->cond);
+		pthread_mutex_unlock(&ring->lock);
+		if (failed)
+			break;
+	}
+
+	return NULL;
+}
+
+/* Reader thread fills the ring, while calling thread drains it. Windows
+ * are read and written in the same order, and every window is read before
+ * it is written, so it is safe even for overlapping ranges as long as
+ * sequential copy is.
+ */
+static int copy_pipelined(io_job_t *job)
+{
+	io_ring_t ring;
+	pthread_t reader;
+	uint64_t k;
+	unsigned i;
+	int failed = 0;
+
+	ring.job = job;
+	ring.slots = min_u64(io_opts.buffers, job->windows);
+	ring.filled = 0;
+	ring.drained = 0;
+	ring.failed = 0;
+	ring.buf = calloc(ring.slots, sizeof(*ring.buf));
+	if (!ring.buf)
+		return job_fail(job, 0, job->src, job->window);
+	for (i = 0; i < ring.slots; i++) {
+		ring.buf[i] = io_buf_alloc(job->window);
+		if (!ring.buf[i]) {
+			job_fail(job, 0, job->src, job->window);
+			while (i--)
+				io_buf_free(ring.buf[i], job->window);
+			free(ring.buf);
+			return FAILURE;
+		}
+	}
+	pthread_mutex_init(&ring.lock, NULL);
+	pthread_cond_init(&ring.cond, NULL);
+
+	if ((errno = pthread_create(&reader, NULL, ring_reader, &ring))) {
+		failed = job_fail(job, 0, job->src, job->window);
+	} else {
+		for (k = 0; k < job->windows; k++) {
+			pthread_mutex_lock(&ring.lock);
+			while (!ring.failed && ring.filled <= k)
+				pthread_cond_wait(&ring.cond, &ring.lock);
+			failed = ring.failed && ring.filled <= k;
+			pthread_mutex_unlock(&ring.lock);
+			if (failed)
+				break;
+
+			failed = job_write(job, ring.buf[k % ring.slots], k);
+
+			pthread_mutex_lock(&ring.lock);
+			if (failed)
+				ring.failed = 1;
+			else
+				ring.drained++;
+			pthread_cond_broadcast(&ring.cond);
+			pthread_mutex_unlock(&ring.lock);
+			if (failed)
+				break;
+		}
+		pthread_join(reader, NULL);
+	}
+
+	pthread_cond_destroy(&ring.cond);
+	pthread_mutex_destroy(&ring.lock);
+	for (i = 0; i < ring.slots; i++)
+		io_buf_free(ring.buf[i], job->window);
+	free(ring.buf);
+
+	return failed ? FAILURE : SUCCESS;
+}
+
+static int scan_sync(int fd, uint64_t off, uint64_t len,
+                     io_scan_cb_t cb, void *ctx)
+{
+	char *buffer;
+	uint64_t size = min_u64(IO_SCAN_CHUNK, len);
+	uint64_t done, n;
+	int res = SUCCESS;
+
+	buffer = io_buf_alloc(size);
+	if (!buffer)
+		return FAILURE;
+	for (done = 0; done < len && res == SUCCESS; done += n) {
+		n = min_u64(IO_SCAN_CHUNK, len - done);
+		res = io_pread(fd, buffer, n, off + done);
+		ui_add_step_bytes(n);
+		if (res == SUCCESS)
+			res = cb(buffer, done, n, ctx);
+	}
+	io_buf_free(buffer, size);
+
+	return res;
+}
+
+#if __linux__
+
+static int clone_range(io_job_t *job, uint64_t off, uint64_t n)
+{
+#ifdef FICLONERANGE
+	struct file_clone_range range = {
+		.src_fd      = job->fin,
+		.src_offset  = job->src + off,
+		.src_length  = n,
+		.dest_offset = job->dst + off,
+	};
+	uint64_t start = trace_now();
+	int res;
+
+	res = ioctl(job->fout, FICLONERANGE, &range);
+	STAT_ADD(other_calls, 1);
+	trace_span("io", "clone", start, job->dst + off, n);
+	if (res)
+		return FAILURE;
+	STAT_ADD(kernel_bytes, n);
+
+	return SUCCESS;
+#else
+	return FAILURE;
+#endif
+}
+
+static int copy_range(io_job_t *job, uint64_t off, uint64_t n)
+{
+	ssize_t ret;
+	loff_t in = job->src + off;
+	loff_t out = job->dst + off;
+	uint64_t start;
+
+	/* Kernel both reads and writes. */
+	throttle(2 * n);
+	while (n) {
+		start = trace_now();
+		ret = copy_file_range(job->fin, &in, job->fout, &out, n, 0);
+		STAT_ADD(other_calls, 1);
+		trace_span("io", "copy_file_range", start, out, n);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return FAILURE;
+		STAT_ADD(kernel_bytes, ret);
+		n -= ret;
+	}
+
+	return SUCCESS;
+}
+
+/* Asks kernel to copy as many windows as possible, preferring reflinks
+ * (shared extents) over in-kernel copying. Stops at first window neither
+ * method could handle, leaving the rest for buffered copy.
+ */
+static void copy_kernel(io_job_t *job)
+{
+	uint64_t k, off, n;
+	int clone = io_opts.copy == IO_COPY_AUTO;
+
+	for (k = 0; k < job->windows; k++) {
+		window_at(job, k, &off, &n);
+		if (clone && clone_range(job, off, n) == SUCCESS) {
+			job_progress(job, n);
+			continue;
+		}
+		clone = 0;
+		if (io_opts.direct || copy_range(job, off, n) != SUCCESS)
+			break;
+		job_progress(job, n);
+	}
+}
+
+#endif /* __linux__ */
+
+#if HAVE_IO_URING
+
+/* Minimal io_uring wrapper. Every slot has at most one request in flight,
+ * so submission queue never overflows if it has as many entries as slots.
+ */
+
+/** Mapped io_uring instance. */
+typedef struct uring {
+	int fd;
+	unsigned entries;
+	unsigned pending;   /**< Prepared, but not submitted SQEs. */
+	unsigned inflight;  /**< Submitted requests without completion. */
+	int fixed;          /**< Whether slot buffers are registered. */
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr;
+	void *cq_ptr;
+	size_t sq_size;
+	size_t cq_size;
+	size_t sqes_size;
+} uring_t;
+
+/** Buffer with request using it. */
+typedef struct uring_slot {
+	char *buf;
+	uint64_t k;         /**< Window (or chunk) number. */
+	uint64_t off;       /**< File offset of whole request. */
+	uint64_t len;       /**< Length of whole request. */
+	uint64_t done;      /**< Bytes already transferred. */
+	uint64_t start;     /**< Submission time of request (for trace). */
+	int state;
+} uring_slot_t;
+
+enum uring_slot_state {
+	SLOT_FREE = 0,
+	SLOT_READING,
+	SLOT_READ,
+	SLOT_WRITING,
+};
+
+static void uring_exit(uring_t *r)
+{
+	if (r->sqes)
+		munmap(r->sqes, r->sqes_size);
+	if (r->cq_ptr && r->cq_ptr != r->sq_ptr)
+		munmap(r->cq_ptr, r->cq_size);
+	if (r->sq_ptr)
+		munmap(r->sq_ptr, r->sq_size);
+	close(r->fd);
+}
+
+static int uring_init(uring_t *r, uring_slot_t *slots, unsigned n,
+                      uint64_t size)
+{
+	struct io_uring_params p;
+	struct iovec *iov;
+	unsigned i;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, n, &p);
+	if (r->fd < 0)
+		return FAILURE;
+	r->entries = p.sq_entries;
+
+	r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->sq_size = r->cq_size = max_u64(r->sq_size, r->cq_size);
+	r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+	                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ptr == MAP_FAILED) {
+		r->sq_ptr = NULL;
+		goto fail;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ptr = r->sq_ptr;
+	} else {
+		r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+		                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ptr == MAP_FAILED) {
+			r->cq_ptr = NULL;
+			goto fail;
+		}
+	}
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+	               MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		goto fail;
+	}
+
+	r->sq_tail = (unsigned *)((char *)r->sq_ptr + p.sq_off.tail);
+	r->sq_mask = (unsigned *)((char *)r->sq_ptr + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)((char *)r->sq_ptr + p.sq_off.array);
+	r->cq_head = (unsigned *)((char *)r->cq_ptr + p.cq_off.head);
+	r->cq_tail = (unsigned *)((char *)r->cq_ptr + p.cq_off.tail);
+	r->cq_mask = (unsigned *)((char *)r->cq_ptr + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *)r->cq_ptr + p.cq_off.cqes);
+
+	/* Registered buffers are optional, e.g. RLIMIT_MEMLOCK may forbid them. */
+	iov = calloc(n, sizeof(*iov));
+	if (iov) {
+		for (i = 0; i < n; i++) {
+			iov[i].iov_base = slots[i].buf;
+			iov[i].iov_len = size;
+		}
+		r->fixed = !syscall(__NR_io_uring_register, r->fd,
+		                    IORING_REGISTER_BUFFERS, iov, n);
+		free(iov);
+	}
+
+	return SUCCESS;
+
+fail:
+	uring_exit(r);
+	return FAILURE;
+}
+
+static void uring_prep(uring_t *r, uring_slot_t *slots, unsigned i,
+                       int write, int fd)
+{
+	uring_slot_t *slot = &slots[i];
+	unsigned tail = *r->sq_tail;
+	unsigned idx = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	if (r->fixed) {
+		sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->buf_index = i;
+	} else {
+		sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	}
+	sqe->fd = direct_fd(fd, slot->buf + slot->done, slot->len - slot->done,
+	                    slot->off + slot->done);
+	if (sqe->fd < 0)
+		sqe->fd = fd;
+	sqe->addr = (uintptr_t)(slot->buf + slot->done);
+	sqe->len = slot->len - slot->done;
+	sqe->off = slot->off + slot->done;
+	sqe->user_data = i;
+	throttle(sqe->len);
+	slot->start = trace_now();
+	r->sq_array[idx] = idx;
+	if (write)
+		STAT_ADD(writes, 1);
+	else
+		STAT_ADD(reads, 1);
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->pending++;
+}
+
+/* Submits prepared requests and waits for at least one completion. */
+static int uring_enter(uring_t *r)
+{
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, r->fd, r->pending, 1,
+		              IORING_ENTER_GETEVENTS, NULL, 0);
+		STAT_ADD(other_calls, 1);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return FAILURE;
+	r->inflight += ret;
+	r->pending -= ret;
+
+	return SUCCESS;
+}
+
+/* Takes next completion, if there is any. */
+static int uring_reap(uring_t *r, unsigned *slot, int *res)
+{
+	unsigned head = *r->cq_head;
+	struct io_uring_cqe *cqe;
+
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		return 0;
+	cqe = &r->cqes[head & *r->cq_mask];
+	*slot = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+	r->inflight--;
+
+	return 1;
+}
+
+/* Waits for all requests in flight, so their buffers can be freed. */
+static void uring_drain(uring_t *r)
+{
+	unsigned slot;
+	int res;
+
+	while (r->inflight || r->pending) {
+		if (uring_enter(r) != SUCCESS)
+			break;
+		while (uring_reap(r, &slot, &res))
+			;
+	}
+}
+
+static uring_slot_t *uring_slots_alloc(unsigned n, uint64_t size)
+{
+	uring_slot_t *slots = calloc(n, sizeof(*slots));
+	unsigned i;
+
+	if (!slots)
+		return NULL;
+	for (i = 0; i < n; i++) {
+		slots[i].buf = io_buf_alloc(size);
+		if (!slots[i].buf) {
+			while (i--)
+				io_buf_free(slots[i].buf, size);
+			free(slots);
+			return NULL;
+		}
+	}
+
+	return slots;
+}
+
+static void uring_slots_free(uring_slot_t *slots, unsigned n, uint64_t size)
+{
+	unsigned i;
+
+	for (i = 0; i < n; i++)
+		io_buf_free(slots[i].buf, size);
+	free(slots);
+}
+
+/* Updates slot after completion. Returns 1 if whole request is done,
+ * 0 if it has to be resubmitted and -1 on error.
+ */
+static int uring_slot_advance(uring_slot_t *slot, int res)
+{
+	if (res < 0) {
+		errno = -res;
+		return -1;
+	}
+	if (res == 0) {
+		errno = EIO;
+		return -1;
+	}
+	slot->done += res;
+
+	return slot->done == slot->len;
+}
+
+/* Keeps up to io_opts.buffers windows in flight. Write of a window is
+ * issued only when all windows up to it have been read, which preserves
+ * the guarantees of sequential copy for overlapping ranges.
+ */
+static int copy_uring(io_job_t *job)
+{
+	uring_t r;
+	uring_slot_t *slots;
+	unsigned n = min_u64(max_u32(io_opts.buffers, 1), job->windows);
+	uint64_t next = 0;      /* next window to read */
+	uint64_t written = 0;   /* windows written */
+	uint64_t read_upto;     /* all windows below were read */
+	unsigned i;
+	int res, ret, failed = 0;
+
+	slots = uring_slots_alloc(n, job->window);
+	if (!slots)
+		return job_fail(job, 0, job->src, job->window);
+	if (uring_init(&r, slots, n, job->window) != SUCCESS) {
+		uring_slots_free(slots, n, job->window);
+		return copy_sequential(job);
+	}
+
+	while (written < job->windows && !failed) {
+		for (i = 0; i < n && next < job->windows; i++) {
+			if (slots[i].state != SLOT_FREE)
+				continue;
+			slots[i].k = next++;
+			window_at(job, slots[i].k, &slots[i].off, &slots[i].len);
+			slots[i].off += job->src;
+			slots[i].done = 0;
+			slots[i].state = SLOT_READING;
+			uring_prep(&r, slots, i, 0, job->fin);
+		}
+		read_upto = next;
+		for (i = 0; i < n; i++)
+			if (slots[i].state == SLOT_READING && slots[i].k < read_upto)
+				read_upto = slots[i].k;
+		for (i = 0; i < n; i++) {
+			if (slots[i].state != SLOT_READ || slots[i].k >= read_upto)
+				continue;
+			window_at(job, slots[i].k, &slots[i].off, &slots[i].len);
+			slots[i].off += job->dst;
+			slots[i].done = 0;
+			slots[i].state = SLOT_WRITING;
+			uring_prep(&r, slots, i, 1, job->fout);
+		}
+
+		if (uring_enter(&r) != SUCCESS) {
+			failed = job_fail(job, 0, job->src, job->window);
+			break;
+		}
+		while (uring_reap(&r, &i, &res)) {
+			uring_slot_t *slot = &slots[i];
+			int write = slot->state == SLOT_WRITING;
+
+			if (res > 0 && write)
+				STAT_ADD(write_bytes, res);
+			else if (res > 0)
+				STAT_ADD(read_bytes, res);
+			trace_span("io", write ? "write" : "read", slot->start,
+			           slot->off + slot->done, slot->len - slot->done);
+			ret = uring_slot_advance(slot, res);
+			if (ret < 0) {
+				failed = job_fail(job, write, slot->off, slot->len);
+				slot->state = SLOT_FREE;
+			} else if (!ret && !failed) {
+				uring_prep(&r, slots, i, write,
+				           write ? job->fout : job->fin);
+			} else if (write) {
+				slot->state = SLOT_FREE;
+				written++;
+				job_writeback(job, slot->off, slot->len);
+				job_progress(job, slot->len);
+			} else {
+				slot->state = SLOT_READ;
+			}
+		}
+	}
+
+	uring_drain(&r);
+	uring_exit(&r);
+	uring_slots_free(slots, n, job->window);
+
+	return failed ? FAILURE : SUCCESS;
+}
+
+/* Reads chunks ahead, but hands them to callback in order. */
+static int scan_uring(int fd, uint64_t off, uint64_t len,
+                      io_scan_cb_t cb, void *ctx)
+{
+	uring_t r;
+	uring_slot_t *slots;
+	uint64_t chunks = (len + IO_SCAN_CHUNK - 1) / IO_SCAN_CHUNK;
+	unsigned n = min_u64(max_u32(io_opts.buffers, 1), chunks);
+	uint64_t next = 0;      /* next chunk to read */
+	uint64_t passed = 0;    /* chunks passed to callback */
+	unsigned i;
+	int res, ret, failed = 0;
+
+	slots = uring_slots_alloc(n, IO_SCAN_CHUNK);
+	if (!slots)
+		return FAILURE;
+	if (uring_init(&r, slots, n, IO_SCAN_CHUNK) != SUCCESS) {
+		uring_slots_free(slots, n, IO_SCAN_CHUNK);
+		return scan_sync(fd, off, len, cb, ctx);
+	}
+
+	while (passed < chunks && !failed) {
+		/* Chunk k always uses slot (k % n) and slots are freed in order,
+		 * so the next chunk to pass is always in slot (passed % n). */
+		while (next < chunks && slots[next % n].state == SLOT_FREE) {
+			i = next % n;
+			slots[i].k = next++;
+			slots[i].off = off + slots[i].k * IO_SCAN_CHUNK;
+			slots[i].len = min_u64(IO_SCAN_CHUNK,
+			                       len - slots[i].k * IO_SCAN_CHUNK);
+			slots[i].done = 0;
+			slots[i].state = SLOT_READING;
+			uring_prep(&r, slots, i, 0, fd);
+		}
+		if (uring_enter(&r) != SUCCESS) {
+			failed = 1;
+			break;
+		}
+		while (uring_reap(&r, &i, &res)) {
+			if (res > 0)
+				STAT_ADD(read_bytes, res);
+			trace_span("io", "read", slots[i].start,
+			           slots[i].off + slots[i].done,
+			           slots[i].len - slots[i].done);
+			ret = uring_slot_advance(&slots[i], res);
+			if (ret < 0)
+				failed = 1;
+			else if (!ret && !failed)
+				uring_prep(&r, slots, i, 0, fd);
+			else
+				slots[i].state = SLOT_READ;
+		}
+		while (!failed && passed < chunks &&
+		       slots[passed % n].state == SLOT_READ) {
+			i = passed % n;
+			ui_add_step_bytes(slots[i].len);
+			failed = cb(slots[i].buf, slots[i].off - off,
+			            slots[i].len, ctx) != SUCCESS;
+			slots[i].state = SLOT_FREE;
+			passed++;
+		}
+	}
+
+	uring_drain(&r);
+	uring_exit(&r);
+	uring_slots_free(slots, n, IO_SCAN_CHUNK);
+
+	return failed ? FAILURE : SUCCESS;
+}
+
+#endif /* HAVE_IO_URING */
+
+/* Sends data through buffer, where kernel cannot do it. */
+static int send_buffered(int sock, int fd, size_t len, uint64_t off)
+{
+	char buf[64 * 1024];
+	const char *p;
+	size_t n;
+	ssize_t ret;
+
+	for (; len; len -= n, off += n) {
+		n = min_u64(len, sizeof(buf));
+		if (io_pread(fd, buf, n, off) != SUCCESS)
+			return FAILURE;
+		for (p = buf; p < buf + n; p += ret) {
+			ret = write(sock, p, buf + n - p);
+			if (ret < 0 && errno == EINTR)
+				ret = 0;
+			else if (ret <= 0)
+				return FAILURE;
+		}
+	}
+
+	return SUCCESS;
+}
+
+/* ==== Exposed functions definitions ======================================= */
+
+void *io_buf_alloc(uint64_t size)
+{
+	void *buf = NULL;
+	unsigned i;
+
+	pthread_mutex_lock(&pool_lock);
+	for (i = 0; i < IO_POOL_SIZE; i++) {
+		if (pool[i].buf && pool[i].size == size) {
+			buf = pool[i].buf;
+			pool[i].buf = NULL;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pool_lock);
+	if (!buf)
+		buf = alloc_aligned(IO_BUFFER_ALIGNMENT, size);
+	if (buf)
+		stat_max(&io_stats.buf_peak, STAT_ADD(buf_bytes, size));
+
+	return buf;
+}
+
+void io_buf_free(void *buf, uint64_t size)
+{
+	unsigned i;
+
+	if (!buf)
+		return;
+	__atomic_sub_fetch(&io_stats.buf_bytes, size, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&pool_lock);
+	for (i = 0; i < IO_POOL_SIZE; i++) {
+		if (!pool[i].buf) {
+			pool[i].buf = buf;
+			pool[i].size = size;
+			buf = NULL;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pool_lock);
+	free_aligned(buf);
+}
+
+void io_buf_release()
+{
+	unsigned i;
+
+	pthread_mutex_lock(&pool_lock);
+	for (i = 0; i < IO_POOL_SIZE; i++) {
+		free_aligned(pool[i].buf);
+		pool[i].buf = NULL;
+	}
+	pthread_mutex_unlock(&pool_lock);
+}
+
+int io_open_direct(int fd, const char *path)
+{
+#ifdef O_DIRECT
+	int flags = fcntl(fd, F_GETFL);
+	int dfd = -1;
+	int added = 0;
+
+	if (flags >= 0)
+		dfd = open(path, (flags & O_ACCMODE) | O_DIRECT | O_BINARY);
+	if (dfd >= 0) {
+		pthread_rwlock_wrlock(&twins_lock);
+		if (twin_count < IO_MAX_TWINS) {
+			twins[twin_count].fd = fd;
+			twins[twin_count].direct_fd = dfd;
+			__atomic_store_n(&twin_count, twin_count + 1,
+			                 __ATOMIC_RELAXED);
+			added = 1;
+		}
+		pthread_rwlock_unlock(&twins_lock);
+		if (added)
+			return SUCCESS;
+		close(dfd);
+	}
+#endif
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	return FAILURE;
+}
+
+void io_close_direct()
+{
+	pthread_rwlock_wrlock(&twins_lock);
+	while (twin_count)
+		close(twins[--twin_count].direct_fd);
+	pthread_rwlock_unlock(&twins_lock);
+}
+
+void io_close_direct_of(int fd)
+{
+	unsigned i;
+
+	pthread_rwlock_wrlock(&twins_lock);
+	for (i = 0; i < twin_count; i++) {
+		if (twins[i].fd == fd) {
+			close(twins[i].direct_fd);
+			twins[i] = twins[twin_count - 1];
+			__atomic_store_n(&twin_count, twin_count - 1,
+			                 __ATOMIC_RELAXED);
+			break;
+		}
+	}
+	pthread_rwlock_unlock(&twins_lock);
+}
+
+int io_pread(int fd, void *buf, size_t len, uint64_t off)
+{
+	ssize_t n;
+	char *p = buf;
+	uint64_t start;
+	int dfd;
+
+	throttle(len);
+	while (len) {
+		start = trace_now();
+		dfd = direct_fd(fd, p, len, off);
+		n = pread(dfd >= 0 ? dfd : fd, p, len, off);
+		STAT_ADD(reads, 1);
+		trace_span("io", dfd >= 0 ? "read (direct)" : "read", start, off, len);
+		if (dfd < 0 && n > 0)
+			drop_cache(fd, off, n);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (!n)
+			errno = EIO;
+		if (n <= 0)
+			return FAILURE;
+		STAT_ADD(read_bytes, n);
+		p += n;
+		len -= n;
+		off += n;
+	}
+
+	return SUCCESS;
+}
+
+int io_pwrite(int fd, const void *buf, size_t len, uint64_t off)
+{
+	ssize_t n;
+	const char *p = buf;
+	uint64_t start;
+	int dfd;
+
+	throttle(len);
+	while (len) {
+		start = trace_now();
+		dfd = direct_fd(fd, p, len, off);
+		n = pwrite(dfd >= 0 ? dfd : fd, p, len, off);
+		STAT_ADD(writes, 1);
+		trace_span("io", dfd >= 0 ? "write (direct)" : "write", start, off,
+		           len);
+		if (dfd < 0 && n > 0)
+			drop_cache(fd, off, n);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (!n)
+			errno = EIO;
+		if (n <= 0)
+			return FAILURE;
+		STAT_ADD(write_bytes, n);
+		p += n;
+		len -= n;
+		off += n;
+	}
+
+	return SUCCESS;
+}
+
+int io_send(int sock, int fd, size_t len, uint64_t off)
+{
+#if __linux__
+	ssize_t n;
+	off_t pos = off;
+	uint64_t start, first = off;
+
+	throttle(len);
+	while (len) {
+		start = trace_now();
+		n = sendfile(sock, fd, &pos, len);
+		STAT_ADD(other_calls, 1);
+		trace_span("io", "sendfile", start, off, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		/* Not supported for this file, nothing sent yet. */
+		if (n < 0 && (errno == EINVAL || errno == ENOSYS) &&
+		    off == first)
+			return send_buffered(sock, fd, len, off);
+		if (!n)
+			errno = EIO;
+		if (n <= 0)
+			return FAILURE;
+		STAT_ADD(kernel_bytes, n);
+		len -= n;
+		off += n;
+	}
+
+	return SUCCESS;
+#else
+	return send_buffered(sock, fd, len, off);
+#endif
+}
+
+int io_fsync(int fd)
+{
+	return sync_fd(fd, 0);
+}
+
+int io_sync_needed(int barrier)
+{
+	switch (io_opts.durability) {
+	case IO_DURABILITY_NONE:
+		return 0;
+	case IO_DURABILITY_ORDERED:
+		return barrier;
+	default:
+		return 1;
+	}
+}
+
+int io_sync(int fd, int barrier)
+{
+	if (!io_sync_needed(barrier))
+		return SUCCESS;
+
+	return sync_fd(fd, io_opts.durability == IO_DURABILITY_ORDERED);
+}
+
+void io_stats_get(io_stats_t *stats)
+{
+	const uint64_t *src = (const uint64_t *)&io_stats;
+	uint64_t *dst = (uint64_t *)stats;
+	size_t i;
+
+	for (i = 0; i < sizeof(*stats) / sizeof(uint64_t); i++)
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
+
+void io_stats_reset_peaks()
+{
+	__atomic_store_n(&io_stats.buf_peak,
+	                 __atomic_load_n(&io_stats.buf_bytes, __ATOMIC_RELAXED),
+	                 __ATOMIC_RELAXED);
+	__atomic_store_n(&io_stats.fsync_max_us, 0, __ATOMIC_RELAXED);
+}
+
+static void job_init(io_job_t *job, int fin, uint64_t src,
+                     int fout, uint64_t dst, uint64_t len, uint32_t unit)
+{
+	memset(job, 0, sizeof(*job));
+	job->fin = fin;
+	job->fout = fout;
+	job->src = src;
+	job->dst = dst;
+	job->len = len;
+	job->window = window_size(unit);
+	job->windows = (len + job->window - 1) / job->window;
+	job->unit = unit;
+	job->ui = ui;
+	job->same_file = same_file_behind_fds(fin, fout) == SUCCESS;
+	job->backward = job->same_file && dst > src && dst < src + len;
+}
+
+static int job_run(io_job_t *job)
+{
+	int res;
+
+	if (io_opts.threads > 1 && job->windows > 1 && !job->same_file &&
+	    !job->map)
+		res = copy_parallel(job);
+	else
+#if HAVE_IO_URING
+	if (io_opts.engine == IO_ENGINE_URING && !job->sparse)
+		res = copy_uring(job);
+	else
+#endif
+	if (io_opts.buffers > 1 && job->windows > 1)
+		res = copy_pipelined(job);
+	else
+		res = copy_sequential(job);
+
+	if (res != SUCCESS)
+		ui->log("ERROR   %s %"PRIu64" bytes at %"PRIu64" failed: %s\n",
+		        job->err_write ? "Writing" : "Reading",
+		        job->err_len, job->err_off, strerror(job->err));
+
+	return res;
+}
+
+int io_copy(int fin, uint64_t src, int fout, uint64_t dst, uint64_t len,
+            uint32_t unit)
+{
+	io_job_t job;
+
+	if (!len) {
+		if (unit)
+			ui->set_step_prog_val(0);
+		return SUCCESS;
+	}
+	job_init(&job, fin, src, fout, dst, len, unit);
+
+#if __linux__
+	if (!job.same_file && io_opts.copy != IO_COPY_BUFFERED) {
+		copy_kernel(&job);
+		if (job.done == len)
+			return SUCCESS;
+		/* Continue with buffered copy where kernel gave up. */
+		job.src += job.done;
+		job.dst += job.done;
+		job.len -= job.done;
+		job.windows = (job.len + job.window - 1) / job.window;
+	}
+#endif
+
+	return job_run(&job);
+}
+
+int io_copy_sparse(int fin, uint64_t src, int fout, uint64_t dst,
+                   uint32_t count, uint32_t unit, uint32_t *map,
+                   uint32_t *kept)
+{
+	io_job_t job;
+	int res;
+
+	*kept = 0;
+	if (!count) {
+		ui->set_step_prog_val(0);
+		return SUCCESS;
+	}
+	job_init(&job, fin, src, fout, dst, (uint64_t)count * unit, unit);
+	job.sparse = 1;
+	job.map = map;
+
+	res = job_run(&job);
+	*kept = job.kept;
+
+	return res;
+}
+
+int io_scan(int fd, uint64_t off, uint64_t len, io_scan_cb_t cb, void *ctx)
+{
+	if (!len)
+		return SUCCESS;
+#if HAVE_IO_URING
+	if (io_opts.engine == IO_ENGINE_URING)
+		return scan_uring(fd, off, len, cb, ctx);
+#endif
+
+	return scan_sync(fd, off, len, cb, ctx);
+}
+
+int io_insert_range(int fd, uint64_t off, uint64_t len)
+{
+#if __linux__ && defined(FALLOC_FL_INSERT_RANGE)
+	int res;
+	uint64_t start;
+
+	do {
+		start = trace_now();
+		res = fallocate(fd, FALLOC_FL_INSERT_RANGE, off, len);
+		STAT_ADD(other_calls, 1);
+		trace_span("io", "insert_range", start, off, len);
+	} while (res < 0 && errno == EINTR);
+
+	return !res ? SUCCESS : FAILURE;
+#else
+	errno = ENOSYS;
+	return FAILURE;
+#endif
+}
+
+int io_punch_hole(int fd, uint64_t off, uint64_t len)
+{
+	return punch_hole(fd, off, len);
+}
+
+int io_share_throttle()
+{
+#if !__WIN32__
+	io_throttle_t *sched;
+	pthread_mutexattr_t attr;
+	int err;
+
+	sched = mmap(NULL, sizeof(*sched), PROT_READ | PROT_WRITE,
+	             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (sched == MAP_FAILED)
+		return FAILURE;
+	sched->next = 0;
+	err = pthread_mutexattr_init(&attr);
+	if (!err) {
+		err = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) ||
+		      pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) ||
+		      pthread_mutex_init(&sched->lock, &attr);
+		pthread_mutexattr_destroy(&attr);
+	}
+	if (err) {
+		munmap(sched, sizeof(*sched));
+		return FAILURE;
+	}
+	throttle_sched = sched;
+
+	return SUCCESS;
+#else
+	return FAILURE;
+#endif
+}
+
+int io_set_engine(const char *name)
+{
+	if (!strcmp(name, "sync")) {
+		io_opts.engine = IO_ENGINE_SYNC;
+		return SUCCESS;
+	}
+#if HAVE_IO_URING
+	if (!strcmp(name, "uring")) {
+		io_opts.engine = IO_ENGINE_URING;
+		return SUCCESS;
+	}
+#endif
+
+	return FAILURE;
+}
+
+int io_set_durability(const char *name)
+{
+	if (!strcmp(name, "none"))
+		io_opts.durability = IO_DURABILITY_NONE;
+	else if (!strcmp(name, "ordered"))
+		io_opts.durability = IO_DURABILITY_ORDERED;
+	else if (!strcmp(name, "full"))
+		io_opts.durability = IO_DURABILITY_FULL;
+	else
+		return FAILURE;
+
+	return SUCCESS;
+}
+
+int io_set_copy_mode(const char *name)
+{
+	if (!strcmp(name, "auto"))
+		io_opts.copy = IO_COPY_AUTO;
+	else if (!strcmp(name, "kernel"))
+		io_opts.copy = IO_COPY_KERNEL;
+	else if (!strcmp(name, "buffered"))
+		io_opts.copy = IO_COPY_BUFFERED;
+	else
+		return FAILURE;
+
+	return SUCCESS;
+}
@@ -0,0 +1,293 @@
+/*
+ * Copyright (C) 2013 Przemyslaw Pawelczyk <przemoc@gmail.com>
+ *
+ * This software is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ * See <http://www.gnu.org/licenses/gpl-2.0.txt>.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/** \file io.h
+ * I/O engine.
+ *
+ * Moves data between (or within) files in large windows using explicit
+ * offsets, so callers never depend on shared file position.
+ *
+ * If more than one buffer is allowed, then reading and writing is pipelined:
+ * separate reader thread fills a ring of buffers, while the calling thread
+ * writes them out, so source and destination are busy at the same time.
+ *
+ * On Linux io_uring engine can be chosen instead. It keeps as many requests
+ * in flight as there are buffers, using registered buffers when possible.
+ * If io_uring cannot be set up, synchronous engine is used.
+ *
+ * Copies between different files on Linux are offered to the kernel first:
+ * reflinks (FICLONERANGE) are tried, then copy_file_range(). Whatever they
+ * cannot handle is copied through userspace buffers.
+ *
+ * In direct mode page cache is bypassed: requests aligned to 4 KiB (buffer,
+ * offset and length) use O_DIRECT descriptor opened by io_open_direct(),
+ * while the rest (header, BAM, odd tails) use ordinary descriptor and are
+ * dropped from page cache right after. copy_file_range() is not used then.
+ *
+ * Unless durability level is none, data written by copies is flushed
+ * incrementally on Linux: writeback of each window is started as soon as
+ * it's written and awaited when the next one is, so dirty pages don't pile
+ * up and syncs at the end of steps don't stall for long.
+ *
+ * If bandwidth is limited, every read and write (including those done by
+ * kernel on behalf of vidma) waits for its turn, so the average rate of the
+ * whole process doesn't exceed the limit. After io_share_throttle() the turns
+ * are shared with forked processes, so the limit applies to all of them.
+ */
+
+#ifndef IO_H
+#define IO_H
+
+#include <sys/types.h>
+
+#include "common.h"
+
+/** Default size of I/O window (in megabytes). */
+#define IO_DEFAULT_WINDOW_MB 64
+/** Default size of I/O window. */
+#define IO_DEFAULT_WINDOW (IO_DEFAULT_WINDOW_MB * _1MB)
+/** Size of chunks passed by io_scan(). */
+#define IO_SCAN_CHUNK _1MB
+/** Default number of window-sized buffers. */
+#define IO_DEFAULT_BUFFERS 2
+/** Maximal number of threads copying between different files. */
+#define IO_MAX_THREADS 256
+
+/** I/O engine identifier. */
+enum io_engine {
+	/** pread()/pwrite() with optional reader thread. */
+	IO_ENGINE_SYNC = 0,
+	/** Linux io_uring. */
+	IO_ENGINE_URING,
+};
+
+/** Copy mode used between different files. */
+enum io_copy_mode {
+	/** Reflink, then copy_file_range(), then buffers. */
+	IO_COPY_AUTO = 0,
+	/** copy_file_range(), then buffers. */
+	IO_COPY_KERNEL,
+	/** Buffers only. */
+	IO_COPY_BUFFERED,
+};
+
+/** Durability level, i.e. how much syncing is done. */
+enum io_durability {
+	/** Nothing is synced explicitly. */
+	IO_DURABILITY_NONE = 0,
+	/** Data only (fdatasync()) and only where later writes depend on it. */
+	IO_DURABILITY_ORDERED,
+	/** fsync() at the end of every step. */
+	IO_DURABILITY_FULL,
+};
+
+/** I/O engine tunables. */
+typedef struct io_opts {
+	uint64_t window;    /**< Bytes moved by single read/write pair. */
+	unsigned buffers;   /**< Window-sized buffers in flight (1 = no pipeline). */
+	unsigned threads;   /**< Threads copying between different files. */
+	int engine;         /**< Engine used for copying and scanning. */
+	int copy;           /**< Copy mode used between different files. */
+	int sparse;         /**< Whether zero blocks should not be written. */
+	int direct;         /**< Whether page cache should be avoided. */
+	int durability;     /**< Durability level. */
+	uint64_t bandwidth; /**< Bytes read plus written per second or 0. */
+} io_opts_t;
+
+/** I/O engine tunables used by vidma. */
+extern io_opts_t io_opts;
+
+/** I/O statistics (all fields are uint64_t updated atomically). */
+typedef struct io_stats {
+	uint64_t read_bytes;    /**< Bytes read into buffers. */
+	uint64_t write_bytes;   /**< Bytes written from buffers. */
+	uint64_t kernel_bytes;  /**< Bytes copied by kernel (reflink, etc.). */
+	uint64_t reads;         /**< Read syscalls (or io_uring reads). */
+	uint64_t writes;        /**< Write syscalls (or io_uring writes). */
+	uint64_t other_calls;   /**< Other syscalls (copy_file_range(), etc.). */
+	uint64_t fsyncs;        /**< Calls of io_fsync(). */
+	uint64_t fsync_us;      /**< Time spent in io_fsync() (in microseconds). */
+	uint64_t fsync_max_us;  /**< Longest io_fsync() since last peaks reset. */
+	uint64_t buf_bytes;     /**< Memory currently taken by I/O buffers. */
+	uint64_t buf_peak;      /**< Highest buf_bytes since last peaks reset. */
+} io_stats_t;
+
+/** I/O statistics gathered by engine. */
+extern io_stats_t io_stats;
+
+/** Allocates buffer aligned for direct I/O, reusing freed one of the same
+ * size if possible.
+ *
+ * \return buffer or NULL
+ */
+void *io_buf_alloc(uint64_t size);
+
+/** Returns buffer of \p size bytes obtained from io_buf_alloc(). */
+void io_buf_free(void *buf, uint64_t size);
+
+/** Frees buffers kept for reuse. */
+void io_buf_release();
+
+/** Opens file at \p path (already opened as \p fd) once again with O_DIRECT,
+ * so aligned requests for \p fd can bypass page cache.
+ *
+ * If it isn't possible, kernel is only advised that \p fd is going to be
+ * read sequentially.
+ *
+ * \return \a SUCCESS or \a FAILURE
+ */
+int io_open_direct(int fd, const char *path);
+
+/** Closes descriptors opened by io_open_direct(). */
+void io_close_direct();
+
+/** Closes descriptor opened by io_open_direct() for \p fd, if there is one. */
+void io_close_direct_of(int fd);
+
+/** Reads exactly \p len bytes at \p off, retrying short reads.
+ *
+ * \return \a SUCCESS or \a FAILURE (on error or premature end of file)
+ */
+int io_pread(int fd, void *buf, size_t len, uint64_t off);
+
+/** Writes exactly \p len bytes at \p off, retrying short writes.
+ *
+ * \return \a SUCCESS or \a FAILURE
+ */
+int io_pwrite(int fd, const void *buf, size_t len, uint64_t off);
+
+/** Sends exactly \p len bytes of \p fd at \p off to socket \p sock,
+ * letting kernel move them (sendfile()) if possible.
+ *
+ * \return \a SUCCESS or \a FAILURE
+ */
+int io_send(int sock, int fd, size_t len, uint64_t off);
+
+/** Flushes \p fd to disk, measuring how long it took.
+ *
+ * \return \a SUCCESS or \a FAILURE
+ */
+int io_fsync(int fd);
+
+/** Checks whether io_sync() at given point does anything at current
+ * durability level.
+ *
+ * \param barrier whether later writes depend on the earlier ones
+ */
+int io_sync_needed(int barrier);
+
+/** Syncs \p fd at the end of step as required by durability level.
+ *
+ * \param barrier whether later writes depend on the earlier ones
+ * \return \a SUCCESS or \a FAILURE
+ */
+int io_sync(int fd, int barrier);
+
+/** Copies consistent enough snapshot of \a io_stats into \p stats. */
+void io_stats_get(io_stats_t *stats);
+
+/** Starts tracking peak values (buffer memory, fsync latency) anew. */
+void io_stats_reset_peaks();
+
+/** Copies \p len bytes from \p src in \p fin to \p dst in \p fout.
+ *
+ * Overlapping ranges within the same file are handled properly, i.e. data
+ * is copied backward when moving it forward.
+ * Progress is reported through \a ui in \p unit sized steps (0 = never).
+ *
+ * \return \a SUCCESS or \a FAILURE
+ */
+int io_copy(int fin, uint64_t src, int fout, uint64_t dst, uint64_t len,
+            uint32_t unit);
+
+/** Marks zero unit in map filled by io_copy_sparse(). */
+#define IO_ZERO_UNIT UINT32_MAX
+
+/** Copies \p count units of \p unit bytes like io_copy(), but doesn't write
+ * units consisting of zeros only.
+ *
+ * If \p map is NULL, zero units become holes in \p fout (punched out, if
+ * there was something). Otherwise non-zero units are packed, i.e. written
+ * one after another starting at \p dst, and \p map receives new index of
+ * each unit or \a IO_ZERO_UNIT. Packing requires non-overlapping ranges.
+ *
+ * \param kept receives number of non-zero units
+ * \return \a SUCCESS or \a FAILURE
+ */
+int io_copy_sparse(int fin, uint64_t src, int fout, uint64_t dst,
+                   uint32_t count, uint32_t unit, uint32_t *map,
+                   uint32_t *kept);
+
+/** Callback receiving consecutive chunks read by io_scan().
+ *
+ * \param buf data
+ * \param off offset of data relative to the beginning of scanned range
+ * \param len length of data
+ * \param ctx context given to io_scan()
+ * \return \a SUCCESS to continue or \a FAILURE to stop scanning
+ */
+typedef int (*io_scan_cb_t)(const void *buf, uint64_t off, size_t len,
+                            void *ctx);
+
+/** Reads \p len bytes at \p off in chunks and passes them in order to \p cb.
+ *
+ * \return \a SUCCESS or \a FAILURE (read error or callback failure)
+ */
+int io_scan(int fd, uint64_t off, uint64_t len, io_scan_cb_t cb, void *ctx);
+
+/** Inserts \p len bytes of unwritten space at \p off, shifting the rest of
+ * file without copying data.
+ *
+ * Works only where fallocate(FALLOC_FL_INSERT_RANGE) is supported (e.g. ext4
+ * and XFS on Linux), typically with \p off and \p len being multiples of
+ * filesystem block size.
+ *
+ * \return \a SUCCESS or \a FAILURE if filesystem couldn't do it
+ */
+int io_insert_range(int fd, uint64_t off, uint64_t len);
+
+/** Deallocates \p len bytes at \p off, so they read as zeros and don't take
+ * space on disk.
+ *
+ * \return \a SUCCESS or \a FAILURE if filesystem couldn't do it (data is
+ *         left as it is)
+ */
+int io_punch_hole(int fd, uint64_t off, uint64_t len);
+
+/** Makes schedule of transfers limited by bandwidth shared with processes
+ * forked afterwards, so the limit is their total and bandwidth unused by
+ * some of them is left for others.
+ *
+ * \return \a SUCCESS or \a FAILURE (if shared memory isn't available)
+ */
+int io_share_throttle();
+
+/** Chooses I/O engine by its name ("sync" or "uring").
+ *
+ * \return \a SUCCESS or \a FAILURE if engine is unknown or unavailable
+ */
+int io_set_engine(const char *name);
+
+/** Chooses durability level by its name ("none", "ordered" or "full").
+ *
+ * \return \a SUCCESS or \a FAILURE if level is unknown
+ */
+int io_set_durability(const char *name);
+
+/** Chooses copy mode by its name ("auto", "kernel" or "buffered").
+ *
+ * \return \a SUCCESS or \a FAILURE if mode is unknown
+ */
+int io_set_copy_mode(const char *name);
+
+#endif /* IO_H */
@@ -11,26 +11,127 @@
  * for more details.
  */
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <unistd.h>
 #include <sys/stat.h>
 
 #include "common.h"
+#include "batch.h"
+#include "io.h"
+#include "nbd.h"
+#include "trace.h"
 #include "ui.h"
 #include "vdi.h"
+#include "vdi_bam.h"
 
 const char vidma_header_string[] =
 	"vidma - Virtual Disks Manipulator, " VIDMA_VERSION "\n"
 	"(C) 2009-2012 Przemyslaw Pawelczyk\n";
 
 const char vidma_usage_string[] =
-	"Usage: %s INPUT_FILE [NEW_SIZE_IN_MB [OUTPUT_FILE]]\n"
+	"Usage: %s [OPTION]... INPUT_FILE [NEW_SIZE_IN_MB [OUTPUT_FILE]]\n"
+	"       %s [OPTION]... compact INPUT_FILE [OUTPUT_FILE]\n"
+	"       %s [OPTION]... defrag INPUT_FILE [OUTPUT_FILE]\n"
+	"       %s [OPTION]... batch MANIFEST\n"
+	"       %s [OPTION]... serve INPUT_FILE --socket=PATH\n"
+	"\n"
+	"Without NEW_SIZE_IN_MB information about the image is shown.\n"
+	"compact drops blocks filled with zeros from dynamic image and moves\n"
+	"blocks into the holes left behind, so the image file can be truncated.\n"
+	"defrag places blocks of dynamic image in the order of disk blocks.\n"
+	"batch processes every line of MANIFEST (INPUT_FILE NEW_SIZE_IN_MB or -\n"
+	"[OUTPUT_FILE]) without asking questions and reports all of them.\n"
+	"serve exports the image over NBD protocol on Unix socket until"
+	" interrupted.\n"
+	"\n"
+	"Options:\n"
+	"  -w, --window=MB       move data in windows of MB megabytes"
+	" (default: " Q(IO_DEFAULT_WINDOW_MB) ")\n"
+	"  -b, --buffers=N       keep up to N windows in flight, 1 disables"
+	" pipelining\n"
+	"                        (default: " Q(IO_DEFAULT_BUFFERS) ")\n"
+	"  -t, --threads=N       copy to OUTPUT_FILE with N threads, each taking"
+	" its own\n"
+	"                        part of blocks (default: 1), or serve requests"
+	" with N\n"
+	"                        threads (default: " Q(NBD_DEFAULT_THREADS) ")\n"
+	"  -e, --io-engine=NAME  use NAME I/O engine: sync or uring"
+	" (default: sync)\n"
+	"  -c, --copy-mode=MODE  copy to OUTPUT_FILE using MODE: auto (reflink"
+	" or\n"
+	"                        in-kernel copy if possible), kernel or buffered\n"
+	"                        (default: auto)\n"
+	"  -s, --sparse          do not write blocks filled with zeros\n"
+	"  -m, --memory=MB       keep block allocation map in memory only if it"
+	" takes\n"
+	"                        up to MB megabytes, stream it from disk"
+	" otherwise\n"
+	"                        (default: no limit, data buffers are not"
+	" counted)\n"
+	"  -d, --durability=LEVEL\n"
+	"                        sync at the end of every step (full, default),"
+	"\n"
+	"                        only where order matters (ordered) or never"
+	" (none)\n"
+	"  -D, --direct          bypass page cache (O_DIRECT), or at least"
+	" drop data\n"
+	"                        from it as soon as possible\n"
+	"  -S, --stats=FORMAT    write statistics of every step in FORMAT"
+	" (json)\n"
+	"      --stats-file=FILE write statistics to FILE (default: standard"
+	" error)\n"
+	"  -T, --trace=FILE      write timeline of steps and I/O to FILE in"
+	" Chrome trace\n"
+	"                        format (for Perfetto or chrome://tracing)\n"
+	"      --bandwidth=MB    read and write at most MB megabytes per second\n"
+	"  -j, --jobs=N          process up to N images at once in batch mode\n"
+	"                        (default: 1)\n"
+	"      --socket=PATH     serve on Unix socket at PATH\n"
+	"      --read-only       refuse writes when serving\n"
 	"\n"
 	"USE AT YOUR OWN RISK! NO WARRANTY!\n";
 
-ui_ops_t *ui = &ui_cli;
+/** Values of long options without short counterparts. */
+enum long_only_option {
+	OPT_STATS_FILE = 256,
+	OPT_BANDWIDTH,
+	OPT_SOCKET,
+	OPT_READ_ONLY,
+};
+
+static const struct option long_options[] = {
+	{ "window",     required_argument, NULL, 'w' },
+	{ "buffers",    required_argument, NULL, 'b' },
+	{ "threads",    required_argument, NULL, 't' },
+	{ "io-engine",  required_argument, NULL, 'e' },
+	{ "copy-mode",  required_argument, NULL, 'c' },
+	{ "sparse",     no_argument,       NULL, 's' },
+	{ "memory",     required_argument, NULL, 'm' },
+	{ "durability", required_argument, NULL, 'd' },
+	{ "direct",     no_argument,       NULL, 'D' },
+	{ "stats",      required_argument, NULL, 'S' },
+	{ "stats-file", required_argument, NULL, OPT_STATS_FILE },
+	{ "trace",      required_argument, NULL, 'T' },
+	{ "jobs",       required_argument, NULL, 'j' },
+	{ "bandwidth",  required_argument, NULL, OPT_BANDWIDTH },
+	{ "socket",     required_argument, NULL, OPT_SOCKET },
+	{ "read-only",  no_argument,       NULL, OPT_READ_ONLY },
+	{ NULL,         0,                 NULL, 0   }
+};
+
+/** Operation requested in command line. */
+enum command {
+	CMD_RESIZE = 0,
+	CMD_COMPACT,
+	CMD_DEFRAG,
+	CMD_BATCH,
+	CMD_SERVE,
+};
 
 int litle_endian_test()
 {
@@ -39,41 +140,59 @@ int litle_endian_test()
 	return ((char*)&endianness_test)[0];
 }
 
-int main(int argc, char *argv[])
+int parse_positive_u32(const char *str, uint32_t *val)
 {
-	int fin, fout, result;
 	char *tmp;
+	long long v = strtoll(str, &tmp, 10);
+
+	if (*str == '\0' || *tmp != '\0' || v <= 0 || v > UINT32_MAX)
+		return FAILURE;
+	*val = v;
+
+	return SUCCESS;
+}
+
+/* Writes statistics to file at \p path (or to stderr if it's NULL). */
+void write_stats(const char *path, int result)
+{
+	FILE *f = stderr;
+
+	if (path && !(f = fopen(path, "w"))) {
+		perror(path);
+		return;
+	}
+	ui_stats_write_json(f, result);
+	if (f != stderr)
+		fclose(f);
+}
+
+/* Shows peak memory usage, if memory limit is given. */
+void print_peak_rss()
+{
+	uint64_t bytes;
+
+	if (vdi_bam_mem_limit && get_peak_rss(&bytes) == SUCCESS)
+		ui->log("\nPeak memory usage\n"
+		        "     %21"PRIu64" bytes (%15"PRIu64" MB)\n",
+		        bytes, bytes / _1MB);
+}
+
+/* Runs \p cmd on \p in, writing result to \p out (or in place if it's
+ * NULL). Resize with \p new_msize being 0 only shows information. */
+static int process_image(enum command cmd, const char *in, const char *out,
+                         uint32_t new_msize)
+{
+	int fin, fout, result;
 	vd_type_t *types[] = {
 		&vd_vdi,
 		NULL
 	};
 	vd_type_t **type = types;
-	uint32_t new_msize = 0;
-
-	if (!litle_endian_test()) {
-		fprintf(stderr, "This program requires little-endian machine. Sorry!");
-		exit(FAILURE);
-	}
-
-	if (argc == 1) {
-		puts(vidma_header_string);
-		printf(vidma_usage_string, argv[0]);
-		exit(SUCCESS);
-	} else if (argc == 3 || argc == 4) {
-		new_msize = strtoll(argv[2], &tmp, 10);
-		if (*argv[2] == '\0' || new_msize <= 0 || *tmp != '\0') {
-			fprintf(stderr, "Incorrect second argument!\n");
-			exit(FAILURE);
-		}
-	} else if (argc > 4) {
-		fprintf(stderr, "Too many arguments!\n");
-		exit(FAILURE);
-	}
 
-	fin = open(argv[1], O_RDONLY | O_BINARY);
+	fin = open(in, O_RDONLY | O_BINARY);
 	if (fin < 0) {
-		perror(argv[1]);
-		exit(FAILURE);
+		perror(in);
+		return FAILURE;
 	}
 
 	for (; *type != NULL; type++) {
@@ -86,27 +205,305 @@ int main(int argc, char *argv[])
 
 	if (*type == NULL) {
 		fprintf(stderr, "Unrecognized file format!\n");
-		exit(FAILURE);
+		close(fin);
+		return FAILURE;
 	}
 
-	fout = open(argc == 4 ? argv[3] : argv[1],
-	            O_CREAT | O_WRONLY | O_BINARY,
+	fout = open(out ? out : in, O_CREAT | O_WRONLY | O_BINARY,
 	            S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH);
 	if (fout < 0) {
-		perror(argc == 4 ? argv[3] : argv[1]);
-		exit(FAILURE);
+		perror(out ? out : in);
+		close(fin);
+		return FAILURE;
 	}
+	if (io_opts.direct &&
+	    (io_open_direct(fin, in) != SUCCESS ||
+	     io_open_direct(fout, out ? out : in) != SUCCESS))
+		fprintf(stderr, "Page cache cannot be bypassed, data will be dropped"
+		                " from it instead.\n\n");
 
-
-	if (argc == 2) {
+	if (cmd == CMD_COMPACT) {
+		if ((*type)->ops.compact) {
+			result = (*type)->ops.compact(fin, fout);
+		} else {
+			fprintf(stderr, "Compact is not supported for this format!\n");
+			result = FAILURE;
+		}
+	} else if (cmd == CMD_DEFRAG) {
+		if ((*type)->ops.defrag) {
+			result = (*type)->ops.defrag(fin, fout);
+		} else {
+			fprintf(stderr, "Defrag is not supported for this format!\n");
+			result = FAILURE;
+		}
+	} else if (!new_msize) {
 		(*type)->ops.info(fin);
-		return 0;
+		result = SUCCESS;
+	} else {
+		result = (*type)->ops.resize(fin, fout, new_msize);
 	}
+	print_peak_rss();
 
-	result = (*type)->ops.resize(fin, fout, new_msize);
-
+	io_close_direct();
+	io_buf_release();
 	close(fout);
 	close(fin);
 
 	return result;
 }
+
+/* Serves \p in over NBD protocol as described by \p opts. */
+static int serve_image(const char *in, nbd_opts_t *opts)
+{
+	int result;
+	vd_t vd = { .fd = -1 };
+	vd_type_t *types[] = {
+		&vd_vdi,
+		NULL
+	};
+	vd_type_t **type = types;
+	const char *name = strrchr(in, '/');
+
+	opts->name = name ? name + 1 : in;
+	if (!opts->read_only) {
+		vd.fd = open(in, O_RDWR | O_BINARY);
+		if (vd.fd < 0 && (errno == EACCES || errno == EROFS)) {
+			fprintf(stderr, "Image cannot be written, serving it"
+			                " read-only.\n\n");
+			opts->read_only = 1;
+		}
+	}
+	if (vd.fd < 0)
+		vd.fd = open(in, O_RDONLY | O_BINARY);
+	if (vd.fd < 0) {
+		perror(in);
+		return FAILURE;
+	}
+
+	for (; *type != NULL; type++)
+		if ((*type)->ops.detect(vd.fd) == SUCCESS)
+			break;
+	if (*type == NULL || !(*type)->ops.open) {
+		fprintf(stderr, "Unrecognized file format!\n");
+		close(vd.fd);
+		return FAILURE;
+	}
+	if ((*type)->ops.open(&vd) != SUCCESS) {
+		close(vd.fd);
+		return FAILURE;
+	}
+
+	result = nbd_serve(&vd, &(*type)->ops, opts);
+	print_peak_rss();
+
+	(*type)->ops.close(&vd);
+	close(vd.fd);
+
+	return result;
+}
+
+/* Processes image listed in batch manifest. */
+static int process_batch_image(const char *in, const char *out,
+                               uint32_t new_msize)
+{
+	return process_image(CMD_RESIZE, in, out, new_msize);
+}
+
+int main(int argc, char *argv[])
+{
+	int result, opt, args, out_arg;
+	enum command cmd = CMD_RESIZE;
+	batch_opts_t batch = { .jobs = 1 };
+	nbd_opts_t serve = { .threads = 0 };
+	uint32_t new_msize = 0;
+	uint32_t val;
+	const char *stats_file = NULL;
+	const char *trace_file = NULL;
+	int stats = 0;
+
+	if (!litle_endian_test()) {
+		fprintf(stderr, "This program requires little-endian machine. Sorry!");
+		exit(FAILURE);
+	}
+
+	while ((opt = getopt_long(argc, argv, "w:b:t:e:c:sm:d:DS:T:j:", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'w':
+			if (parse_positive_u32(optarg, &val) != SUCCESS) {
+				fprintf(stderr, "Incorrect window size!\n");
+				exit(FAILURE);
+			}
+			io_opts.window = (uint64_t)val * _1MB;
+			break;
+		case 'b':
+			if (parse_positive_u32(optarg, &val) != SUCCESS) {
+				fprintf(stderr, "Incorrect number of buffers!\n");
+				exit(FAILURE);
+			}
+			io_opts.buffers = val;
+			break;
+		case 't':
+			if (parse_positive_u32(optarg, &val) != SUCCESS ||
+			    val > IO_MAX_THREADS) {
+				fprintf(stderr, "Incorrect number of threads!\n");
+				exit(FAILURE);
+			}
+			io_opts.threads = val;
+			serve.threads = val;
+			break;
+		case 'e':
+			if (io_set_engine(optarg) != SUCCESS) {
+				fprintf(stderr, "Unknown or unavailable I/O engine!\n");
+				exit(FAILURE);
+			}
+			break;
+		case 'c':
+			if (io_set_copy_mode(optarg) != SUCCESS) {
+				fprintf(stderr, "Unknown copy mode!\n");
+				exit(FAILURE);
+			}
+			break;
+		case 's':
+			io_opts.sparse = 1;
+			break;
+		case 'm':
+			if (parse_positive_u32(optarg, &val) != SUCCESS) {
+				fprintf(stderr, "Incorrect memory limit!\n");
+				exit(FAILURE);
+			}
+			vdi_bam_mem_limit = (uint64_t)val * _1MB;
+			break;
+		case 'd':
+			if (io_set_durability(optarg) != SUCCESS) {
+				fprintf(stderr, "Unknown durability level!\n");
+				exit(FAILURE);
+			}
+			break;
+		case 'D':
+			io_opts.direct = 1;
+			break;
+		case 'S':
+			if (strcmp(optarg, "json")) {
+				fprintf(stderr, "Unknown statistics format!\n");
+				exit(FAILURE);
+			}
+			stats = 1;
+			break;
+		case OPT_STATS_FILE:
+			stats_file = optarg;
+			break;
+		case 'T':
+			trace_file = optarg;
+			break;
+		case 'j':
+			if (parse_positive_u32(optarg, &val) != SUCCESS) {
+				fprintf(stderr, "Incorrect number of jobs!\n");
+				exit(FAILURE);
+			}
+			batch.jobs = val;
+			break;
+		case OPT_BANDWIDTH:
+			if (parse_positive_u32(optarg, &val) != SUCCESS) {
+				fprintf(stderr, "Incorrect bandwidth!\n");
+				exit(FAILURE);
+			}
+			io_opts.bandwidth = (uint64_t)val * _1MB;
+			break;
+		case OPT_SOCKET:
+			serve.socket = optarg;
+			break;
+		case OPT_READ_ONLY:
+			serve.read_only = 1;
+			break;
+		default:
+			exit(FAILURE);
+		}
+	}
+	args = argc - optind;
+	if (args > 0 && !strcmp(argv[optind], "compact"))
+		cmd = CMD_COMPACT;
+	else if (args > 0 && !strcmp(argv[optind], "defrag"))
+		cmd = CMD_DEFRAG;
+	else if (args > 0 && !strcmp(argv[optind], "batch"))
+		cmd = CMD_BATCH;
+	else if (args > 0 && !strcmp(argv[optind], "serve"))
+		cmd = CMD_SERVE;
+	if (cmd != CMD_RESIZE) {
+		optind++;
+		args--;
+	}
+
+	if (args == 0) {
+		puts(vidma_header_string);
+		printf(vidma_usage_string, argv[0], argv[0], argv[0], argv[0],
+		       argv[0]);
+		exit(SUCCESS);
+	} else if (cmd == CMD_BATCH) {
+		if (args > 1) {
+			fprintf(stderr, "Too many arguments!\n");
+			exit(FAILURE);
+		}
+		if (trace_file) {
+			fprintf(stderr, "Trace is not supported in batch mode!\n");
+			exit(FAILURE);
+		}
+		batch.stats = stats;
+		batch.stats_file = stats_file;
+		return batch_run(argv[optind], &batch, process_batch_image);
+	} else if (cmd == CMD_SERVE) {
+		if (args > 1) {
+			fprintf(stderr, "Too many arguments!\n");
+			exit(FAILURE);
+		}
+		if (!serve.socket) {
+			fprintf(stderr, "Socket is not given!\n");
+			exit(FAILURE);
+		}
+		if (!serve.threads)
+			serve.threads = NBD_DEFAULT_THREADS;
+	} else if (cmd != CMD_RESIZE) {
+		if (args > 2) {
+			fprintf(stderr, "Too many arguments!\n");
+			exit(FAILURE);
+		}
+	} else if (args == 2 || args == 3) {
+		if (parse_positive_u32(argv[optind + 1], &new_msize) != SUCCESS) {
+			fprintf(stderr, "Incorrect second argument!\n");
+			exit(FAILURE);
+		}
+	} else if (args > 3) {
+		fprintf(stderr, "Too many arguments!\n");
+		exit(FAILURE);
+	}
+	argv += optind - 1;
+	argc = args + 1;
+	out_arg = cmd == CMD_RESIZE ? 3 : 2;
+
+	if (stats) {
+		ui_stats_start(ui);
+		ui = &ui_stats;
+	}
+	if (trace_file) {
+		if (trace_open(trace_file) != SUCCESS) {
+			perror(trace_file);
+			exit(FAILURE);
+		}
+		ui_trace_start(ui);
+		ui = &ui_trace;
+	}
+
+	if (cmd == CMD_SERVE)
+		result = serve_image(argv[1], &serve);
+	else
+		result = process_image(cmd, argv[1],
+		                       argc > out_arg ? argv[out_arg] : NULL,
+		                       new_msize);
+	if (stats)
+		write_stats(stats_file, result);
+	if (trace_file) {
+		ui_trace_stop();
+		trace_close();
+	}
+
+	return result;
+}
@@ -0,0 +1,990 @@
+/*
+ * Copyright (C) 2013 Przemyslaw Pawelczyk <przemoc@gmail.com>
+ *
+ * This software is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ * See <http://www.gnu.org/licenses/gpl-2.0.txt>.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if !__WIN32__
+# include <poll.h>
+# include <sys/socket.h>
+# include <sys/stat.h>
+# include <sys/un.h>
+#endif
+
+#include "common.h"
+#include "io.h"
+#include "nbd.h"
+#include "ui.h"
+
+#if !__WIN32__
+
+/* ==== Defines and Macros ================================================== */
+
+#define NBD_MAGIC               0x4e42444d41474943ULL /* "NBDMAGIC" */
+#define NBD_OPT_MAGIC           0x49484156454f5054ULL /* "IHAVEOPT" */
+#define NBD_REP_MAGIC           0x0003e889045565a9ULL
+#define NBD_REQUEST_MAGIC       0x25609513
+#define NBD_SIMPLE_REPLY_MAGIC  0x67446698
+#define NBD_STRUCT_REPLY_MAGIC  0x668e33ef
+
+/* Handshake flags. */
+#define NBD_FLAG_FIXED_NEWSTYLE (1 << 0)
+#define NBD_FLAG_NO_ZEROES      (1 << 1)
+
+/* Transmission flags. */
+#define NBD_FLAG_HAS_FLAGS      (1 << 0)
+#define NBD_FLAG_READ_ONLY      (1 << 1)
+#define NBD_FLAG_SEND_FLUSH     (1 << 2)
+#define NBD_FLAG_SEND_FUA       (1 << 3)
+#define NBD_FLAG_SEND_DF        (1 << 7)
+#define NBD_FLAG_CAN_MULTI_CONN (1 << 8)
+
+/* Options. */
+#define NBD_OPT_EXPORT_NAME       1
+#define NBD_OPT_ABORT             2
+#define NBD_OPT_LIST              3
+#define NBD_OPT_INFO              6
+#define NBD_OPT_GO                7
+#define NBD_OPT_STRUCTURED_REPLY  8
+#define NBD_OPT_LIST_META_CONTEXT 9
+#define NBD_OPT_SET_META_CONTEXT  10
+
+/* Option replies. */
+#define NBD_REP_ACK               1
+#define NBD_REP_SERVER            2
+#define NBD_REP_INFO              3
+#define NBD_REP_META_CONTEXT      4
+#define NBD_REP_ERR_UNSUP         0x80000001
+#define NBD_REP_ERR_INVALID       0x80000003
+
+/* Information types. */
+#define NBD_INFO_EXPORT           0
+#define NBD_INFO_BLOCK_SIZE       3
+
+/* Commands and their flags. */
+#define NBD_CMD_READ              0
+#define NBD_CMD_WRITE             1
+#define NBD_CMD_DISC              2
+#define NBD_CMD_FLUSH             3
+#define NBD_CMD_BLOCK_STATUS      7
+#define NBD_CMD_FLAG_FUA          (1 << 0)
+#define NBD_CMD_FLAG_DF           (1 << 2)
+#define NBD_CMD_FLAG_REQ_ONE      (1 << 3)
+
+/* Structured reply chunks. */
+#define NBD_REPLY_FLAG_DONE       (1 << 0)
+#define NBD_REPLY_TYPE_NONE       0
+#define NBD_REPLY_TYPE_OFFSET_DATA 1
+#define NBD_REPLY_TYPE_OFFSET_HOLE 2
+#define NBD_REPLY_TYPE_BLOCK_STATUS 5
+#define NBD_REPLY_TYPE_ERROR      ((1 << 15) + 1)
+
+/* Block status flags of base:allocation context. */
+#define NBD_STATE_HOLE            (1 << 0)
+#define NBD_STATE_ZERO            (1 << 1)
+
+/* Errors. */
+#define NBD_EPERM                 1
+#define NBD_EIO                   5
+#define NBD_ENOMEM                12
+#define NBD_EINVAL                22
+#define NBD_EOVERFLOW             75
+
+/** The only metadata context served. */
+#define NBD_META_ALLOCATION       "base:allocation"
+/** Its id. */
+#define NBD_META_ALLOCATION_ID    1
+
+/** Longest option data accepted. */
+#define NBD_MAX_OPTION            4096
+/** Longest read or write. */
+#define NBD_MAX_LEN               (32 * _1MB)
+/** Preferred length of requests. */
+#define NBD_PREF_LEN              4096
+/** Most extents sent in single block status reply. */
+#define NBD_MAX_EXTENTS           1024
+/** Most requests waiting for worker threads. */
+#define NBD_QUEUE_MAX             256
+
+typedef struct nbd_server nbd_server_t;
+
+/** Connection with client. */
+typedef struct nbd_conn {
+	nbd_server_t *srv;
+	int sock;
+	unsigned id;
+	int structured;     /**< Whether structured replies were negotiated. */
+	int meta;           /**< Whether base:allocation context was set. */
+	unsigned pending;   /**< Requests queued or being served. */
+	pthread_mutex_t send_lock;  /**< Keeps replies (or their chunks) whole. */
+	pthread_cond_t drained;     /**< Signaled when pending drops to 0. */
+	struct nbd_conn *next;
+} nbd_conn_t;
+
+/** Request waiting for worker thread. */
+typedef struct nbd_req {
+	nbd_conn_t *conn;
+	uint16_t flags;
+	uint16_t type;
+	uint64_t handle;
+	uint64_t off;
+	uint32_t len;
+	char *data;         /**< Data of write. */
+	struct nbd_req *next;
+} nbd_req_t;
+
+struct nbd_server {
+	vd_t *vd;
+	const vd_ops_t *ops;
+	const nbd_opts_t *opts;
+	uint64_t size;
+	ui_ops_t *ui;               /**< UI of thread which started server. */
+	pthread_rwlock_t image_lock; /**< Writes exclude other requests. */
+	pthread_mutex_t lock;       /**< Guards everything below. */
+	pthread_cond_t queued;      /**< Signaled when request is queued. */
+	pthread_cond_t room;        /**< Signaled when request is taken. */
+	pthread_cond_t closed;      /**< Signaled when connection is closed. */
+	nbd_req_t *head, *tail;
+	unsigned queue_len;
+	nbd_conn_t *conns;
+	unsigned conn_count;
+	unsigned conn_ids;
+	int stopping;
+};
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static const char zeros[64 * 1024];
+
+/* ==== Non-exposed functions definitions =================================== */
+
+static inline void put16(unsigned char *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static inline void put32(unsigned char *p, uint32_t v)
+{
+	put16(p, v >> 16);
+	put16(p + 2, v);
+}
+
+static inline void put64(unsigned char *p, uint64_t v)
+{
+	put32(p, v >> 32);
+	put32(p + 4, v);
+}
+
+static inline uint16_t get16(const unsigned char *p)
+{
+	return (uint16_t)p[0] << 8 | p[1];
+}
+
+static inline uint32_t get32(const unsigned char *p)
+{
+	return (uint32_t)get16(p) << 16 | get16(p + 2);
+}
+
+static inline uint64_t get64(const unsigned char *p)
+{
+	return (uint64_t)get32(p) << 32 | get32(p + 4);
+}
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop_requested = 1;
+}
+
+static int send_all(int sock, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = write(sock, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return FAILURE;
+		p += n;
+		len -= n;
+	}
+
+	return SUCCESS;
+}
+
+static int recv_all(int sock, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = read(sock, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return FAILURE;
+		p += n;
+		len -= n;
+	}
+
+	return SUCCESS;
+}
+
+static int send_zeros(int sock, uint64_t len)
+{
+	uint64_t n;
+
+	for (; len; len -= n) {
+		n = min_u64(len, sizeof(zeros));
+		if (send_all(sock, zeros, n) != SUCCESS)
+			return FAILURE;
+	}
+
+	return SUCCESS;
+}
+
+static int opt_reply(nbd_conn_t *c, uint32_t opt, uint32_t type,
+                     const void *data, uint32_t len)
+{
+	unsigned char hdr[20];
+
+	put64(hdr, NBD_REP_MAGIC);
+	put32(hdr + 8, opt);
+	put32(hdr + 12, type);
+	put32(hdr + 16, len);
+	if (send_all(c->sock, hdr, sizeof(hdr)) != SUCCESS ||
+	    (len && send_all(c->sock, data, len) != SUCCESS))
+		return FAILURE;
+
+	return SUCCESS;
+}
+
+static uint16_t transmission_flags(nbd_conn_t *c)
+{
+	uint16_t flags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH |
+	                 NBD_FLAG_SEND_FUA | NBD_FLAG_CAN_MULTI_CONN;
+
+	if (c->srv->opts->read_only)
+		flags |= NBD_FLAG_READ_ONLY;
+	/* Unfragmented reads make sense only with structured replies. */
+	if (c->structured)
+		flags |= NBD_FLAG_SEND_DF;
+
+	return flags;
+}
+
+/* Answers NBD_OPT_INFO or NBD_OPT_GO, setting acked if export was
+ * described (and not an error returned). */
+static int opt_info(nbd_conn_t *c, uint32_t opt, const unsigned char *data,
+                    uint32_t len, int *acked)
+{
+	unsigned char info[14];
+	uint32_t name_len, i;
+	uint16_t requests;
+	int block_size = 0;
+
+	*acked = 0;
+	if (len < 6 || (name_len = get32(data)) > len - 6 ||
+	    (requests = get16(data + 4 + name_len)) * 2 != len - 6 - name_len)
+		return opt_reply(c, opt, NBD_REP_ERR_INVALID, NULL, 0);
+	for (i = 0; i < requests; i++)
+		if (get16(data + 6 + name_len + 2 * i) == NBD_INFO_BLOCK_SIZE)
+			block_size = 1;
+
+	put16(info, NBD_INFO_EXPORT);
+	put64(info + 2, c->srv->size);
+	put16(info + 10, transmission_flags(c));
+	if (opt_reply(c, opt, NBD_REP_INFO, info, 12) != SUCCESS)
+		return FAILURE;
+	if (block_size) {
+		put16(info, NBD_INFO_BLOCK_SIZE);
+		put32(info + 2, 1);
+		put32(info + 6, NBD_PREF_LEN);
+		put32(info + 10, NBD_MAX_LEN);
+		if (opt_reply(c, opt, NBD_REP_INFO, info, 14) != SUCCESS)
+			return FAILURE;
+	}
+	*acked = 1;
+
+	return opt_reply(c, opt, NBD_REP_ACK, NULL, 0);
+}
+
+/* Answers NBD_OPT_LIST_META_CONTEXT or NBD_OPT_SET_META_CONTEXT. */
+static int opt_meta(nbd_conn_t *c, uint32_t opt, const unsigned char *data,
+                    uint32_t len)
+{
+	static const char ctx[] = NBD_META_ALLOCATION;
+	unsigned char reply[4 + sizeof(ctx) - 1];
+	uint32_t name_len, queries, q_len, i, p;
+	int list = opt == NBD_OPT_LIST_META_CONTEXT;
+	int match = 0;
+
+	if (!list && !c->structured)
+		return opt_reply(c, opt, NBD_REP_ERR_INVALID, NULL, 0);
+	if (len < 8 || (name_len = get32(data)) > len - 8)
+		return opt_reply(c, opt, NBD_REP_ERR_INVALID, NULL, 0);
+	queries = get32(data + 4 + name_len);
+	p = 8 + name_len;
+	for (i = 0; i < queries; i++) {
+		if (len - p < 4 || (q_len = get32(data + p)) > len - p - 4)
+			return opt_reply(c, opt, NBD_REP_ERR_INVALID, NULL, 0);
+		p += 4;
+		if ((q_len == sizeof(ctx) - 1 && !memcmp(data + p, ctx, q_len)) ||
+		    (list && q_len == 5 && !memcmp(data + p, "base:", 5)))
+			match = 1;
+		p += q_len;
+	}
+	if (p != len)
+		return opt_reply(c, opt, NBD_REP_ERR_INVALID, NULL, 0);
+	/* Listing without queries shows everything. */
+	if (list && !queries)
+		match = 1;
+	if (!list)
+		c->meta = match;
+
+	if (match) {
+		put32(reply, NBD_META_ALLOCATION_ID);
+		memcpy(reply + 4, ctx, sizeof(ctx) - 1);
+		if (opt_reply(c, opt, NBD_REP_META_CONTEXT, reply,
+		              sizeof(reply)) != SUCCESS)
+			return FAILURE;
+	}
+
+	return opt_reply(c, opt, NBD_REP_ACK, NULL, 0);
+}
+
+/* Negotiates export with client.
+ *
+ * \return SUCCESS if transmission should start, FAILURE otherwise
+ */
+static int handshake(nbd_conn_t *c)
+{
+	unsigned char buf[NBD_MAX_OPTION], hdr[18];
+	const char *name = c->srv->opts->name;
+	uint32_t client_flags, opt, len;
+	int no_zeroes, acked;
+
+	put64(hdr, NBD_MAGIC);
+	put64(hdr + 8, NBD_OPT_MAGIC);
+	put16(hdr + 16, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+	if (send_all(c->sock, hdr, 18) != SUCCESS ||
+	    recv_all(c->sock, hdr, 4) != SUCCESS)
+		return FAILURE;
+	client_flags = get32(hdr);
+	if (client_flags & ~(uint32_t)(NBD_FLAG_FIXED_NEWSTYLE |
+	                               NBD_FLAG_NO_ZEROES))
+		return FAILURE;
+	no_zeroes = client_flags & NBD_FLAG_NO_ZEROES;
+
+	for (;;) {
+		if (recv_all(c->sock, hdr, 16) != SUCCESS ||
+		    get64(hdr) != NBD_OPT_MAGIC)
+			return FAILURE;
+		opt = get32(hdr + 8);
+		len = get32(hdr + 12);
+		if (len > sizeof(buf) || recv_all(c->sock, buf, len) != SUCCESS)
+			return FAILURE;
+
+		switch (opt) {
+		case NBD_OPT_EXPORT_NAME:
+			put64(buf, c->srv->size);
+			put16(buf + 8, transmission_flags(c));
+			memset(buf + 10, 0, 124);
+			return send_all(c->sock, buf, no_zeroes ? 10 : 134);
+		case NBD_OPT_ABORT:
+			opt_reply(c, opt, NBD_REP_ACK, NULL, 0);
+			return FAILURE;
+		case NBD_OPT_LIST:
+			if (len) {
+				if (opt_reply(c, opt, NBD_REP_ERR_INVALID, NULL, 0)
+				    != SUCCESS)
+					return FAILURE;
+				break;
+			}
+			len = min_u32(strlen(name), sizeof(buf) - 4);
+			put32(buf, len);
+			memcpy(buf + 4, name, len);
+			if (opt_reply(c, opt, NBD_REP_SERVER, buf, 4 + len) != SUCCESS ||
+			    opt_reply(c, opt, NBD_REP_ACK, NULL, 0) != SUCCESS)
+				return FAILURE;
+			break;
+		case NBD_OPT_INFO:
+		case NBD_OPT_GO:
+			if (opt_info(c, opt, buf, len, &acked) != SUCCESS)
+				return FAILURE;
+			if (opt == NBD_OPT_GO && acked)
+				return SUCCESS;
+			break;
+		case NBD_OPT_STRUCTURED_REPLY:
+			if (len) {
+				if (opt_reply(c, opt, NBD_REP_ERR_INVALID, NULL, 0)
+				    != SUCCESS)
+					return FAILURE;
+				break;
+			}
+			c->structured = 1;
+			if (opt_reply(c, opt, NBD_REP_ACK, NULL, 0) != SUCCESS)
+				return FAILURE;
+			break;
+		case NBD_OPT_LIST_META_CONTEXT:
+		case NBD_OPT_SET_META_CONTEXT:
+			if (opt_meta(c, opt, buf, len) != SUCCESS)
+				return FAILURE;
+			break;
+		default:
+			if (opt_reply(c, opt, NBD_REP_ERR_UNSUP, NULL, 0) != SUCCESS)
+				return FAILURE;
+		}
+	}
+}
+
+/* Sends simple reply header (with send_lock held). */
+static int reply_simple(nbd_req_t *r, uint32_t err)
+{
+	unsigned char hdr[16];
+
+	put32(hdr, NBD_SIMPLE_REPLY_MAGIC);
+	put32(hdr + 4, err);
+	put64(hdr + 8, r->handle);
+
+	return send_all(r->conn->sock, hdr, sizeof(hdr));
+}
+
+/* Sends structured reply chunk header followed by \p data_len bytes of
+ * \p data, while whole chunk has \p len bytes (with send_lock held). */
+static int reply_chunk(nbd_req_t *r, uint16_t flags, uint16_t type,
+                       const void *data, uint32_t data_len, uint32_t len)
+{
+	unsigned char hdr[20];
+
+	put32(hdr, NBD_STRUCT_REPLY_MAGIC);
+	put16(hdr + 4, flags);
+	put16(hdr + 6, type);
+	put64(hdr + 8, r->handle);
+	put32(hdr + 16, len);
+	if (send_all(r->conn->sock, hdr, sizeof(hdr)) != SUCCESS ||
+	    (data_len && send_all(r->conn->sock, data, data_len) != SUCCESS))
+		return FAILURE;
+
+	return SUCCESS;
+}
+
+/* Replies with error (or success, if err is 0) without any data. */
+static int reply(nbd_req_t *r, uint32_t err)
+{
+	nbd_conn_t *c = r->conn;
+	unsigned char data[6];
+	int res;
+
+	pthread_mutex_lock(&c->send_lock);
+	if (!c->structured) {
+		res = reply_simple(r, err);
+	} else if (!err) {
+		res = reply_chunk(r, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_NONE,
+		                  NULL, 0, 0);
+	} else {
+		put32(data, err);
+		put16(data + 4, 0);
+		res = reply_chunk(r, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_ERROR,
+		                  data, sizeof(data), sizeof(data));
+	}
+	pthread_mutex_unlock(&c->send_lock);
+
+	return res;
+}
+
+/* Sends guest data as it is (unallocated ranges as zeros). */
+static int send_data(nbd_server_t *srv, int sock, uint64_t off, uint64_t len)
+{
+	vd_extent_t ext;
+
+	for (; len; off += ext.len, len -= ext.len) {
+		if (srv->ops->map(srv->vd, off, len, &ext) != SUCCESS)
+			return FAILURE;
+		if (ext.allocated
+		    ? io_send(sock, srv->vd->fd, ext.len, ext.off) != SUCCESS
+		    : send_zeros(sock, ext.len) != SUCCESS)
+			return FAILURE;
+	}
+
+	return SUCCESS;
+}
+
+/* Sends extents of guest data as separate chunks, unallocated ones as
+ * holes. Chunks of other requests may go in between, so connection is held
+ * for one chunk at a time. Failure of mapping is reported to client. */
+static int send_chunks(nbd_req_t *r)
+{
+	nbd_conn_t *c = r->conn;
+	nbd_server_t *srv = c->srv;
+	uint64_t off = r->off, len = r->len;
+	unsigned char data[12];
+	vd_extent_t ext;
+	int res;
+
+	for (; len; off += ext.len, len -= ext.len) {
+		if (srv->ops->map(srv->vd, off, len, &ext) != SUCCESS)
+			return reply(r, NBD_EIO);
+		put64(data, off);
+		pthread_mutex_lock(&c->send_lock);
+		if (!ext.allocated) {
+			put32(data + 8, ext.len);
+			res = reply_chunk(r, 0, NBD_REPLY_TYPE_OFFSET_HOLE, data, 12, 12);
+		} else {
+			res = reply_chunk(r, 0, NBD_REPLY_TYPE_OFFSET_DATA, data, 8,
+			                  8 + ext.len);
+			if (res == SUCCESS)
+				res = io_send(c->sock, srv->vd->fd, ext.len, ext.off);
+		}
+		pthread_mutex_unlock(&c->send_lock);
+		if (res != SUCCESS)
+			return FAILURE;
+	}
+
+	return reply(r, 0);
+}
+
+/* Sends reply to read. Once data has started, failure can only be reported
+ * by dropping connection. */
+static int serve_read(nbd_req_t *r)
+{
+	nbd_conn_t *c = r->conn;
+	unsigned char data[8];
+	int res;
+
+	if (r->len > NBD_MAX_LEN)
+		return reply(r, NBD_EOVERFLOW);
+	if (!r->len)
+		return reply(r, 0);
+	if (c->structured && !(r->flags & NBD_CMD_FLAG_DF))
+		return send_chunks(r);
+
+	/* Data comes in one piece, so connection is held until it's sent. */
+	pthread_mutex_lock(&c->send_lock);
+	if (c->structured) {
+		put64(data, r->off);
+		res = reply_chunk(r, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_OFFSET_DATA,
+		                  data, 8, 8 + r->len);
+	} else {
+		res = reply_simple(r, 0);
+	}
+	if (res == SUCCESS)
+		res = send_data(c->srv, c->sock, r->off, r->len);
+	pthread_mutex_unlock(&c->send_lock);
+
+	return res;
+}
+
+/* Describes allocation of requested range (one extent if client asks for
+ * one only). Neighbouring extents of the same state are merged. */
+static int serve_block_status(nbd_req_t *r)
+{
+	nbd_server_t *srv = r->conn->srv;
+	uint64_t off = r->off, end = r->off + r->len;
+	unsigned max = r->flags & NBD_CMD_FLAG_REQ_ONE ? 1 : NBD_MAX_EXTENTS;
+	unsigned char *data;
+	uint32_t state, n = 0, len;
+	vd_extent_t ext;
+	int res;
+
+	if (!r->conn->meta)
+		return reply(r, NBD_EINVAL);
+	if (!r->len)
+		return reply(r, NBD_EINVAL);
+	data = malloc(4 + 8 * max);
+	if (!data)
+		return reply(r, NBD_ENOMEM);
+
+	for (; off < end; off += ext.len) {
+		if (srv->ops->map(srv->vd, off, end - off, &ext) != SUCCESS) {
+			free(data);
+			return reply(r, NBD_EIO);
+		}
+		state = ext.allocated ? 0 : NBD_STATE_HOLE | NBD_STATE_ZERO;
+		if (n && get32(data + 4 + 8 * (n - 1) + 4) == state) {
+			len = get32(data + 4 + 8 * (n - 1));
+			put32(data + 4 + 8 * (n - 1), len + ext.len);
+			continue;
+		}
+		if (n == max)
+			break;
+		put32(data + 4 + 8 * n, ext.len);
+		put32(data + 4 + 8 * n + 4, state);
+		n++;
+	}
+	put32(data, NBD_META_ALLOCATION_ID);
+	pthread_mutex_lock(&r->conn->send_lock);
+	res = reply_chunk(r, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_BLOCK_STATUS,
+	                  data, 4 + 8 * n, 4 + 8 * n);
+	pthread_mutex_unlock(&r->conn->send_lock);
+	free(data);
+
+	return res;
+}
+
+/* Serves request and replies to it.
+ *
+ * \return FAILURE if reply could not be sent (whole)
+ */
+static int serve(nbd_req_t *r)
+{
+	nbd_conn_t *c = r->conn;
+	nbd_server_t *srv = c->srv;
+	int in_range = r->off <= srv->size && r->len <= srv->size - r->off;
+	uint32_t err = 0;
+	int res;
+
+	switch (r->type) {
+	case NBD_CMD_READ:
+	case NBD_CMD_BLOCK_STATUS:
+		if (!in_range) {
+			err = NBD_EINVAL;
+			break;
+		}
+		pthread_rwlock_rdlock(&srv->image_lock);
+		res = r->type == NBD_CMD_READ ? serve_read(r)
+		                              : serve_block_status(r);
+		pthread_rwlock_unlock(&srv->image_lock);
+		return res;
+	case NBD_CMD_WRITE:
+		if (!in_range) {
+			err = NBD_EINVAL;
+			break;
+		}
+		if (srv->opts->read_only) {
+			err = NBD_EPERM;
+			break;
+		}
+		pthread_rwlock_wrlock(&srv->image_lock);
+		if (r->len && srv->ops->write_at(srv->vd, r->data, r->len,
+		                                 r->off) != SUCCESS)
+			err = NBD_EIO;
+		pthread_rwlock_unlock(&srv->image_lock);
+		if (!err && (r->flags & NBD_CMD_FLAG_FUA) &&
+		    io_fsync(srv->vd->fd) != SUCCESS)
+			err = NBD_EIO;
+		break;
+	case NBD_CMD_FLUSH:
+		if (!srv->opts->read_only && io_fsync(srv->vd->fd) != SUCCESS)
+			err = NBD_EIO;
+		break;
+	default:
+		err = NBD_EINVAL;
+	}
+
+	return reply(r, err);
+}
+
+static void *worker_run(void *arg)
+{
+	nbd_server_t *srv = arg;
+	nbd_conn_t *c;
+	nbd_req_t *r;
+
+	ui = srv->ui;
+	pthread_mutex_lock(&srv->lock);
+	for (;;) {
+		while (!srv->head && !srv->stopping)
+			pthread_cond_wait(&srv->queued, &srv->lock);
+		if (!srv->head)
+			break;
+		r = srv->head;
+		srv->head = r->next;
+		if (!srv->head)
+			srv->tail = NULL;
+		srv->queue_len--;
+		pthread_cond_signal(&srv->room);
+		pthread_mutex_unlock(&srv->lock);
+
+		c = r->conn;
+		/* Client won't get the rest of this reply nor any later one. */
+		if (serve(r) != SUCCESS)
+			shutdown(c->sock, SHUT_RDWR);
+		free(r->data);
+		free(r);
+
+		pthread_mutex_lock(&srv->lock);
+		if (!--c->pending)
+			pthread_cond_broadcast(&c->drained);
+	}
+	pthread_mutex_unlock(&srv->lock);
+
+	return NULL;
+}
+
+/* Reads requests and queues them for worker threads. */
+static void transmission(nbd_conn_t *c)
+{
+	nbd_server_t *srv = c->srv;
+	unsigned char hdr[28];
+	nbd_req_t *r;
+
+	while (recv_all(c->sock, hdr, sizeof(hdr)) == SUCCESS &&
+	       get32(hdr) == NBD_REQUEST_MAGIC) {
+		r = calloc(1, sizeof(*r));
+		if (!r)
+			break;
+		r->conn = c;
+		r->flags = get16(hdr + 4);
+		r->type = get16(hdr + 6);
+		r->handle = get64(hdr + 8);
+		r->off = get64(hdr + 16);
+		r->len = get32(hdr + 24);
+		if (r->type == NBD_CMD_DISC) {
+			free(r);
+			break;
+		}
+		/* Data of too long write cannot be skipped reasonably. */
+		if (r->type == NBD_CMD_WRITE &&
+		    (r->len > NBD_MAX_LEN ||
+		     (r->len && !(r->data = malloc(r->len))) ||
+		     recv_all(c->sock, r->data, r->len) != SUCCESS)) {
+			free(r->data);
+			free(r);
+			break;
+		}
+
+		pthread_mutex_lock(&srv->lock);
+		while (srv->queue_len >= NBD_QUEUE_MAX)
+			pthread_cond_wait(&srv->room, &srv->lock);
+		if (srv->tail)
+			srv->tail->next = r;
+		else
+			srv->head = r;
+		srv->tail = r;
+		srv->queue_len++;
+		c->pending++;
+		pthread_cond_signal(&srv->queued);
+		pthread_mutex_unlock(&srv->lock);
+	}
+}
+
+static void *conn_run(void *arg)
+{
+	nbd_conn_t *c = arg;
+	nbd_server_t *srv = c->srv;
+	nbd_conn_t **p;
+
+	ui = srv->ui;
+	if (handshake(c) == SUCCESS)
+		transmission(c);
+
+	pthread_mutex_lock(&srv->lock);
+	while (c->pending)
+		pthread_cond_wait(&c->drained, &srv->lock);
+	for (p = &srv->conns; *p != c; p = &(*p)->next)
+		;
+	*p = c->next;
+	srv->conn_count--;
+	pthread_cond_broadcast(&srv->closed);
+	pthread_mutex_unlock(&srv->lock);
+
+	ui->log("NOTE    Connection %u closed.\n", c->id);
+	close(c->sock);
+	pthread_mutex_destroy(&c->send_lock);
+	pthread_cond_destroy(&c->drained);
+	free(c);
+
+	return NULL;
+}
+
+static void accept_conn(nbd_server_t *srv, int sock)
+{
+	nbd_conn_t *c = calloc(1, sizeof(*c));
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	if (!c) {
+		close(sock);
+		return;
+	}
+	c->srv = srv;
+	c->sock = sock;
+	pthread_mutex_init(&c->send_lock, NULL);
+	pthread_cond_init(&c->drained, NULL);
+
+	pthread_mutex_lock(&srv->lock);
+	c->id = ++srv->conn_ids;
+	c->next = srv->conns;
+	srv->conns = c;
+	srv->conn_count++;
+	pthread_mutex_unlock(&srv->lock);
+
+	ui->log("NOTE    Connection %u opened.\n", c->id);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, conn_run, c)) {
+		ui->log("ERROR   Cannot start thread of connection %u.\n", c->id);
+		/* Nothing was queued, so it can be closed right away. */
+		shutdown(sock, SHUT_RDWR);
+		conn_run(c);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+static int listen_on(const char *path)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	int sock;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		ui->log("ERROR   Socket path is too long.\n");
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	/* Socket left behind by previous server, but nothing else. */
+	if (!stat(path, &st) && S_ISSOCK(st.st_mode))
+		unlink(path);
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(sock, 16)) {
+		ui->log("ERROR   Cannot listen on %s: %s\n", path, strerror(errno));
+		if (sock >= 0)
+			close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+/* ==== Exposed functions definitions ======================================= */
+
+int nbd_serve(vd_t *vd, const vd_ops_t *ops, const nbd_opts_t *opts)
+{
+	nbd_server_t srv;
+	struct sigaction sa, old_int, old_term, old_pipe;
+	struct pollfd pfd;
+	pthread_t *workers;
+	vd_info_t info;
+	vd_extent_t ext;
+	nbd_conn_t *c;
+	unsigned i, started = 0;
+	int lsock, sock;
+
+	if (!ops->map || !ops->read_at || !ops->write_at || !ops->get_info) {
+		ui->log("ERROR   Serving is not supported for this format.\n");
+		return FAILURE;
+	}
+	/* The first access loads what's needed by concurrent ones. */
+	if (ops->get_info(vd, &info) != SUCCESS ||
+	    ops->map(vd, 0, 1, &ext) != SUCCESS)
+		return FAILURE;
+
+	memset(&srv, 0, sizeof(srv));
+	srv.vd = vd;
+	srv.ops = ops;
+	srv.opts = opts;
+	srv.size = info.disk_size;
+	srv.ui = ui;
+	pthread_rwlock_init(&srv.image_lock, NULL);
+	pthread_mutex_init(&srv.lock, NULL);
+	pthread_cond_init(&srv.queued, NULL);
+	pthread_cond_init(&srv.room, NULL);
+	pthread_cond_init(&srv.closed, NULL);
+
+	workers = malloc(opts->threads * sizeof(*workers));
+	lsock = workers ? listen_on(opts->socket) : -1;
+	if (lsock < 0) {
+		free(workers);
+		return FAILURE;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, &old_int);
+	sigaction(SIGTERM, &sa, &old_term);
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, &old_pipe);
+	stop_requested = 0;
+
+	for (i = 0; i < opts->threads; i++) {
+		if (pthread_create(&workers[i], NULL, worker_run, &srv))
+			break;
+		started++;
+	}
+	if (!started) {
+		ui->log("ERROR   Cannot start worker threads.\n");
+		stop_requested = 1;
+	}
+
+	ui->log("Serving %s (%"PRIu64" bytes%s) on %s with %u worker thread(s)\n"
+	        "Press Ctrl+C to stop.\n", opts->name, srv.size,
+	        opts->read_only ? ", read-only" : "", opts->socket, started);
+
+	pfd.fd = lsock;
+	pfd.events = POLLIN;
+	while (!stop_requested) {
+		if (poll(&pfd, 1, 1000) <= 0)
+			continue;
+		sock = accept(lsock, NULL, NULL);
+		if (sock >= 0)
+			accept_conn(&srv, sock);
+	}
+
+	ui->log("Stopping server\n");
+	close(lsock);
+	unlink(opts->socket);
+
+	/* Clients are disconnected, requests already read are served. */
+	pthread_mutex_lock(&srv.lock);
+	for (c = srv.conns; c; c = c->next)
+		shutdown(c->sock, SHUT_RDWR);
+	while (srv.conn_count)
+		pthread_cond_wait(&srv.closed, &srv.lock);
+	srv.stopping = 1;
+	pthread_cond_broadcast(&srv.queued);
+	pthread_mutex_unlock(&srv.lock);
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+
+	if (!opts->read_only && io_fsync(vd->fd) != SUCCESS)
+		ui->log("ERROR   Flushing image failed: %s\n", strerror(errno));
+
+	sigaction(SIGINT, &old_int, NULL);
+	sigaction(SIGTERM, &old_term, NULL);
+	sigaction(SIGPIPE, &old_pipe, NULL);
+	pthread_cond_destroy(&srv.closed);
+	pthread_cond_destroy(&srv.room);
+	pthread_cond_destroy(&srv.queued);
+	pthread_mutex_destroy(&srv.lock);
+	pthread_rwlock_destroy(&srv.image_lock);
+
+	return started ? SUCCESS : FAILURE;
+}
+
+#else /* __WIN32__ */
+
+int nbd_serve(vd_t *vd, const vd_ops_t *ops, const nbd_opts_t *opts)
+{
+	(void)vd;
+	(void)ops;
+	(void)opts;
+	fprintf(stderr, "Serving is not supported on this platform!\n");
+
+	return FAILURE;
+}
+
+#endif /* __WIN32__ */
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2013 Przemyslaw Pawelczyk <przemoc@gmail.com>
+ *
+ * This software is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ * See <http://www.gnu.org/licenses/gpl-2.0.txt>.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/** \file nbd.h
+ * NBD server.
+ *
+ * Image is exported over Network Block Device protocol (fixed newstyle
+ * negotiation) on Unix socket, so it can be attached with nbd-client or
+ * opened by qemu on a host without VirtualBox.
+ *
+ * Every connection has its own thread reading requests, which are served
+ * by pool of worker threads shared by all connections, so many requests are
+ * served at once. Reads and block status queries run in parallel, writes
+ * exclude them, as they may allocate blocks. Allocated data is sent straight
+ * from image file (see io_send()), unallocated ranges are sent as holes if
+ * client accepts structured replies. Block status ("base:allocation"
+ * metadata context) comes from block allocation map, so clients can skip
+ * unallocated regions.
+ *
+ * Server runs until it's interrupted (SIGINT or SIGTERM).
+ */
+
+#ifndef NBD_H
+#define NBD_H
+
+#include "common.h"
+#include "vd.h"
+
+/** Default number of worker threads. */
+#define NBD_DEFAULT_THREADS 4
+
+/** NBD server options. */
+typedef struct nbd_opts {
+	const char *socket;     /**< Path of Unix socket. */
+	const char *name;       /**< Name of export. */
+	unsigned threads;       /**< Worker threads. */
+	int read_only;          /**< Whether writes are refused. */
+} nbd_opts_t;
+
+/** Serves image \p vd (opened with ops->open()) until interrupted.
+ *
+ * \return \a SUCCESS or \a FAILURE (if server cannot be started)
+ */
+int nbd_serve(vd_t *vd, const vd_ops_t *ops, const nbd_opts_t *opts);
+
+#endif /* NBD_H */
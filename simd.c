@@ -0,0 +1,279 @@
+/*
+ * Copyright (C) 2013 Przemyslaw Pawelczyk <przemoc@gmail.com>
+ *
+ * This software is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ * See <http://www.gnu.org/licenses/gpl-2.0.txt>.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#include <string.h>
+
+#include "common.h"
+#include "simd.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+# define SIMD_X86 1
+# include <immintrin.h>
+#endif
+
+/* ==== Defines and Macros ================================================== */
+
+/** Bytes checked before any vector loop, as non-zero data rarely starts with
+ * many zeros. */
+#define HEAD_SIZE 16
+
+/** Unused map entry. */
+#define MAP_UNUSED UINT32_MAX
+/** Map entry of zeros. */
+#define MAP_ZERO   (UINT32_MAX - 1)
+
+/* ==== Non-exposed functions definitions =================================== */
+
+static int is_zero_scalar(const unsigned char *p, size_t len)
+{
+	uint64_t acc = 0, w;
+
+	for (; len && ((uintptr_t)p & 7); p++, len--)
+		acc |= *p;
+	for (; len >= 32; p += 32, len -= 32) {
+		memcpy(&w, p, 8);       acc |= w;
+		memcpy(&w, p + 8, 8);   acc |= w;
+		memcpy(&w, p + 16, 8);  acc |= w;
+		memcpy(&w, p + 24, 8);  acc |= w;
+		if (acc)
+			return 0;
+	}
+	for (; len; p++, len--)
+		acc |= *p;
+
+	return !acc;
+}
+
+#if SIMD_X86
+
+__attribute__((target("sse2")))
+static int is_zero_sse2(const unsigned char *p, size_t len)
+{
+	__m128i acc;
+	__m128i zero = _mm_setzero_si128();
+
+	for (; len >= 64; p += 64, len -= 64) {
+		acc = _mm_or_si128(
+		        _mm_or_si128(_mm_loadu_si128((const __m128i *)p),
+		                     _mm_loadu_si128((const __m128i *)(p + 16))),
+		        _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + 32)),
+		                     _mm_loadu_si128((const __m128i *)(p + 48))));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff)
+			return 0;
+	}
+
+	return is_zero_scalar(p, len);
+}
+
+__attribute__((target("avx2")))
+static int is_zero_avx2(const unsigned char *p, size_t len)
+{
+	__m256i acc;
+
+	for (; len >= 128; p += 128, len -= 128) {
+		acc = _mm256_or_si256(
+		        _mm256_or_si256(_mm256_loadu_si256((const __m256i *)p),
+		                        _mm256_loadu_si256((const __m256i *)(p + 32))),
+		        _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(p + 64)),
+		                        _mm256_loadu_si256((const __m256i *)(p + 96))));
+		if (!_mm256_testz_si256(acc, acc))
+			return 0;
+	}
+
+	return is_zero_sse2(p, len);
+}
+
+#endif /* SIMD_X86 */
+
+static void map_stats_scalar(const uint32_t *map, size_t n, map_stats_t *st)
+{
+	size_t i;
+
+	st->unused = 0;
+	st->zero = 0;
+	st->last = 0;
+	st->max = 0;
+	for (i = 0; i < n; i++) {
+		if (map[i] == MAP_UNUSED) {
+			st->unused++;
+			continue;
+		}
+		st->last = i + 1;
+		if (map[i] == MAP_ZERO)
+			st->zero++;
+		else if (st->max < map[i])
+			st->max = map[i];
+	}
+}
+
+/* Completes vector scan: adds statistics of n - done entries left after
+ * vector loop and looks for the last used entry within vector at last_vec
+ * (of width entries), if there is none after it. */
+static void map_stats_finish(const uint32_t *map, size_t n, size_t done,
+                             size_t last_vec, size_t width, map_stats_t *st)
+{
+	map_stats_t tail;
+
+	map_stats_scalar(map + done, n - done, &tail);
+	st->unused += tail.unused;
+	st->zero += tail.zero;
+	if (st->max < tail.max)
+		st->max = tail.max;
+	if (tail.last) {
+		st->last = done + tail.last;
+	} else if (last_vec != SIZE_MAX) {
+		for (st->last = last_vec + width; map[st->last - 1] == MAP_UNUSED; )
+			st->last--;
+	} else {
+		st->last = 0;
+	}
+}
+
+#if SIMD_X86
+
+static inline uint32_t sum_u32x4(const uint32_t *v)
+{
+	return v[0] + v[1] + v[2] + v[3];
+}
+
+__attribute__((target("sse4.1")))
+static void map_stats_sse41(const uint32_t *map, size_t n, map_stats_t *st)
+{
+	size_t i;
+	size_t last_vec = SIZE_MAX;
+	uint32_t lanes[3][4];
+	__m128i v, unused, zero;
+	__m128i m_unused = _mm_set1_epi32((int)MAP_UNUSED);
+	__m128i m_zero = _mm_set1_epi32((int)MAP_ZERO);
+	__m128i c_unused = _mm_setzero_si128();
+	__m128i c_zero = _mm_setzero_si128();
+	__m128i vmax = _mm_setzero_si128();
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		v = _mm_loadu_si128((const __m128i *)(map + i));
+		unused = _mm_cmpeq_epi32(v, m_unused);
+		zero = _mm_cmpeq_epi32(v, m_zero);
+		c_unused = _mm_sub_epi32(c_unused, unused);
+		c_zero = _mm_sub_epi32(c_zero, zero);
+		vmax = _mm_max_epu32(vmax,
+		                     _mm_andnot_si128(_mm_or_si128(unused, zero), v));
+		if (_mm_movemask_epi8(unused) != 0xffff)
+			last_vec = i;
+	}
+	_mm_storeu_si128((__m128i *)lanes[0], c_unused);
+	_mm_storeu_si128((__m128i *)lanes[1], c_zero);
+	_mm_storeu_si128((__m128i *)lanes[2], vmax);
+
+	st->unused = sum_u32x4(lanes[0]);
+	st->zero = sum_u32x4(lanes[1]);
+	st->max = max_u32(max_u32(lanes[2][0], lanes[2][1]),
+	                  max_u32(lanes[2][2], lanes[2][3]));
+	map_stats_finish(map, n, i, last_vec, 4, st);
+}
+
+__attribute__((target("avx2")))
+static void map_stats_avx2(const uint32_t *map, size_t n, map_stats_t *st)
+{
+	size_t i, j;
+	size_t last_vec = SIZE_MAX;
+	uint32_t lanes[3][8];
+	__m256i v, unused, zero;
+	__m256i m_unused = _mm256_set1_epi32((int)MAP_UNUSED);
+	__m256i m_zero = _mm256_set1_epi32((int)MAP_ZERO);
+	__m256i c_unused = _mm256_setzero_si256();
+	__m256i c_zero = _mm256_setzero_si256();
+	__m256i vmax = _mm256_setzero_si256();
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		v = _mm256_loadu_si256((const __m256i *)(map + i));
+		unused = _mm256_cmpeq_epi32(v, m_unused);
+		zero = _mm256_cmpeq_epi32(v, m_zero);
+		c_unused = _mm256_sub_epi32(c_unused, unused);
+		c_zero = _mm256_sub_epi32(c_zero, zero);
+		vmax = _mm256_max_epu32(vmax,
+		                        _mm256_andnot_si256(_mm256_or_si256(unused,
+		                                                            zero), v));
+		if (_mm256_movemask_epi8(unused) != -1)
+			last_vec = i;
+	}
+	_mm256_storeu_si256((__m256i *)lanes[0], c_unused);
+	_mm256_storeu_si256((__m256i *)lanes[1], c_zero);
+	_mm256_storeu_si256((__m256i *)lanes[2], vmax);
+
+	st->unused = sum_u32x4(lanes[0]) + sum_u32x4(lanes[0] + 4);
+	st->zero = sum_u32x4(lanes[1]) + sum_u32x4(lanes[1] + 4);
+	for (st->max = 0, j = 0; j < 8; j++)
+		st->max = max_u32(st->max, lanes[2][j]);
+	map_stats_finish(map, n, i, last_vec, 8, st);
+}
+
+#endif /* SIMD_X86 */
+
+static void map_stats_dispatch(const uint32_t *map, size_t n,
+                               map_stats_t *st);
+
+static void (*map_stats_impl)(const uint32_t *, size_t, map_stats_t *) =
+	map_stats_dispatch;
+
+static void map_stats_dispatch(const uint32_t *map, size_t n,
+                               map_stats_t *st)
+{
+#if SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		map_stats_impl = map_stats_avx2;
+	else if (__builtin_cpu_supports("sse4.1"))
+		map_stats_impl = map_stats_sse41;
+	else
+#endif
+		map_stats_impl = map_stats_scalar;
+
+	map_stats_impl(map, n, st);
+}
+
+static int is_zero_dispatch(const unsigned char *p, size_t len);
+
+static int (*is_zero)(const unsigned char *, size_t) = is_zero_dispatch;
+
+static int is_zero_dispatch(const unsigned char *p, size_t len)
+{
+#if SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		is_zero = is_zero_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		is_zero = is_zero_sse2;
+	else
+#endif
+		is_zero = is_zero_scalar;
+
+	return is_zero(p, len);
+}
+
+/* ==== Exposed functions definitions ======================================= */
+
+int mem_is_zero(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	size_t head = min_u64(len, HEAD_SIZE);
+
+	if (!is_zero_scalar(p, head))
+		return 0;
+
+	return is_zero(p + head, len - head);
+}
+
+void map_stats(const uint32_t *map, size_t n, map_stats_t *st)
+{
+	map_stats_impl(map, n, st);
+}
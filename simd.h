@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2013 Przemyslaw Pawelczyk <przemoc@gmail.com>
+ *
+ * This software is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ * See <http://www.gnu.org/licenses/gpl-2.0.txt>.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/** \file simd.h
+ * Vectorized helpers.
+ *
+ * On x86 the best implementation supported by CPU (AVX2, SSE4.1, SSE2) is
+ * chosen at runtime, elsewhere portable scalar code is used.
+ */
+
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Checks whether \p len bytes at \p buf are all zeros.
+ *
+ * \return 1 if they are, 0 otherwise
+ */
+int mem_is_zero(const void *buf, size_t len);
+
+/** Summary of 32-bit map entries, where UINT32_MAX marks unused entry and
+ * UINT32_MAX - 1 marks entry of zeros (e.g. VDI block allocation map).
+ * Other values are ordinary ones. */
+typedef struct map_stats {
+	size_t unused;      /**< Entries equal to UINT32_MAX. */
+	size_t zero;        /**< Entries equal to UINT32_MAX - 1. */
+	size_t last;        /**< Index of the last used entry + 1 (0 if none). */
+	uint32_t max;       /**< Highest ordinary entry (0 if none). */
+} map_stats_t;
+
+/** Summarizes \p n entries of \p map (n must be below 2^32). */
+void map_stats(const uint32_t *map, size_t n, map_stats_t *st);
+
+#endif /* SIMD_H */
@@ -0,0 +1,182 @@
+#!/bin/sh
+
+# Copyright (C) 2013 Przemyslaw Pawelczyk <przemoc@gmail.com>
+#
+# This software is free software; you can redistribute it and/or modify it
+# under the terms of the GNU General Public License version 2.
+# See <http://www.gnu.org/licenses/gpl-2.0.txt>.
+#
+# This software is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+# or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+# for more details.
+
+# vidma correctness checks
+#
+# Generates synthetic images with vdi-gen, runs operations on them and
+# compares checksums of guest data before and after, so any block lost or
+# misplaced on the way is caught. Writes done through NBD server are compared
+# with the same writes done through libvidma. Every operation is run both
+# with block allocation map in memory and with streamed one.
+#
+# Environment variables (defaults in brackets):
+#   VIDMA         vidma binary [./vidma]
+#   VDI_GEN       vdi-gen binary [./vdi-gen]
+#   VDI_CHECK     vdi-check binary [./vdi-check]
+#   VIDMA_OPTS    additional vidma options, e.g. "-e uring -b 4" []
+#   CHECK_DIR     directory to run in [/tmp]
+
+VIDMA="${VIDMA:-./vidma}"
+VDI_GEN="${VDI_GEN:-./vdi-gen}"
+VDI_CHECK="${VDI_CHECK:-./vdi-check}"
+VIDMA_OPTS="${VIDMA_OPTS:-}"
+CHECK_DIR="${CHECK_DIR:-/tmp}"
+
+# Images have 262144 blocks of 512 bytes, so BAM with its reverse map takes
+# 2 MB and memory limit of 1 MB makes it streamed.
+SIZE=128
+GEN_OPTS="-s $SIZE -B 512 -z 10"
+MODES="memory streamed"
+
+WORK=
+SERVER=
+cleanup() {
+	[ -z "$SERVER" ] || kill "$SERVER" 2>/dev/null
+	[ -z "$WORK" ] || rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+PASSED=0
+FAILED=0
+
+pass() {
+	PASSED=$((PASSED + 1))
+	echo "PASS  $*"
+}
+
+fail() {
+	FAILED=$((FAILED + 1))
+	echo "FAIL  $*"
+}
+
+# streamed_as_expected MODE
+# Tells whether logged run of vidma streamed BAM in streamed mode only.
+streamed_as_expected() {
+	if grep -q "map is streamed" "$WORK/log"; then
+		[ "$1" = streamed ]
+	else
+		[ "$1" = memory ]
+	fi
+}
+
+# vidma MODE ARGS...
+vidma() {
+	mode="$1"
+	shift
+	limit=
+	[ "$mode" = streamed ] && limit="-m 1"
+	yes | "$VIDMA" $VIDMA_OPTS $limit "$@" >"$WORK/log" 2>&1
+}
+
+# check NAME GEN_OPTIONS MB ARGS...
+# Runs vidma with ARGS on generated image, where IMAGE and COPY are replaced
+# with paths, and compares guest data of first MB megabytes of the result
+# with the original one.
+check() {
+	name="$1"
+	gen="$2"
+	msize="$3"
+	shift 3
+	for mode in $MODES; do
+		rm -f "$WORK/image.vdi" "$WORK/copy.vdi"
+		"$VDI_GEN" $GEN_OPTS $gen "$WORK/image.vdi" >/dev/null
+		before="$("$VDI_CHECK" sum "$WORK/image.vdi" "$msize")"
+		result="$WORK/image.vdi"
+		args=
+		for arg in "$@"; do
+			case "$arg" in
+			IMAGE) arg="$WORK/image.vdi" ;;
+			COPY)  arg="$WORK/copy.vdi"; result="$arg" ;;
+			esac
+			args="$args $arg"
+		done
+		if ! vidma "$mode" $args; then
+			fail "$name ($mode): vidma failed"
+			sed 's/^/      /' "$WORK/log"
+			continue
+		fi
+		after="$("$VDI_CHECK" sum "$result" "$msize")"
+		if ! streamed_as_expected "$mode"; then
+			fail "$name ($mode): map was not streamed"
+		elif [ -n "$before" ] && [ "$before" = "$after" ]; then
+			pass "$name ($mode)"
+		else
+			fail "$name ($mode): guest data differs"
+		fi
+	done
+}
+
+# serve NAME GEN_OPTIONS
+# Writes to generated image through NBD server and compares guest data with
+# the same writes done through libvidma.
+serve() {
+	name="$1"
+	gen="$2"
+	for mode in $MODES; do
+		rm -f "$WORK/image.vdi" "$WORK/copy.vdi" "$WORK/sock"
+		"$VDI_GEN" $GEN_OPTS $gen "$WORK/image.vdi" >/dev/null
+		cp "$WORK/image.vdi" "$WORK/copy.vdi"
+		limit=
+		[ "$mode" = streamed ] && limit="-m 1"
+		"$VIDMA" $VIDMA_OPTS $limit serve "$WORK/image.vdi" \
+		    --socket="$WORK/sock" >"$WORK/log" 2>&1 &
+		SERVER=$!
+		tries=50
+		while [ ! -S "$WORK/sock" ] && [ $tries -gt 0 ]; do
+			sleep 0.1
+			tries=$((tries - 1))
+		done
+		"$VDI_CHECK" nbd-write "$WORK/sock" 1 200
+		res=$?
+		kill "$SERVER"
+		wait "$SERVER" || res=1
+		SERVER=
+		if [ $res -ne 0 ]; then
+			fail "$name ($mode): writing through server failed"
+			sed 's/^/      /' "$WORK/log"
+			continue
+		fi
+		"$VDI_CHECK" write "$WORK/copy.vdi" 1 200
+		served="$("$VDI_CHECK" sum "$WORK/image.vdi")"
+		written="$("$VDI_CHECK" sum "$WORK/copy.vdi")"
+		if ! streamed_as_expected "$mode"; then
+			fail "$name ($mode): map was not streamed"
+		elif [ -n "$served" ] && [ "$served" = "$written" ]; then
+			pass "$name ($mode)"
+		else
+			fail "$name ($mode): guest data differs"
+		fi
+	done
+}
+
+WORK="$(mktemp -d "$CHECK_DIR/vidma-check.XXXXXX")" || exit 1
+
+GROW=$((SIZE * 2))
+GROW_BAM=$((SIZE * 4))
+SHRINK=$((SIZE / 2))
+check grow-in-place           "-t dynamic"        $SIZE   IMAGE $GROW
+check grow-with-bam-move      "-t dynamic -a 512" $SIZE   IMAGE $GROW_BAM
+check grow-by-copy            "-t dynamic -F 30"  $SIZE   IMAGE $GROW COPY
+check grow-fixed-in-place     "-t fixed -a 512"   $SIZE   IMAGE $GROW
+check grow-sparse-by-copy     "-t dynamic"        $SIZE   -s IMAGE $GROW COPY
+check shrink-in-place         "-t dynamic -F 30"  $SHRINK IMAGE $SHRINK
+check shrink-by-copy          "-t dynamic -F 30"  $SHRINK IMAGE $SHRINK COPY
+check compact-in-place        "-t dynamic -F 30"  $SIZE   compact IMAGE
+check compact-by-copy         "-t dynamic -F 30"  $SIZE   compact IMAGE COPY
+check defrag-in-place         "-t dynamic -F 50"  $SIZE   defrag IMAGE
+check defrag-by-copy          "-t dynamic -F 50"  $SIZE   defrag IMAGE COPY
+serve serve-writes-dynamic    "-t dynamic"
+serve serve-writes-fixed      "-t fixed"
+
+echo "$PASSED passed, $FAILED failed"
+[ $FAILED -eq 0 ]
@@ -0,0 +1,324 @@
+/*
+ * Copyright (C) 2013 Przemyslaw Pawelczyk <przemoc@gmail.com>
+ *
+ * This software is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ * See <http://www.gnu.org/licenses/gpl-2.0.txt>.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/* Helper of make check: sums guest data of images and writes to them
+ * through libvidma or NBD server. */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "common.h"
+#include "vidma.h"
+
+const char vdi_check_usage_string[] =
+	"Usage: %s sum IMAGE [MB]\n"
+	"       %s write IMAGE SEED COUNT\n"
+	"       %s nbd-write SOCKET SEED COUNT\n"
+	"\n"
+	"sum prints checksum of guest data (of first MB megabytes only, if\n"
+	"given), write does COUNT pseudo-random writes of guest data generated\n"
+	"from SEED through libvidma, nbd-write does the same ones through NBD\n"
+	"server listening on Unix SOCKET.\n";
+
+/** Size of chunks of guest data read at once. */
+#define CHUNK _1MB
+/** Longest pseudo-random write. */
+#define MAX_WRITE (256 * 1024)
+
+#define NBD_MAGIC              0x4e42444d41474943ULL /* "NBDMAGIC" */
+#define NBD_OPT_MAGIC          0x49484156454f5054ULL /* "IHAVEOPT" */
+#define NBD_REQUEST_MAGIC      0x25609513
+#define NBD_SIMPLE_REPLY_MAGIC 0x67446698
+#define NBD_FLAG_C_FIXED_NEWSTYLE (1 << 0)
+#define NBD_FLAG_C_NO_ZEROES      (1 << 1)
+#define NBD_OPT_EXPORT_NAME    1
+#define NBD_CMD_WRITE          1
+#define NBD_CMD_DISC           2
+#define NBD_CMD_FLUSH          3
+
+/** Target of pseudo-random writes. */
+typedef struct target {
+	vidma_image_t *img; /**< Image or NULL if NBD is used. */
+	int sock;
+	uint64_t handle;    /**< Handle of the next NBD request. */
+} target_t;
+
+static uint64_t rnd_state;
+
+static uint64_t rnd()
+{
+	/* xorshift64* */
+	rnd_state ^= rnd_state >> 12;
+	rnd_state ^= rnd_state << 25;
+	rnd_state ^= rnd_state >> 27;
+	return rnd_state * UINT64_C(2685821657736338717);
+}
+
+static int parse_u32(const char *str, uint32_t *val)
+{
+	char *tmp;
+	long long v = strtoll(str, &tmp, 10);
+
+	if (*str == '\0' || *tmp != '\0' || v < 0 || v > UINT32_MAX)
+		return FAILURE;
+	*val = v;
+
+	return SUCCESS;
+}
+
+static void log_line(void *ctx, const char *line)
+{
+	(void)ctx;
+	fprintf(stderr, "%s\n", line);
+}
+
+static const vidma_callbacks_t callbacks = { .log = log_line };
+
+static void put32(unsigned char *p, uint32_t v)
+{
+	int i;
+
+	for (i = 3; i >= 0; i--, v >>= 8)
+		p[i] = v;
+}
+
+static void put64(unsigned char *p, uint64_t v)
+{
+	int i;
+
+	for (i = 7; i >= 0; i--, v >>= 8)
+		p[i] = v;
+}
+
+static uint64_t get64(const unsigned char *p)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		v = v << 8 | p[i];
+
+	return v;
+}
+
+static int send_all(int sock, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = send(sock, p, len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return FAILURE;
+		p += n;
+		len -= n;
+	}
+
+	return SUCCESS;
+}
+
+static int recv_all(int sock, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = recv(sock, p, len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return FAILURE;
+		p += n;
+		len -= n;
+	}
+
+	return SUCCESS;
+}
+
+/* Connects to NBD server and selects default export, getting its size. */
+static int nbd_connect(target_t *t, const char *path, uint64_t *size)
+{
+	struct sockaddr_un addr;
+	unsigned char buf[18];
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return FAILURE;
+	strcpy(addr.sun_path, path);
+	t->sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (t->sock < 0 ||
+	    connect(t->sock, (struct sockaddr *)&addr, sizeof(addr)))
+		return FAILURE;
+
+	if (recv_all(t->sock, buf, 18) != SUCCESS ||
+	    get64(buf) != NBD_MAGIC || get64(buf + 8) != NBD_OPT_MAGIC)
+		return FAILURE;
+	put32(buf, NBD_FLAG_C_FIXED_NEWSTYLE | NBD_FLAG_C_NO_ZEROES);
+	put64(buf + 4, NBD_OPT_MAGIC);
+	put32(buf + 12, NBD_OPT_EXPORT_NAME);
+	if (send_all(t->sock, buf, 4) != SUCCESS ||
+	    send_all(t->sock, buf + 4, 12) != SUCCESS ||
+	    send_all(t->sock, "\0\0\0\0", 4) != SUCCESS ||
+	    recv_all(t->sock, buf, 10) != SUCCESS)
+		return FAILURE;
+	*size = get64(buf);
+
+	return SUCCESS;
+}
+
+/* Sends request and waits for its simple reply. */
+static int nbd_request(target_t *t, uint16_t type, const void *data,
+                       uint32_t len, uint64_t off)
+{
+	unsigned char req[28], rep[16];
+
+	put32(req, NBD_REQUEST_MAGIC);
+	put32(req + 4, type);
+	put64(req + 8, ++t->handle);
+	put64(req + 16, off);
+	put32(req + 24, len);
+	if (send_all(t->sock, req, sizeof(req)) != SUCCESS ||
+	    (type == NBD_CMD_WRITE && send_all(t->sock, data, len) != SUCCESS))
+		return FAILURE;
+	if (type == NBD_CMD_DISC)
+		return SUCCESS;
+	if (recv_all(t->sock, rep, sizeof(rep)) != SUCCESS ||
+	    get64(rep) >> 32 != NBD_SIMPLE_REPLY_MAGIC ||
+	    (uint32_t)get64(rep) || get64(rep + 8) != t->handle)
+		return FAILURE;
+
+	return SUCCESS;
+}
+
+static int write_at(target_t *t, const void *buf, uint32_t len, uint64_t off)
+{
+	if (t->img)
+		return vidma_write(t->img, buf, len, off);
+
+	return nbd_request(t, NBD_CMD_WRITE, buf, len, off);
+}
+
+/* Writes count pseudo-random pieces of data at pseudo-random offsets of disk
+ * of given size, so the same seed gives the same guest data whatever the
+ * target is. */
+static int random_writes(target_t *t, uint64_t size, uint32_t seed,
+                         uint32_t count)
+{
+	unsigned char *buf = malloc(MAX_WRITE);
+	uint64_t off, v;
+	uint32_t len, i, j;
+	int res = SUCCESS;
+
+	if (!buf)
+		return FAILURE;
+	rnd_state = UINT64_C(0x9e3779b97f4a7c15) ^ seed;
+	for (i = 0; i < count && res == SUCCESS && size; i++) {
+		off = rnd() % size;
+		len = min_u64(1 + rnd() % MAX_WRITE, size - off);
+		for (j = 0; j < len; j += sizeof(v)) {
+			v = rnd();
+			memcpy(buf + j, &v, min_u32(sizeof(v), len - j));
+		}
+		res = write_at(t, buf, len, off);
+	}
+	free(buf);
+
+	return res;
+}
+
+/* Prints FNV-1a hash of first len bytes of guest data. */
+static int sum(vidma_image_t *img, uint64_t len)
+{
+	unsigned char *buf = malloc(CHUNK);
+	uint64_t hash = UINT64_C(0xcbf29ce484222325);
+	uint64_t off;
+	uint32_t n, i;
+
+	if (!buf)
+		return FAILURE;
+	for (off = 0; off < len; off += n) {
+		n = min_u64(CHUNK, len - off);
+		if (vidma_read(img, buf, n, off) != VIDMA_SUCCESS) {
+			free(buf);
+			return FAILURE;
+		}
+		for (i = 0; i < n; i++)
+			hash = (hash ^ buf[i]) * UINT64_C(0x100000001b3);
+	}
+	free(buf);
+	printf("%016"PRIx64"\n", hash);
+
+	return SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+	target_t t = { NULL, -1, 0 };
+	vidma_info_t info;
+	uint64_t size;
+	uint32_t seed = 0, count = 0, msize = 0;
+	int res;
+
+	if (argc >= 3 && argc <= 4 && !strcmp(argv[1], "sum") &&
+	    (argc == 3 || parse_u32(argv[3], &msize) == SUCCESS)) {
+		t.img = vidma_open(argv[2], &callbacks);
+		if (!t.img || vidma_info(t.img, &info) != VIDMA_SUCCESS) {
+			fprintf(stderr, "%s: Cannot open image!\n", argv[2]);
+			exit(FAILURE);
+		}
+		size = info.disk_size;
+		if (msize)
+			size = min_u64(size, (uint64_t)msize * _1MB);
+		res = sum(t.img, size);
+		vidma_close(t.img);
+	} else if (argc == 5 && parse_u32(argv[3], &seed) == SUCCESS &&
+	           parse_u32(argv[4], &count) == SUCCESS &&
+	           !strcmp(argv[1], "write")) {
+		t.img = vidma_open(argv[2], &callbacks);
+		if (!t.img || vidma_info(t.img, &info) != VIDMA_SUCCESS) {
+			fprintf(stderr, "%s: Cannot open image!\n", argv[2]);
+			exit(FAILURE);
+		}
+		res = random_writes(&t, info.disk_size, seed, count);
+		vidma_close(t.img);
+	} else if (argc == 5 && parse_u32(argv[3], &seed) == SUCCESS &&
+	           parse_u32(argv[4], &count) == SUCCESS &&
+	           !strcmp(argv[1], "nbd-write")) {
+		if (nbd_connect(&t, argv[2], &size) != SUCCESS) {
+			fprintf(stderr, "%s: Cannot connect to NBD server!\n",
+			        argv[2]);
+			exit(FAILURE);
+		}
+		res = random_writes(&t, size, seed, count);
+		if (res == SUCCESS)
+			res = nbd_request(&t, NBD_CMD_FLUSH, NULL, 0, 0);
+		if (res == SUCCESS)
+			res = nbd_request(&t, NBD_CMD_DISC, NULL, 0, 0);
+		close(t.sock);
+	} else {
+		printf(vdi_check_usage_string, argv[0], argv[0], argv[0]);
+		exit(argc == 1 ? SUCCESS : FAILURE);
+	}
+	if (res != SUCCESS)
+		fprintf(stderr, "%s failed!\n", argv[1]);
+
+	return res;
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2013 Przemyslaw Pawelczyk <przemoc@gmail.com>
+ *
+ * This software is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ * See <http://www.gnu.org/licenses/gpl-2.0.txt>.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#include "common.h"
+#include "trace.h"
+#include "ui.h"
+
+/* ==== Defines and Macros ================================================== */
+
+/** Size of stdio buffer of trace file. */
+#define TRACE_BUFFER_SIZE _1MB
+
+int trace_enabled = 0;
+
+static FILE *trace_file = NULL;
+static uint64_t trace_origin;
+/** Serializes writes to trace file. */
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Last thread id given out (main thread gets 1). */
+static unsigned trace_tids = 0;
+static __thread unsigned trace_tid = 0;
+
+/* ==== Non-exposed functions definitions =================================== */
+
+/* Gives calling thread its id, naming it in trace (called with trace_lock
+ * held). */
+static unsigned thread_id()
+{
+	if (!trace_tid) {
+		trace_tid = ++trace_tids;
+		fprintf(trace_file,
+		        ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+		        "\"tid\":%u,\"args\":{\"name\":\"%s %u\"}}",
+		        trace_tid, trace_tid == 1 ? "main" : "worker", trace_tid);
+	}
+
+	return trace_tid;
+}
+
+/* ==== Exposed functions definitions ======================================= */
+
+int trace_open(const char *path)
+{
+	trace_file = fopen(path, "w");
+	if (!trace_file)
+		return FAILURE;
+	setvbuf(trace_file, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+	trace_origin = gettimeofday_us();
+	fprintf(trace_file, "[\n{\"name\":\"process_name\",\"ph\":\"M\","
+	                    "\"pid\":1,\"args\":{\"name\":\"vidma\"}}");
+	pthread_mutex_lock(&trace_lock);
+	thread_id();
+	pthread_mutex_unlock(&trace_lock);
+	trace_enabled = 1;
+
+	return SUCCESS;
+}
+
+void trace_close()
+{
+	if (!trace_file)
+		return;
+	trace_enabled = 0;
+	pthread_mutex_lock(&trace_lock);
+	fprintf(trace_file, "\n]\n");
+	fclose(trace_file);
+	trace_file = NULL;
+	pthread_mutex_unlock(&trace_lock);
+}
+
+void trace_span_record(const char *cat, const char *name, uint64_t start,
+                       uint64_t off, uint64_t len)
+{
+	uint64_t end = gettimeofday_us();
+	int err = errno;
+	unsigned tid;
+
+	pthread_mutex_lock(&trace_lock);
+	if (trace_file) {
+		tid = thread_id();
+		fputs(",\n{\"name\":", trace_file);
+		ui_json_string(trace_file, name);
+		fputs(",\"cat\":", trace_file);
+		ui_json_string(trace_file, cat);
+		fprintf(trace_file,
+		        ",\"ph\":\"X\",\"ts\":%"PRIu64",\"dur\":%"PRIu64","
+		        "\"pid\":1,\"tid\":%u",
+		        start - trace_origin, end - start, tid);
+		if (len)
+			fprintf(trace_file, ",\"args\":{\"off\":%"PRIu64","
+			                    "\"len\":%"PRIu64"}}", off, len);
+		else
+			fputc('}', trace_file);
+	}
+	pthread_mutex_unlock(&trace_lock);
+	errno = err;
+}
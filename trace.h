@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2013 Przemyslaw Pawelczyk <przemoc@gmail.com>
+ *
+ * This software is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ * See <http://www.gnu.org/licenses/gpl-2.0.txt>.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/** \file trace.h
+ * Event timeline in Chrome trace format (JSON), viewable in Perfetto or
+ * chrome://tracing.
+ *
+ * Spans are written as complete events, i.e. when they end, so the caller
+ * remembers only start time taken with trace_now(). If trace is not
+ * enabled, trace_now() and trace_span() boil down to a single branch.
+ * Spans can be recorded from any thread.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "common.h"
+
+/** Whether trace is being written (set by trace_open() only). */
+extern int trace_enabled;
+
+/** Starts writing trace to file at \p path.
+ *
+ * \return \a SUCCESS or \a FAILURE
+ */
+int trace_open(const char *path);
+
+/** Finishes trace file. */
+void trace_close();
+
+/** Records span of \p cat category called \p name, lasting from \p start
+ * till now. \p off and \p len are attached as arguments, if \p len is not 0.
+ * errno is preserved.
+ */
+void trace_span_record(const char *cat, const char *name, uint64_t start,
+                       uint64_t off, uint64_t len);
+
+/** Returns start time for trace_span() (0 if trace is not enabled). */
+static inline uint64_t trace_now()
+{
+	return trace_enabled ? gettimeofday_us() : 0;
+}
+
+/** Records span if trace is enabled (see trace_span_record()). */
+#define trace_span(cat, name, start, off, len) \
+	do { \
+		if (trace_enabled) \
+			trace_span_record(cat, name, start, off, len); \
+	} while (0)
+
+#endif /* TRACE_H */
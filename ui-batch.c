@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2013 Przemyslaw Pawelczyk <przemoc@gmail.com>
+ *
+ * This software is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ * See <http://www.gnu.org/licenses/gpl-2.0.txt>.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "common.h"
+#include "ui.h"
+
+/* ==== Defines and Macros ================================================== */
+
+static int steps = 0;
+static int step = 0;
+
+/* ==== Exposed functions prototypes ======================================== */
+
+static int batch_log(const char *format, ...);
+static int batch_yesno(const char *format, ...);
+static int batch_start_op(const char *title, int steps_no);
+static int batch_end_op();
+static int batch_next_step(const char *name);
+static int batch_set_step_prog_max(uint64_t max);
+static int batch_set_step_prog_val(uint64_t val);
+
+ui_ops_t ui_batch = {
+	.log               = batch_log,
+	.yesno             = batch_yesno,
+	.start_op          = batch_start_op,
+	.end_op            = batch_end_op,
+	.next_step         = batch_next_step,
+	.set_step_prog_max = batch_set_step_prog_max,
+	.set_step_prog_val = batch_set_step_prog_val,
+};
+
+/* ==== Exposed functions definitions ======================================= */
+
+static int batch_log(const char *format, ...)
+{
+	va_list ap;
+	int ret;
+
+	if (step)
+		printf("[%d/%d] ", step, steps);
+	va_start(ap, format);
+	ret = vprintf(format, ap);
+	va_end(ap);
+	fflush(stdout);
+
+	return ret;
+}
+
+/* Questions are answered by putting image into manifest. */
+static int batch_yesno(const char *format, ...)
+{
+	va_list ap;
+
+	puts("");
+	va_start(ap, format);
+	vprintf(format, ap);
+	va_end(ap);
+	puts(" (y/N) y (batch mode)");
+	fflush(stdout);
+
+	return SUCCESS;
+}
+
+static int batch_start_op(const char *title, int steps_no)
+{
+	steps = steps_no;
+	step = 0;
+
+	printf("\nOperation: %s\n", title);
+	fflush(stdout);
+
+	return 0;
+}
+
+static int batch_end_op()
+{
+	step = 0;
+	steps = 0;
+	puts("Operation finished");
+	fflush(stdout);
+
+	return 0;
+}
+
+static int batch_next_step(const char *name)
+{
+	step++;
+	printf("[%d/%d] %s\n", step, steps, name);
+	fflush(stdout);
+	__atomic_store_n(&ui_progress.bytes, 0, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+static int batch_set_step_prog_max(uint64_t max)
+{
+	__atomic_store_n(&ui_progress.val, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ui_progress.max, max, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+static int batch_set_step_prog_val(uint64_t val)
+{
+	__atomic_store_n(&ui_progress.val, val, __ATOMIC_RELAXED);
+
+	return 0;
+}
@@ -11,16 +11,38 @@
  * for more details.
  */
 
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "ui.h"
 
+/* ==== Defines and Macros ================================================== */
+
+/** Interval between progress refreshes on terminal (in microseconds). */
+#define REFRESH_TTY_US   250000
+/** Interval between progress refreshes otherwise (in microseconds). */
+#define REFRESH_FILE_US 5000000
+
+__thread ui_ops_t *ui = &ui_cli;
+ui_progress_t ui_progress;
+
 static int steps = 0;
 static int step = 0;
-static uint64_t pmax = 0;
-static uint64_t pval = 0;
+static int step_done = 1;
+static uint64_t step_start = 0;
+/** Length of progress text shown in current line. */
+static int drawn = 0;
+
+/** Serializes writes to stdout between main thread and reporter. */
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reporter_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t reporter;
+static int reporter_running = 0;
+static int reporter_stop = 0;
 
 /* ==== Exposed functions prototypes ======================================== */
 
@@ -42,6 +64,97 @@ ui_ops_t ui_cli = {
 	.set_step_prog_val = cli_set_step_prog_val,
 };
 
+/* ==== Non-exposed functions definitions =================================== */
+
+/* Replaces progress text shown in current line with given one (called with
+ * out_lock held). */
+static void redraw(const char *text)
+{
+	int old = drawn, len, pad;
+
+	for (pad = old; pad > 0; pad--)
+		putchar('\b');
+	len = printf("%s", text);
+	for (pad = old - len; pad > 0; pad--)
+		putchar(' ');
+	for (pad = old - len; pad > 0; pad--)
+		putchar('\b');
+	drawn = len;
+	fflush(stdout);
+}
+
+/* Shows percentage, throughput and ETA of current step (called with
+ * out_lock held). */
+static void draw_progress()
+{
+	uint64_t val = __atomic_load_n(&ui_progress.val, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&ui_progress.max, __ATOMIC_RELAXED);
+	uint64_t bytes = __atomic_load_n(&ui_progress.bytes, __ATOMIC_RELAXED);
+	uint64_t elapsed = max_u64(gettimeofday_us() - step_start, 1);
+	uint64_t eta;
+	char text[80];
+	int len;
+
+	if (step_done || max <= 1)
+		return;
+	val = min_u64(val, max);
+	len = snprintf(text, sizeof(text), "%u.%u%%",
+	               (unsigned)(val * 100 / max),
+	               (unsigned)(val * 1000 / max % 10));
+	if (bytes)
+		len += snprintf(text + len, sizeof(text) - len, " %.1f MB/s",
+		                (double)bytes / _1MB / (elapsed / 1e6));
+	if (val && val < max) {
+		eta = (double)elapsed * (max - val) / val / 1e6;
+		snprintf(text + len, sizeof(text) - len, " ETA %u:%02u:%02u",
+		         (unsigned)(eta / 3600), (unsigned)(eta / 60 % 60),
+		         (unsigned)(eta % 60));
+	}
+	redraw(text);
+}
+
+static void *report(void *arg)
+{
+	struct timespec ts;
+	uint64_t at;
+	uint64_t interval = isatty(STDOUT_FILENO) ? REFRESH_TTY_US
+	                                          : REFRESH_FILE_US;
+
+	(void)arg;
+	pthread_mutex_lock(&out_lock);
+	while (!reporter_stop) {
+		at = gettimeofday_us() + interval;
+		ts.tv_sec = at / 1000000;
+		ts.tv_nsec = at % 1000000 * 1000;
+		pthread_cond_timedwait(&reporter_cond, &out_lock, &ts);
+		if (!reporter_stop)
+			draw_progress();
+	}
+	pthread_mutex_unlock(&out_lock);
+
+	return NULL;
+}
+
+static void start_reporter()
+{
+	if (reporter_running)
+		return;
+	reporter_stop = 0;
+	reporter_running = !pthread_create(&reporter, NULL, report, NULL);
+}
+
+static void stop_reporter()
+{
+	if (!reporter_running)
+		return;
+	pthread_mutex_lock(&out_lock);
+	reporter_stop = 1;
+	pthread_cond_signal(&reporter_cond);
+	pthread_mutex_unlock(&out_lock);
+	pthread_join(reporter, NULL);
+	reporter_running = 0;
+}
+
 /* ==== Exposed functions definitions ======================================= */
 
 static int cli_log(const char *format, ...)
@@ -49,11 +162,15 @@ static int cli_log(const char *format, ...)
 	va_list ap;
 	int ret;
 
+	pthread_mutex_lock(&out_lock);
+	if (drawn)
+		redraw("");
 	if (step)
 		printf("[%d/%d] ", step, steps);
 	va_start(ap, format);
 	ret = vprintf(format, ap);
 	va_end(ap);
+	pthread_mutex_unlock(&out_lock);
 
 	return ret;
 }
@@ -79,12 +196,14 @@ static int cli_start_op(const char *title, int steps_no)
 {
 	steps = steps_no;
 	step = 0;
+	start_reporter();
 
 	return printf("\nOperation: %s\n", title);
 }
 
 static int cli_end_op()
 {
+	stop_reporter();
 	step = 0;
 	steps = 0;
 	puts("Operation finished");
@@ -94,8 +213,15 @@ static int cli_end_op()
 
 static int cli_next_step(const char *name)
 {
+	pthread_mutex_lock(&out_lock);
 	step++;
+	step_done = 0;
+	drawn = 0;
 	printf("[%d/%d] %s: ", step, steps, name);
+	fflush(stdout);
+	step_start = gettimeofday_us();
+	__atomic_store_n(&ui_progress.bytes, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&out_lock);
 	cli_set_step_prog_max(1);
 
 	return 0;
@@ -103,28 +229,26 @@ static int cli_next_step(const char *name)
 
 static int cli_set_step_prog_max(uint64_t max)
 {
-	pmax = max;
-	pval = 0;
+	__atomic_store_n(&ui_progress.val, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ui_progress.max, max, __ATOMIC_RELAXED);
 
 	return 0;
 }
 
+/* Only stores the value, reporter shows it. Completion is shown at once. */
 static int cli_set_step_prog_val(uint64_t val)
 {
-	static int len = 0;
-
-	pval = val;
-	if (pmax > 1) {
-		while (len) {
-			putchar('\b');
-			len--;
-		}
-		len = printf("%"PRIu64"/%"PRIu64" ", pval, pmax);
-	}
-	if (pval == pmax) {
+	__atomic_store_n(&ui_progress.val, val, __ATOMIC_RELAXED);
+	if (val != __atomic_load_n(&ui_progress.max, __ATOMIC_RELAXED))
+		return 0;
+
+	pthread_mutex_lock(&out_lock);
+	if (!step_done) {
+		redraw("");
 		puts("Done");
-		len = 0;
+		step_done = 1;
 	}
+	pthread_mutex_unlock(&out_lock);
 
-	return len;
+	return 0;
 }
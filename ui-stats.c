@@ -0,0 +1,281 @@
+/*
+ * Copyright (C) 2013 Przemyslaw Pawelczyk <przemoc@gmail.com>
+ *
+ * This software is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ * See <http://www.gnu.org/licenses/gpl-2.0.txt>.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "io.h"
+#include "ui.h"
+
+/* ==== Defines and Macros ================================================== */
+
+#define NAME_SIZE 64
+
+/** Statistics of single step. */
+typedef struct stats_phase {
+	char name[NAME_SIZE];
+	uint64_t start;     /**< Start time (in microseconds). */
+	uint64_t wall;      /**< Duration (in microseconds). */
+	io_stats_t io;      /**< I/O done within step (peaks are absolute). */
+} stats_phase_t;
+
+/** Statistics of single operation. */
+typedef struct stats_op {
+	char name[NAME_SIZE];
+	uint64_t start;
+	uint64_t wall;
+	int completed;      /**< Whether end_op() was reached. */
+	stats_phase_t *phases;
+	unsigned phase_count;
+} stats_op_t;
+
+static ui_ops_t *inner = &ui_cli;
+static uint64_t origin;
+static io_stats_t io_origin;
+static io_stats_t io_phase;
+static stats_op_t *ops = NULL;
+static unsigned op_count = 0;
+static int in_op = 0;
+static int in_phase = 0;
+/** Peaks over finished steps (engine counters are reset at every step). */
+static uint64_t buf_peak = 0;
+static uint64_t fsync_max_us = 0;
+
+/* ==== Exposed functions prototypes ======================================== */
+
+static int stats_log(const char *format, ...);
+static int stats_yesno(const char *format, ...);
+static int stats_start_op(const char *title, int steps_no);
+static int stats_end_op();
+static int stats_next_step(const char *name);
+static int stats_set_step_prog_max(uint64_t max);
+static int stats_set_step_prog_val(uint64_t val);
+
+ui_ops_t ui_stats = {
+	.log               = stats_log,
+	.yesno             = stats_yesno,
+	.start_op          = stats_start_op,
+	.end_op            = stats_end_op,
+	.next_step         = stats_next_step,
+	.set_step_prog_max = stats_set_step_prog_max,
+	.set_step_prog_val = stats_set_step_prog_val,
+};
+
+/* ==== Non-exposed functions definitions =================================== */
+
+/* Computes I/O done since \p from, taking peaks as they are. */
+static void io_since(io_stats_t *diff, const io_stats_t *from)
+{
+	io_stats_t now;
+
+	io_stats_get(&now);
+	diff->read_bytes   = now.read_bytes   - from->read_bytes;
+	diff->write_bytes  = now.write_bytes  - from->write_bytes;
+	diff->kernel_bytes = now.kernel_bytes - from->kernel_bytes;
+	diff->reads        = now.reads        - from->reads;
+	diff->writes       = now.writes       - from->writes;
+	diff->other_calls  = now.other_calls  - from->other_calls;
+	diff->fsyncs       = now.fsyncs       - from->fsyncs;
+	diff->fsync_us     = now.fsync_us     - from->fsync_us;
+	diff->fsync_max_us = now.fsync_max_us;
+	diff->buf_bytes    = now.buf_bytes;
+	diff->buf_peak     = now.buf_peak;
+}
+
+static void close_phase()
+{
+	stats_op_t *op;
+	stats_phase_t *phase;
+
+	if (!in_phase)
+		return;
+	op = &ops[op_count - 1];
+	phase = &op->phases[op->phase_count - 1];
+	phase->wall = gettimeofday_us() - phase->start;
+	io_since(&phase->io, &io_phase);
+	buf_peak = max_u64(buf_peak, phase->io.buf_peak);
+	fsync_max_us = max_u64(fsync_max_us, phase->io.fsync_max_us);
+	in_phase = 0;
+}
+
+static void close_op()
+{
+	if (!in_op)
+		return;
+	close_phase();
+	ops[op_count - 1].wall = gettimeofday_us() - ops[op_count - 1].start;
+	in_op = 0;
+}
+
+static void print_io(FILE *f, const io_stats_t *io, const char *indent)
+{
+	fprintf(f,
+	        "%s\"read_bytes\": %"PRIu64",\n"
+	        "%s\"write_bytes\": %"PRIu64",\n"
+	        "%s\"kernel_copy_bytes\": %"PRIu64",\n"
+	        "%s\"syscalls\": { \"read\": %"PRIu64", \"write\": %"PRIu64", "
+	        "\"fsync\": %"PRIu64", \"other\": %"PRIu64" },\n"
+	        "%s\"fsync_us\": { \"total\": %"PRIu64", \"max\": %"PRIu64" },\n"
+	        "%s\"peak_buffer_bytes\": %"PRIu64,
+	        indent, io->read_bytes,
+	        indent, io->write_bytes,
+	        indent, io->kernel_bytes,
+	        indent, io->reads, io->writes, io->fsyncs, io->other_calls,
+	        indent, io->fsync_us, io->fsync_max_us,
+	        indent, io->buf_peak);
+}
+
+/* ==== Exposed functions definitions ======================================= */
+
+void ui_stats_start(ui_ops_t *wrapped)
+{
+	inner = wrapped;
+	origin = gettimeofday_us();
+	io_stats_reset_peaks();
+	io_stats_get(&io_origin);
+}
+
+void ui_stats_write_json(FILE *f, int result)
+{
+	io_stats_t total;
+	uint64_t rss = 0;
+	unsigned i, j;
+
+	close_op();
+	io_since(&total, &io_origin);
+	total.buf_peak = max_u64(total.buf_peak, buf_peak);
+	total.fsync_max_us = max_u64(total.fsync_max_us, fsync_max_us);
+	get_peak_rss(&rss);
+
+	fprintf(f, "{\n"
+	           "  \"result\": \"%s\",\n"
+	           "  \"wall_us\": %"PRIu64",\n"
+	           "  \"peak_rss_bytes\": %"PRIu64",\n",
+	        result == SUCCESS ? "success" : "failure",
+	        gettimeofday_us() - origin, rss);
+	print_io(f, &total, "  ");
+	fprintf(f, ",\n  \"operations\": [");
+	for (i = 0; i < op_count; i++) {
+		fprintf(f, "%s\n    {\n      \"name\": ", i ? "," : "");
+		ui_json_string(f, ops[i].name);
+		fprintf(f, ",\n"
+		           "      \"completed\": %s,\n"
+		           "      \"wall_us\": %"PRIu64",\n"
+		           "      \"phases\": [",
+		        ops[i].completed ? "true" : "false", ops[i].wall);
+		for (j = 0; j < ops[i].phase_count; j++) {
+			stats_phase_t *phase = &ops[i].phases[j];
+
+			fprintf(f, "%s\n        {\n          \"name\": ", j ? "," : "");
+			ui_json_string(f, phase->name);
+			fprintf(f, ",\n"
+			           "          \"start_us\": %"PRIu64",\n"
+			           "          \"wall_us\": %"PRIu64",\n",
+			        phase->start - origin, phase->wall);
+			print_io(f, &phase->io, "          ");
+			fprintf(f, "\n        }");
+		}
+		fprintf(f, "%s]\n    }", ops[i].phase_count ? "\n      " : "");
+	}
+	fprintf(f, "%s]\n}\n", op_count ? "\n  " : "");
+	fflush(f);
+}
+
+static int stats_log(const char *format, ...)
+{
+	va_list ap;
+	char buf[4096];
+
+	va_start(ap, format);
+	vsnprintf(buf, sizeof(buf), format, ap);
+	va_end(ap);
+
+	return inner->log("%s", buf);
+}
+
+static int stats_yesno(const char *format, ...)
+{
+	va_list ap;
+	char buf[4096];
+
+	va_start(ap, format);
+	vsnprintf(buf, sizeof(buf), format, ap);
+	va_end(ap);
+
+	return inner->yesno("%s", buf);
+}
+
+static int stats_start_op(const char *title, int steps_no)
+{
+	stats_op_t *op;
+
+	close_op();
+	op = realloc(ops, (op_count + 1) * sizeof(*ops));
+	if (op) {
+		ops = op;
+		op = &ops[op_count++];
+		memset(op, 0, sizeof(*op));
+		snprintf(op->name, sizeof(op->name), "%s", title);
+		op->start = gettimeofday_us();
+		in_op = 1;
+	}
+
+	return inner->start_op(title, steps_no);
+}
+
+static int stats_end_op()
+{
+	if (in_op) {
+		ops[op_count - 1].completed = 1;
+		close_op();
+	}
+
+	return inner->end_op();
+}
+
+static int stats_next_step(const char *name)
+{
+	stats_op_t *op;
+	stats_phase_t *phase;
+
+	if (in_op) {
+		close_phase();
+		op = &ops[op_count - 1];
+		phase = realloc(op->phases, (op->phase_count + 1) * sizeof(*phase));
+		if (phase) {
+			op->phases = phase;
+			phase = &op->phases[op->phase_count++];
+			memset(phase, 0, sizeof(*phase));
+			snprintf(phase->name, sizeof(phase->name), "%s", name);
+			io_stats_reset_peaks();
+			io_stats_get(&io_phase);
+			phase->start = gettimeofday_us();
+			in_phase = 1;
+		}
+	}
+
+	return inner->next_step(name);
+}
+
+static int stats_set_step_prog_max(uint64_t max)
+{
+	return inner->set_step_prog_max(max);
+}
+
+static int stats_set_step_prog_val(uint64_t val)
+{
+	return inner->set_step_prog_val(val);
+}
@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2013 Przemyslaw Pawelczyk <przemoc@gmail.com>
+ *
+ * This software is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ * See <http://www.gnu.org/licenses/gpl-2.0.txt>.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "common.h"
+#include "trace.h"
+#include "ui.h"
+
+/* ==== Defines and Macros ================================================== */
+
+#define NAME_SIZE 64
+
+static ui_ops_t *inner = &ui_cli;
+static char op_name[NAME_SIZE];
+static char step_name[NAME_SIZE];
+static uint64_t op_start = 0;
+static uint64_t step_start = 0;
+
+/* ==== Exposed functions prototypes ======================================== */
+
+static int trace_log(const char *format, ...);
+static int trace_yesno(const char *format, ...);
+static int trace_start_op(const char *title, int steps_no);
+static int trace_end_op();
+static int trace_next_step(const char *name);
+static int trace_set_step_prog_max(uint64_t max);
+static int trace_set_step_prog_val(uint64_t val);
+
+ui_ops_t ui_trace = {
+	.log               = trace_log,
+	.yesno             = trace_yesno,
+	.start_op          = trace_start_op,
+	.end_op            = trace_end_op,
+	.next_step         = trace_next_step,
+	.set_step_prog_max = trace_set_step_prog_max,
+	.set_step_prog_val = trace_set_step_prog_val,
+};
+
+/* ==== Non-exposed functions definitions =================================== */
+
+static void end_step()
+{
+	if (!step_start)
+		return;
+	trace_span("step", step_name, step_start, 0, 0);
+	step_start = 0;
+}
+
+static void end_op()
+{
+	if (!op_start)
+		return;
+	end_step();
+	trace_span("op", op_name, op_start, 0, 0);
+	op_start = 0;
+}
+
+/* ==== Exposed functions definitions ======================================= */
+
+void ui_trace_start(ui_ops_t *wrapped)
+{
+	inner = wrapped;
+}
+
+void ui_trace_stop()
+{
+	end_op();
+}
+
+static int trace_log(const char *format, ...)
+{
+	va_list ap;
+	char buf[4096];
+
+	va_start(ap, format);
+	vsnprintf(buf, sizeof(buf), format, ap);
+	va_end(ap);
+
+	return inner->log("%s", buf);
+}
+
+static int trace_yesno(const char *format, ...)
+{
+	va_list ap;
+	char buf[4096];
+	uint64_t start = trace_now();
+	int res;
+
+	va_start(ap, format);
+	vsnprintf(buf, sizeof(buf), format, ap);
+	va_end(ap);
+
+	res = inner->yesno("%s", buf);
+	trace_span("ui", "Waiting for answer", start, 0, 0);
+
+	return res;
+}
+
+static int trace_start_op(const char *title, int steps_no)
+{
+	end_op();
+	snprintf(op_name, sizeof(op_name), "%s", title);
+	op_start = trace_now();
+
+	return inner->start_op(title, steps_no);
+}
+
+static int trace_end_op()
+{
+	end_op();
+
+	return inner->end_op();
+}
+
+static int trace_next_step(const char *name)
+{
+	end_step();
+	snprintf(step_name, sizeof(step_name), "%s", name);
+	step_start = trace_now();
+
+	return inner->next_step(name);
+}
+
+static int trace_set_step_prog_max(uint64_t max)
+{
+	return inner->set_step_prog_max(max);
+}
+
+static int trace_set_step_prog_val(uint64_t val)
+{
+	return inner->set_step_prog_val(val);
+}
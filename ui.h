@@ -13,12 +13,17 @@
 
 /** \file ui.h
  * User interface common stuff.
+ *
+ * Progress of the current step is kept in \a ui_progress counters updated
+ * with atomic operations, so they can be bumped from any thread (e.g. by the
+ * I/O engine) without locking. UI reads them at its own pace.
  */
 
 #ifndef UI_H
 #define UI_H
 
 #include <inttypes.h>
+#include <stdio.h>
 
 /** UI operations that must be supported. */
 typedef struct ui_ops {
@@ -49,14 +54,71 @@ typedef struct ui_ops {
 
 	/* set_step_prog_val(uint64_t val) */
 	int (*set_step_prog_val)(uint64_t);
-	/**< Sets current step progress value. */
+	/**< Sets current step progress value (cheap, may be called often). */
 
 } ui_ops_t;
 
-/** Chosen UI operations used by vidma. */
-extern ui_ops_t *ui;
+/** Progress counters of current step. */
+typedef struct ui_progress {
+	uint64_t val;       /**< Progress value. */
+	uint64_t max;       /**< Highest possible progress value. */
+	uint64_t bytes;     /**< Bytes processed so far. */
+} ui_progress_t;
+
+/** Progress of current step (use atomic operations only). */
+extern ui_progress_t ui_progress;
+
+/** Adds \p n bytes processed within current step. */
+static inline void ui_add_step_bytes(uint64_t n)
+{
+	__atomic_fetch_add(&ui_progress.bytes, n, __ATOMIC_RELAXED);
+}
+
+/** Writes \p str to \p f as JSON string (quoted and escaped). */
+static inline void ui_json_string(FILE *f, const char *str)
+{
+	fputc('"', f);
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			fprintf(f, "\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			fprintf(f, "\\u%04x", (unsigned char)*str);
+		else
+			fputc(*str, f);
+	}
+	fputc('"', f);
+}
+
+/** Chosen UI operations used by vidma (set per thread, \a ui_cli by
+ * default). Threads doing work on behalf of another one use its UI. */
+extern __thread ui_ops_t *ui;
 
 /** UI operations for CLI. */
 extern ui_ops_t ui_cli;
 
+/** UI operations for batch mode: plain lines without progress, every
+ * question answered with yes. */
+extern ui_ops_t ui_batch;
+
+/** UI operations gathering statistics of every step (wall time and I/O),
+ * passing everything to UI given to ui_stats_start(). */
+extern ui_ops_t ui_stats;
+
+/** Starts gathering statistics on top of \p wrapped UI operations. */
+void ui_stats_start(ui_ops_t *wrapped);
+
+/** Writes statistics gathered so far as JSON, marking run as successful
+ * or not depending on \p result. */
+void ui_stats_write_json(FILE *f, int result);
+
+/** UI operations recording operations and their steps as trace spans (see
+ * trace.h), passing everything to UI given to ui_trace_start(). */
+extern ui_ops_t ui_trace;
+
+/** Starts recording spans on top of \p wrapped UI operations. */
+void ui_trace_start(ui_ops_t *wrapped);
+
+/** Ends spans of operation and step left unfinished (e.g. on failure). */
+void ui_trace_stop();
+
 #endif /* UI_H */
@@ -20,10 +20,43 @@
 
 #include <inttypes.h>
 
+/** Image opened with open() operation. Format keeps whatever it read from
+ * the image (e.g. header and block map) in \a priv, so it's not read again
+ * by operations on the same image. */
+typedef struct vd {
+	int fd;             /**< Descriptor of image (set before open()). */
+	void *priv;         /**< Format-specific state. */
+} vd_t;
+
+/** Basic information about image. */
+typedef struct vd_info {
+	const char *variant;        /**< Variant of format (e.g. "dynamic"). */
+	uint64_t disk_size;         /**< Size of virtual disk. */
+	uint64_t data_offset;       /**< Offset of the first block in file. */
+	uint32_t blk_size;          /**< Size of block. */
+	uint32_t blk_extra;         /**< Extra data of every block. */
+	uint32_t blk_count;         /**< Number of blocks. */
+	uint32_t blk_alloc;         /**< Number of allocated blocks. */
+	uint32_t blk_zero;          /**< Number of unallocated zero blocks. */
+} vd_info_t;
+
+/** Extent of guest data (see map()). */
+typedef struct vd_extent {
+	uint64_t len;       /**< Length (in bytes). */
+	uint64_t off;       /**< Offset of data in image file (if allocated). */
+	int allocated;      /**< Whether data is kept in image file, otherwise
+	                         it reads as zeros. */
+} vd_extent_t;
+
 /** VD operations that can be supported.
  *
- * All functions take file descriptor as first argument.
- * Following arguments depend on the operation.
+ * Functions take file descriptor or image opened with open() as first
+ * argument. Following arguments depend on the operation.
+ *
+ * Guest data operations (map, read_at, write_at) take offsets and lengths
+ * in bytes of virtual disk. Once the first of them has returned, map and
+ * read_at may be called by many threads at once, but write_at must not run
+ * together with any other operation on the same image.
  */
 typedef struct vd_ops {
 
@@ -39,6 +72,54 @@ typedef struct vd_ops {
 	int (*resize)(int, int, uint32_t);
 	/**< Resizes the image. */
 
+	/* compact(int fd_in, int fd_out) */
+	int (*compact)(int, int);
+	/**< Drops zero blocks and packs the remaining ones (NULL if unsupported). */
+
+	/* defrag(int fd_in, int fd_out) */
+	int (*defrag)(int, int);
+	/**< Places blocks in disk order (NULL if unsupported). */
+
+	/* open(vd_t *vd) */
+	int (*open)(vd_t *);
+	/**< Reads what's needed to operate on vd->fd (NULL if unsupported). */
+
+	/* close(vd_t *vd) */
+	void (*close)(vd_t *);
+	/**< Frees everything kept by open() and later operations. */
+
+	/* get_info(vd_t *vd, vd_info_t *info) */
+	int (*get_info)(vd_t *, vd_info_t *);
+	/**< Fills basic information about opened image. */
+
+	/* resize_vd(vd_t *vd, int fd_out, uint32_t new_size_in_mb) */
+	int (*resize_vd)(vd_t *, int, uint32_t);
+	/**< Resizes opened image (see resize). */
+
+	/* compact_vd(vd_t *vd, int fd_out) */
+	int (*compact_vd)(vd_t *, int);
+	/**< Compacts opened image (see compact, NULL if unsupported). */
+
+	/* defrag_vd(vd_t *vd, int fd_out) */
+	int (*defrag_vd)(vd_t *, int);
+	/**< Defragments opened image (see defrag, NULL if unsupported). */
+
+	/* map(vd_t *vd, uint64_t off, uint64_t len, vd_extent_t *ext) */
+	int (*map)(vd_t *, uint64_t, uint64_t, vd_extent_t *);
+	/**< Finds the longest extent of at most len bytes starting at off that
+	 * is either continuous in image file or unallocated (NULL if
+	 * unsupported). */
+
+	/* read_at(vd_t *vd, void *buf, size_t len, uint64_t off) */
+	int (*read_at)(vd_t *, void *, size_t, uint64_t);
+	/**< Reads guest data, unallocated blocks read as zeros (NULL if
+	 * unsupported). */
+
+	/* write_at(vd_t *vd, const void *buf, size_t len, uint64_t off) */
+	int (*write_at)(vd_t *, const void *, size_t, uint64_t);
+	/**< Writes guest data, allocating blocks if needed, so vd->fd must be
+	 * open for writing (NULL if unsupported). */
+
 } vd_ops_t;
 
 /** VD type definition. */
@@ -11,6 +11,7 @@
  * for more details.
  */
 
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -19,7 +20,10 @@
 #include <sys/stat.h>
 
 #include "common.h"
+#include "io.h"
+#include "simd.h"
 #include "vdi.h"
+#include "vdi_bam.h"
 #include "ui.h"
 
 /* ==== Exposed functions prototypes ======================================== */
@@ -27,6 +31,17 @@
 static int vdi_detect(int fd);
 static void vdi_info(int fd);
 static int vdi_resize(int fin, int fout, uint32_t new_msize);
+static int vdi_compact(int fin, int fout);
+static int vdi_defrag(int fin, int fout);
+static int vdi_open(vd_t *vd);
+static void vdi_close(vd_t *vd);
+static int vdi_get_info(vd_t *vd, vd_info_t *info);
+static int vdi_resize_vd(vd_t *vd, int fout, uint32_t new_msize);
+static int vdi_compact_vd(vd_t *vd, int fout);
+static int vdi_defrag_vd(vd_t *vd, int fout);
+static int vdi_map(vd_t *vd, uint64_t off, uint64_t len, vd_extent_t *ext);
+static int vdi_read_at(vd_t *vd, void *buf, size_t len, uint64_t off);
+static int vdi_write_at(vd_t *vd, const void *buf, size_t len, uint64_t off);
 
 vd_type_t vd_vdi = {
 	.ext = "vdi",
@@ -34,41 +49,167 @@ vd_type_t vd_vdi = {
 	.ops = {
 		.detect     = vdi_detect,
 		.info       = vdi_info,
-		.resize     = vdi_resize
+		.resize     = vdi_resize,
+		.compact    = vdi_compact,
+		.defrag     = vdi_defrag,
+		.open       = vdi_open,
+		.close      = vdi_close,
+		.get_info   = vdi_get_info,
+		.resize_vd  = vdi_resize_vd,
+		.compact_vd = vdi_compact_vd,
+		.defrag_vd  = vdi_defrag_vd,
+		.map        = vdi_map,
+		.read_at    = vdi_read_at,
+		.write_at   = vdi_write_at
 	}
 };
 
+/* ==== Non-exposed types ================================================== */
+
+/** State of opened image (vd_t.priv). Operations modify both header and
+ * BAM, so they are read again afterwards. */
+typedef struct vdi_cache {
+	vdi_start_t vdi;
+	vdi_bam_t bam;
+	int bam_loaded;     /**< Whether bam is loaded. */
+	int data_ready;     /**< Whether guest data can be accessed. */
+	void *zeros;        /**< Zeros filling newly allocated blocks. */
+} vdi_cache_t;
+
+/** Move of consecutive blocks to consecutive positions. */
+typedef struct blk_move {
+	uint32_t src;       /**< Position of the first block. */
+	uint32_t dst;       /**< New position of the first block. */
+	uint32_t count;     /**< Number of blocks. */
+} blk_move_t;
+
+/** Translation of block positions applied when BAM is rewritten. */
+typedef struct remap {
+	vdi_bam_entry_t *map;       /**< New positions (if not NULL). */
+	uint32_t count;     /**< Number of translated positions (0 = none). */
+	uint32_t shift;     /**< Without map positions >= shift are decreased */
+	uint32_t tail;      /**< by shift, the others go to tail + position. */
+} remap_t;
+
+/** Moves of blocks coalesced into runs. BAM entries of moved blocks are set
+ * only after their run is copied. */
+typedef struct mover {
+	vdi_start_t *vdi;
+	vdi_bam_t *bam;
+	int fin, fout;
+	blk_move_t run;             /**< Pending run (empty if count is 0). */
+	vdi_bam_entry_t *blks;      /**< Blocks of pending run. */
+	uint32_t max_run;           /**< Capacity of blks. */
+	uint32_t moved;             /**< Blocks moved so far. */
+	uint32_t runs;              /**< Runs moved so far. */
+	uint64_t start;             /**< Time of the first move. */
+} mover_t;
+
 /* ==== Non-exposed functions prototypes ==================================== */
 
 static void print_uuid(vdi_uuid_t *uuid);
 static void print_info_from_struct(vdi_start_t *v, int full);
+static void print_bam_stats(vdi_bam_t *b);
 static void read_start(int fd, vdi_start_t *vdi);
-static void write_start(int fd, vdi_start_t *vdi);
+static char *type(vdi_start_t *vdi);
+static int cache_checked(vd_t *vd);
+static int cache_bam(vd_t *vd);
+static void cache_reload(vd_t *vd);
+static int cache_data(vd_t *vd);
+static int write_zeros(vd_t *vd, uint64_t off, uint64_t len);
+static int allocate(vd_t *vd, const char *buf, uint64_t len, uint64_t off);
+static int write_start(int fd, vdi_start_t *vdi);
+static int sync_step(int fd, int barrier);
 static int check_assumptions(vdi_start_t *vdi);
 static int check_correctness(vdi_start_t *vdi);
-static void find_last_blocks(vdi_start_t *vdi, int fd,
-                             uint32_t *block_no, uint32_t *block_pos);
 static int resize_confirmation(vdi_start_t *vdi, int fin, int fout,
                                uint32_t new_blk_count);
 static inline uint32_t data_offset(vdi_start_t *vdi, uint32_t blk_count);
+static uint32_t relocation_shift(vdi_start_t *vdi, int same_file,
+                                 uint32_t new_blk_count);
+static inline uint32_t new_data_offset(vdi_start_t *vdi, int same_file,
+                                       uint32_t new_blk_count);
 static inline uint32_t ext_blk_size(vdi_start_t *vdi);
 static inline uint64_t ext_blk_size64(vdi_start_t *vdi);
 static inline uint64_t disk_size(vdi_start_t *vdi, uint32_t blk_count);
+static inline uint64_t block_offset(vdi_start_t *vdi, vdi_bam_entry_t pos);
 static inline uint64_t image_data_size(vdi_start_t *vdi,
                                        uint32_t blk_count_alloc);
-static inline uint64_t image_size(vdi_start_t *vdi, uint32_t blk_count);
-static void rewrite_data(vdi_start_t *vdi, int fin, int fout,
-                         uint32_t new_blk_count);
+static inline uint64_t image_size(vdi_start_t *vdi, uint32_t data_off,
+                                  uint32_t blk_count);
+static inline vdi_bam_entry_t remap_pos(const remap_t *remap,
+                                        vdi_bam_entry_t pos);
+static int rewrite_data(vdi_start_t *vdi, const vdi_bam_t *bam, int fin,
+                        int fout, uint32_t new_blk_count, int sparse,
+                        remap_t *remap);
 static inline void fill_bam_with_unallocated_entries(vdi_bam_entry_t *bam,
                                                      uint32_t n);
 static inline void fill_bam_with_consecutive_values(vdi_bam_entry_t *bam,
                                                     vdi_bam_entry_t start_val,
                                                     uint32_t n);
-static void update_block_allocation_map(vdi_start_t *vdi, int fin, int fout,
-                                        uint32_t new_blk_count);
-static void update_file_size(vdi_start_t *vdi, int fd);
-static void update_header(vdi_start_t *vdi, int fd);
-static int resize(vdi_start_t *vdi, int fin, int fout, uint32_t new_blk_count);
+static int write_new_bam_entries(vdi_start_t *vdi, int fd, uint32_t first,
+                                 uint32_t last);
+static int clear_bam_tail(vdi_start_t *vdi, int fd);
+static int update_block_allocation_map(vdi_start_t *vdi, vdi_bam_t *bam,
+                                       int fin, int fout,
+                                       uint32_t new_blk_count,
+                                       const remap_t *remap,
+                                       vdi_bam_list_t *zeros);
+static int update_file_size(vdi_start_t *vdi, int fd);
+static int update_header(vdi_start_t *vdi, int fd);
+static int resize(vdi_start_t *vdi, vdi_bam_t *bam, int fin, int fout,
+                  uint32_t new_blk_count, int sparse, const char *op);
+static int write_bam(vdi_start_t *vdi, int fd, const vdi_bam_t *bam,
+                     uint32_t blk_count, const remap_t *remap);
+static int mover_init(mover_t *m, vdi_start_t *vdi, vdi_bam_t *bam,
+                      int fin, int fout);
+static int mover_flush(mover_t *m);
+static int mover_add(mover_t *m, uint32_t src, uint32_t dst, uint32_t blk);
+static int mover_finish(mover_t *m, const char *what);
+static void mover_free(mover_t *m);
+static int find_zero_blocks(vdi_start_t *vdi, int fd, vdi_bam_rev_t *it,
+                            vdi_bam_list_t *zeros, uint32_t *zero_count);
+static int unallocate_zero_blocks(vdi_bam_t *bam, int fd,
+                                  vdi_bam_list_t *zeros);
+static int look_for_zero_blocks(vdi_start_t *vdi, vdi_bam_t *bam, int fin,
+                                int fout, vdi_bam_list_t *zeros);
+static int punch_zero_blocks(vdi_start_t *vdi, int fd, const remap_t *remap,
+                             vdi_bam_list_t *zeros);
+static int count_moves(vdi_bam_rev_t *it, vdi_bam_list_t *skip,
+                       uint32_t live, uint32_t *moved);
+static int pack_blocks(vdi_start_t *vdi, vdi_bam_t *bam, int fin, int fout,
+                       vdi_bam_rev_t *it, vdi_bam_list_t *skip, uint32_t live,
+                       int all, const char *step, uint32_t moved);
+static int finish_packing(vdi_start_t *vdi, vdi_bam_t *bam, int fout,
+                          uint32_t live);
+static int compact_confirmation(vdi_start_t *vdi, int same_file,
+                                uint32_t zero_count, uint32_t live,
+                                uint32_t moved);
+static int compact(vdi_start_t *vdi, vdi_bam_t *bam, int fin, int fout);
+static int count_allocated(const vdi_bam_t *bam, uint32_t blk_count,
+                           uint32_t *allocated);
+static int shrink_confirmation(vdi_start_t *vdi, int fout, int same_file,
+                               uint32_t new_blk_count, uint32_t discarded,
+                               uint32_t live, uint32_t moved);
+static int shrink(vdi_start_t *vdi, vdi_bam_t *bam, int fin, int fout,
+                  uint32_t new_blk_count);
+static int fragmentation(const vdi_bam_t *bam, uint32_t *breaks,
+                         uint32_t *live);
+static int plan_defrag(const vdi_bam_t *bam, uint32_t live,
+                       vdi_bam_array_t *target, vdi_bam_array_t *source,
+                       uint32_t *misplaced);
+static int renumber_blocks(vdi_bam_t *bam, int fd);
+static int move_block(vdi_start_t *vdi, int fin, int fout, void *buf,
+                      uint32_t from, uint32_t to);
+static int permute_blocks(vdi_start_t *vdi, int fin, int fout,
+                          vdi_bam_array_t *target, vdi_bam_array_t *source,
+                          uint32_t live, uint32_t misplaced);
+static int copy_in_order(vdi_start_t *vdi, vdi_bam_t *bam, int fin, int fout,
+                         uint32_t live);
+static int defrag_confirmation(vdi_start_t *vdi, int same_file,
+                               uint32_t breaks, uint32_t live,
+                               uint32_t misplaced);
+static int defrag(vdi_start_t *vdi, vdi_bam_t *bam, int fin, int fout);
 
 /* ==== Exposed functions definitions ======================================= */
 
@@ -85,29 +226,283 @@ static int vdi_detect(int fd)
 static void vdi_info(int fd)
 {
 	vdi_start_t v;
+	vdi_bam_t bam;
 
 	read_start(fd, &v);
 	print_info_from_struct(&v, 1);
+
+	if (vdi_bam_load(&bam, &v, fd) != SUCCESS)
+		return;
+	print_bam_stats(&bam);
+	vdi_bam_free(&bam);
 }
 
 static int vdi_resize(int fin, int fout, uint32_t new_msize)
 {
-	vdi_start_t vdi;
+	vd_t vd = { .fd = fin };
+	int res;
+
+	if (vdi_open(&vd) != SUCCESS)
+		return FAILURE;
+	res = vdi_resize_vd(&vd, fout, new_msize);
+	vdi_close(&vd);
+
+	return res;
+}
+
+static int vdi_compact(int fin, int fout)
+{
+	vd_t vd = { .fd = fin };
+	int res;
+
+	if (vdi_open(&vd) != SUCCESS)
+		return FAILURE;
+	res = vdi_compact_vd(&vd, fout);
+	vdi_close(&vd);
+
+	return res;
+}
+
+static int vdi_defrag(int fin, int fout)
+{
+	vd_t vd = { .fd = fin };
+	int res;
+
+	if (vdi_open(&vd) != SUCCESS)
+		return FAILURE;
+	res = vdi_defrag_vd(&vd, fout);
+	vdi_close(&vd);
+
+	return res;
+}
+
+static int vdi_open(vd_t *vd)
+{
+	vdi_cache_t *c = malloc(sizeof(*c));
+
+	if (!c) {
+		ui->log("ERROR   Cannot allocate image state.\n");
+		return FAILURE;
+	}
+	memset(c, 0, sizeof(*c));
+	read_start(vd->fd, &c->vdi);
+	vd->priv = c;
+
+	return SUCCESS;
+}
+
+static void vdi_close(vd_t *vd)
+{
+	vdi_cache_t *c = vd->priv;
+
+	if (!c)
+		return;
+	if (c->bam_loaded)
+		vdi_bam_free(&c->bam);
+	free(c->zeros);
+	free(c);
+	vd->priv = NULL;
+}
+
+static int vdi_get_info(vd_t *vd, vd_info_t *info)
+{
+	vdi_cache_t *c = vd->priv;
+
+	if (cache_bam(vd) != SUCCESS)
+		return FAILURE;
+	info->variant = type(&c->vdi);
+	info->disk_size = c->vdi.header.disk.size;
+	info->data_offset = c->vdi.header.offset.data;
+	info->blk_size = c->vdi.header.disk.blk_size;
+	info->blk_extra = c->vdi.header.disk.blk_extra_data;
+	info->blk_count = c->vdi.header.disk.blk_count;
+	info->blk_alloc = c->bam.allocated;
+	info->blk_zero = c->bam.zero;
+
+	return SUCCESS;
+}
+
+static int vdi_resize_vd(vd_t *vd, int fout, uint32_t new_msize)
+{
+	int res;
+	vdi_cache_t *c = vd->priv;
+	vdi_start_t *vdi = &c->vdi;
+	vdi_bam_t *bam = &c->bam;
+	int fin = vd->fd;
 	uint32_t new_blk_count;
 
-	read_start(fin, &vdi);
-	if (check_assumptions(&vdi) == FAILURE ||
-	    check_correctness(&vdi) == FAILURE)
+	if (cache_checked(vd) != SUCCESS || cache_bam(vd) != SUCCESS)
 		return FAILURE;
 
 	new_blk_count = ALIGN((uint64_t)new_msize * (uint64_t)_1MB,
-	                      vdi.header.disk.blk_size) / vdi.header.disk.blk_size;
-	if (resize_confirmation(&vdi, fin, fout, new_blk_count) != SUCCESS) {
+	                      vdi->header.disk.blk_size) / vdi->header.disk.blk_size;
+
+	/* Cutting off allocated blocks or blocks placed beyond new size. */
+	if (vdi->header.type == VDI_DYNAMIC &&
+	    new_blk_count <= max_u32(bam->last_no, bam->last_pos)) {
+		res = shrink(vdi, bam, fin, fout, new_blk_count);
+	} else if (resize_confirmation(vdi, fin, fout,
+	                               new_blk_count) != SUCCESS) {
 		ui->log("Resize aborted.\n");
+		res = FAILURE;
+	} else {
+		res = resize(vdi, bam, fin, fout, new_blk_count, io_opts.sparse,
+		             "Resize");
+	}
+	cache_reload(vd);
+
+	return res;
+}
+
+static int vdi_compact_vd(vd_t *vd, int fout)
+{
+	int res;
+	vdi_cache_t *c = vd->priv;
+	int fin = vd->fd;
+
+	if (cache_checked(vd) != SUCCESS)
+		return FAILURE;
+
+	if (c->vdi.header.type != VDI_DYNAMIC) {
+		ui->log("ERROR   Only dynamic images can be compacted.\n");
+		return FAILURE;
+	}
+
+	if (cache_bam(vd) != SUCCESS)
+		return FAILURE;
+
+	/* Sparse copy would need relocation map of all blocks in memory. */
+	if (same_file_behind_fds(fin, fout) == SUCCESS || c->bam.streamed) {
+		res = compact(&c->vdi, &c->bam, fin, fout);
+		cache_reload(vd);
+		return res;
+	}
+
+	/* Sparse copy of dynamic image packs non-zero blocks already. */
+	ui->log("Compact operation in fact will create compacted copy of the image.\n");
+	ui->log("NOTE    UUID of the new image will be the same as old one.\n");
+	ui->log("NOTE    Input file is safe and won't be modified.\n");
+	if (ui->yesno("Are you sure you want to continue?") != SUCCESS) {
+		ui->log("Compact aborted.\n");
+		return FAILURE;
+	}
+	res = resize(&c->vdi, &c->bam, fin, fout, c->vdi.header.disk.blk_count,
+	             1, "Compact");
+	cache_reload(vd);
+
+	return res;
+}
+
+static int vdi_defrag_vd(vd_t *vd, int fout)
+{
+	int res;
+	vdi_cache_t *c = vd->priv;
+
+	if (cache_checked(vd) != SUCCESS)
 		return FAILURE;
+
+	if (c->vdi.header.type != VDI_DYNAMIC) {
+		ui->log("ERROR   Only dynamic images can be defragmented.\n");
+		return FAILURE;
+	}
+
+	if (cache_bam(vd) != SUCCESS)
+		return FAILURE;
+	res = defrag(&c->vdi, &c->bam, vd->fd, fout);
+	cache_reload(vd);
+
+	return res;
+}
+
+static int vdi_map(vd_t *vd, uint64_t off, uint64_t len, vd_extent_t *ext)
+{
+	vdi_cache_t *c = vd->priv;
+	vdi_start_t *vdi = &c->vdi;
+	uint64_t blk_size = vdi->header.disk.blk_size;
+	uint64_t end;
+	uint32_t blk;
+	vdi_bam_entry_t pos, next;
+
+	if (cache_data(vd) != SUCCESS)
+		return FAILURE;
+	if (off >= vdi->header.disk.size || !len) {
+		ui->log("ERROR   Access beyond the end of disk.\n");
+		return FAILURE;
+	}
+	end = off + min_u64(len, vdi->header.disk.size - off);
+
+	blk = off / blk_size;
+	if (vdi_bam_get(&c->bam, blk, &pos) != SUCCESS)
+		goto read_error;
+	ext->allocated = VDI_BLK_IS_ALLOCATED(pos);
+	ext->off = ext->allocated ? block_offset(vdi, pos) + off % blk_size : 0;
+
+	/* Blocks placed one after another (which extra data prevents) form one
+	 * extent, so do unallocated ones. */
+	for (blk++; (uint64_t)blk * blk_size < end; blk++) {
+		if (vdi_bam_get(&c->bam, blk, &next) != SUCCESS)
+			goto read_error;
+		if (ext->allocated
+		    ? !VDI_BLK_IS_ALLOCATED(next) || next != pos + 1 ||
+		      vdi->header.disk.blk_extra_data
+		    : VDI_BLK_IS_ALLOCATED(next))
+			break;
+		pos = next;
+	}
+	ext->len = min_u64((uint64_t)blk * blk_size, end) - off;
+
+	return SUCCESS;
+
+read_error:
+	ui->log("ERROR   Reading block allocation map failed.\n");
+	return FAILURE;
+}
+
+static int vdi_read_at(vd_t *vd, void *buf, size_t len, uint64_t off)
+{
+	char *p = buf;
+	vd_extent_t ext;
+
+	while (len) {
+		if (vdi_map(vd, off, len, &ext) != SUCCESS)
+			return FAILURE;
+		if (!ext.allocated) {
+			memset(p, 0, ext.len);
+		} else if (io_pread(vd->fd, p, ext.len, ext.off) != SUCCESS) {
+			ui->log("ERROR   Reading guest data failed: %s\n",
+			        strerror(errno));
+			return FAILURE;
+		}
+		p += ext.len;
+		off += ext.len;
+		len -= ext.len;
+	}
+
+	return SUCCESS;
+}
+
+static int vdi_write_at(vd_t *vd, const void *buf, size_t len, uint64_t off)
+{
+	const char *p = buf;
+	vd_extent_t ext;
+
+	while (len) {
+		if (vdi_map(vd, off, len, &ext) != SUCCESS)
+			return FAILURE;
+		if (!ext.allocated) {
+			if (allocate(vd, p, ext.len, off) != SUCCESS)
+				return FAILURE;
+		} else if (io_pwrite(vd->fd, p, ext.len, ext.off) != SUCCESS) {
+			ui->log("ERROR   Writing guest data failed: %s\n",
+			        strerror(errno));
+			return FAILURE;
+		}
+		p += ext.len;
+		off += ext.len;
+		len -= ext.len;
 	}
 
-	return resize(&vdi, fin, fout, new_blk_count);
+	return SUCCESS;
 }
 
 /* ==== Defines and Macros ================================================== */
@@ -115,6 +510,8 @@ static int vdi_resize(int fin, int fout, uint32_t new_msize)
 #define PRINT(f,a...)  ui->log("%-*s = " f, 32, a)
 #define PRINTU32NN(v,i)  PRINT("%08x %u", #i, (uint32_t)v->i, (uint32_t)v->i)
 #define PRINTU32(v,i)  PRINT("%08x %u\n", #i, (uint32_t)v->i, (uint32_t)v->i)
+#define PRINTBAMU32(b,i) \
+	PRINT("%08x %u\n", "bam." #i, (uint32_t)b->i, (uint32_t)b->i)
 #define PRINTSTR(v,i)  PRINT("%s\n", #i, (char *)v->i)
 #define PRINTUUID(v,i) \
 	do { \
@@ -126,9 +523,6 @@ static int vdi_resize(int fin, int fout, uint32_t new_msize)
 	PRINT("%016"PRIx64" %"PRIu64"\n", #i, (uint64_t)v->i, (uint64_t)v->i)
 #define PRINTNOTE(s)   ui->log(" (%s)\n", s)
 
-#define FILL_SHIFT 4
-#define FILL_COUNT (1 << FILL_SHIFT)
-
 char *types[5] = {
 	"unknown",
 	"dynamic",
@@ -195,16 +589,193 @@ static void print_info_from_struct(vdi_start_t *v, int full)
 		PRINTU32(v, header.lchs.sector_size);
 }
 
+static void print_bam_stats(vdi_bam_t *b)
+{
+	PRINTBAMU32(b, allocated);
+	PRINTBAMU32(b, zero);
+	PRINTBAMU32(b, last_no);
+	PRINTBAMU32(b, last_pos);
+}
+
 static void read_start(int fd, vdi_start_t *vdi)
 {
-	lseek(fd, 0LL, SEEK_SET);
-	read(fd, vdi, sizeof(vdi_start_t));
+	io_pread(fd, vdi, sizeof(vdi_start_t), 0);
+}
+
+/* Checks whether cached header describes image vidma can operate on. */
+static int cache_checked(vd_t *vd)
+{
+	vdi_cache_t *c = vd->priv;
+
+	if (check_assumptions(&c->vdi) == FAILURE ||
+	    check_correctness(&c->vdi) == FAILURE)
+		return FAILURE;
+
+	return SUCCESS;
+}
+
+/* Loads BAM into cache, unless it's there already. */
+static int cache_bam(vd_t *vd)
+{
+	vdi_cache_t *c = vd->priv;
+
+	if (c->bam_loaded)
+		return SUCCESS;
+	if (vdi_bam_load(&c->bam, &c->vdi, vd->fd) != SUCCESS)
+		return FAILURE;
+	c->bam_loaded = 1;
+
+	return SUCCESS;
+}
+
+/* Drops what operation has modified (in memory and maybe in file). */
+static void cache_reload(vd_t *vd)
+{
+	vdi_cache_t *c = vd->priv;
+
+	if (c->bam_loaded)
+		vdi_bam_free(&c->bam);
+	c->bam_loaded = 0;
+	c->data_ready = 0;
+	read_start(vd->fd, &c->vdi);
+}
+
+/* Checks header and loads BAM before the first access to guest data. */
+static int cache_data(vd_t *vd)
+{
+	vdi_cache_t *c = vd->priv;
+
+	if (c->data_ready)
+		return SUCCESS;
+	if (cache_checked(vd) != SUCCESS || cache_bam(vd) != SUCCESS)
+		return FAILURE;
+	c->data_ready = 1;
+
+	return SUCCESS;
+}
+
+static int write_zeros(vd_t *vd, uint64_t off, uint64_t len)
+{
+	vdi_cache_t *c = vd->priv;
+	uint64_t n;
+
+	if (!c->zeros)
+		c->zeros = calloc(1, c->vdi.header.disk.blk_size);
+	if (!c->zeros) {
+		ui->log("ERROR   Cannot allocate buffer of zeros.\n");
+		return FAILURE;
+	}
+	for (; len; off += n, len -= n) {
+		n = min_u64(len, c->vdi.header.disk.blk_size);
+		if (io_pwrite(vd->fd, c->zeros, n, off) != SUCCESS) {
+			ui->log("ERROR   Writing guest data failed: %s\n",
+			        strerror(errno));
+			return FAILURE;
+		}
+	}
+
+	return SUCCESS;
+}
+
+/* Writes unallocated range of guest data into blocks appended to image.
+ * Data goes first, so BAM and header never point to blocks not written. */
+static int allocate(vd_t *vd, const char *buf, uint64_t len, uint64_t off)
+{
+	vdi_cache_t *c = vd->priv;
+	vdi_start_t *vdi = &c->vdi;
+	vdi_bam_t *bam = &c->bam;
+	uint64_t blk_size = vdi->header.disk.blk_size;
+	uint32_t extra = vdi->header.disk.blk_extra_data;
+	uint32_t first = off / blk_size;
+	uint32_t count = (off + len - 1) / blk_size - first + 1;
+	uint32_t pos = vdi->header.disk.blk_count_alloc;
+	uint64_t beg, end, data, run_off = 0, run_len = 0;
+	const char *run = buf;
+	vdi_bam_entry_t old;
+	uint32_t i, zero = 0;
+
+	if (vdi->header.type != VDI_DYNAMIC) {
+		ui->log("ERROR   Block %u of fixed image is not allocated.\n", first);
+		return FAILURE;
+	}
+	if (bam->allocated && bam->last_pos >= pos) {
+		ui->log("ERROR   Block allocation map is corrupted "
+		        "(position %u beyond allocated blocks).\n", bam->last_pos);
+		return FAILURE;
+	}
+
+	/* New blocks are placed one after another, so without extra data all
+	 * their data is written at once. */
+	for (i = 0; i < count; i++) {
+		data = block_offset(vdi, pos + i);
+		beg = i ? 0 : off % blk_size;
+		end = i < count - 1 ? blk_size : (off + len - 1) % blk_size + 1;
+		if ((extra && write_zeros(vd, data - extra, extra) != SUCCESS) ||
+		    write_zeros(vd, data, beg) != SUCCESS ||
+		    write_zeros(vd, data + end, blk_size - end) != SUCCESS)
+			return FAILURE;
+		if (run_len && run_off + run_len != data + beg) {
+			if (io_pwrite(vd->fd, run, run_len, run_off) != SUCCESS)
+				goto write_error;
+			run += run_len;
+			run_len = 0;
+		}
+		if (!run_len)
+			run_off = data + beg;
+		run_len += end - beg;
+	}
+	if (io_pwrite(vd->fd, run, run_len, run_off) != SUCCESS)
+		goto write_error;
+
+	for (i = 0; i < count; i++) {
+		if (vdi_bam_get(bam, first + i, &old) != SUCCESS)
+			return FAILURE;
+		zero += old == VDI_BLK_ZERO;
+		if (vdi_bam_set(bam, vd->fd, first + i, pos + i) != SUCCESS)
+			goto write_error;
+	}
+	if (!bam->streamed &&
+	    io_pwrite(vd->fd, bam->v2p + first, VDI_BAM_SIZE((size_t)count),
+	              bam->off + VDI_BAM_SIZE((uint64_t)first)) != SUCCESS)
+		goto write_error;
+	bam->allocated += count;
+	bam->zero -= zero;
+	bam->pos_count = pos + count;
+	bam->last_pos = pos + count - 1;
+	bam->last_no = max_u32(bam->last_no, first + count - 1);
+
+	vdi->header.disk.blk_count_alloc += count;
+	if (io_pwrite(vd->fd, vdi, sizeof(vdi_start_t), 0) != SUCCESS)
+		goto write_error;
+
+	return SUCCESS;
+
+write_error:
+	ui->log("ERROR   Writing guest data failed: %s\n", strerror(errno));
+	/* What's in memory may be ahead of what's in file now. */
+	cache_reload(vd);
+	return FAILURE;
+}
+
+static int write_start(int fd, vdi_start_t *vdi)
+{
+	return io_pwrite(fd, vdi, sizeof(vdi_start_t), 0);
 }
 
-static void write_start(int fd, vdi_start_t *vdi)
+/* Syncs fd at the end of step, if durability level requires it.
+ * barrier tells whether later steps rely on what has been written, so
+ * they must not start if it fails. */
+static int sync_step(int fd, int barrier)
 {
-	lseek(fd, 0LL, SEEK_SET);
-	write(fd, vdi, sizeof(vdi_start_t));
+	if (!io_sync_needed(barrier))
+		return SUCCESS;
+	ui->log("Syncing\n");
+	if (io_sync(fd, barrier) != SUCCESS) {
+		ui->log("ERROR   Syncing failed: %s\n", strerror(errno));
+		return FAILURE;
+	}
+
+	return SUCCESS;
 }
 
 static int check_assumptions(vdi_start_t *vdi)
@@ -271,48 +842,18 @@ static int check_correctness(vdi_start_t *vdi)
 	       ? SUCCESS : FAILURE;
 }
 
-static void find_last_blocks(vdi_start_t *vdi, int fd,
-                             uint32_t *block_no, uint32_t *block_pos)
-{
-	vdi_bam_entry_t *bam;
-	uint32_t i;
-	uint32_t blocks = vdi->header.disk.blk_count;
-	uint32_t n = 0;
-	uint32_t no = 0;
-	uint32_t pos = 0;
-
-	lseek(fd, vdi->header.offset.bam, SEEK_SET);
-	bam = malloc(_1MB);
-	while (blocks -= n) {
-		n = read(fd, bam,
-		         min_u64(VDI_BAM_SIZE((uint64_t)blocks), _1MB)) /
-		    VDI_BAM_ENTRY_SIZE;
-		for (i = 0; i < n; i++)
-			if (bam[i] != VDI_BLK_NONE) {
-				no = i;
-				if (bam[i] != VDI_BLK_ZERO && pos < bam[i])
-					pos = bam[i];
-			}
-	}
-	free(bam);
-	if (block_no)
-		*block_no = no;
-	if (block_pos)
-		*block_pos = pos;
-}
-
 static int resize_confirmation(vdi_start_t *vdi, int fin, int fout,
                                uint32_t new_blk_count)
 {
 	uint64_t free_bytes = 0;
-	uint32_t last_blk_no = 0;
-	uint32_t last_blk_pos = 0;
-	uint32_t min_blk_count = 1;
-	int32_t delta = data_offset(vdi, new_blk_count) - vdi->header.offset.data;
-	uint64_t new_disk_size = disk_size(vdi, new_blk_count);
-	uint64_t old_image_size = image_size(vdi, vdi->header.disk.blk_count);
-	uint64_t new_image_size = image_size(vdi, new_blk_count);
 	int same_file = same_file_behind_fds(fin, fout) == SUCCESS;
+	uint32_t shift = relocation_shift(vdi, same_file, new_blk_count);
+	uint32_t new_offset = new_data_offset(vdi, same_file, new_blk_count);
+	int32_t delta = new_offset - vdi->header.offset.data;
+	uint64_t new_disk_size = disk_size(vdi, new_blk_count);
+	uint64_t old_image_size = image_size(vdi, vdi->header.offset.data,
+	                                     vdi->header.disk.blk_count);
+	uint64_t new_image_size = image_size(vdi, new_offset, new_blk_count);
 	uint64_t req_bytes = same_file ? (new_image_size > old_image_size
 	                                  ? new_image_size - old_image_size : 0)
 	                               : new_image_size;
@@ -323,17 +864,6 @@ static int resize_confirmation(vdi_start_t *vdi, int fin, int fout,
 	        vdi->header.disk.blk_count, new_blk_count,
 	        vdi->header.disk.blk_size, vdi->header.disk.blk_extra_data);
 
-	if (vdi->header.type == VDI_DYNAMIC) {
-		find_last_blocks(vdi, fin, &last_blk_no, &last_blk_pos);
-		min_blk_count = max_u32(last_blk_no, last_blk_pos) + 1;
-		if (new_blk_count < min_blk_count) {
-			ui->log("But minimal possible block count equals\n"
-			        "     %21u block(s)\n",
-			        min_blk_count);
-			return FAILURE;
-		}
-	}
-
 	ui->log("\nDisk size will change\n"
 	        "from %21"PRIu64" bytes (%15"PRIu64" MB)\n"
 	        "to   %21"PRIu64" bytes (%15"PRIu64" MB)\n"
@@ -360,7 +890,12 @@ static int resize_confirmation(vdi_start_t *vdi, int fin, int fout,
 
 	if (same_file) {
 		ui->log("Resize operation will be performed in-place.\n");
-		if (delta)
+		if (shift)
+			ui->log("CAUTION Only %u block(s) occupying space needed by\n"
+			        "        block allocation map require moving.\n"
+			        "        In case of fail DATA LOSS is POSSIBLE!\n",
+			        min_u32(shift, vdi->header.disk.blk_count_alloc));
+		else if (delta)
 			ui->log("WARNING All allocated blocks require moving.\n"
 			        "        In case of fail DATA LOSS is highly POSSIBLE!\n"
 			        "        Think twice before continuing!\n");
@@ -396,6 +931,43 @@ static inline uint32_t data_offset(vdi_start_t *vdi, uint32_t blk_count)
 	       ? vdi->header.offset.data  : min_offset_data_aligned;
 }
 
+/* Growing BAM of dynamic image in-place doesn't require shifting all
+ * allocated blocks. Blocks are addressed through BAM, so if data offset grows
+ * by a multiple of extended block size, it's enough to move blocks occupying
+ * space needed by BAM past the last block and adjust BAM entries.
+ *
+ * Returns how many positions data offset moves by (in blocks) or 0 if such
+ * relocation is not applicable.
+ */
+static uint32_t relocation_shift(vdi_start_t *vdi, int same_file,
+                                 uint32_t new_blk_count)
+{
+	uint64_t ebs = ext_blk_size64(vdi);
+	uint64_t old_offset = vdi->header.offset.data;
+	uint64_t offset = data_offset(vdi, new_blk_count);
+	uint64_t shift;
+
+	if (!same_file || vdi->header.type != VDI_DYNAMIC ||
+	    !vdi->header.disk.blk_count_alloc || offset <= old_offset)
+		return 0;
+
+	shift = (offset - old_offset + ebs - 1) / ebs;
+	if (old_offset + shift * ebs > UINT32_MAX)
+		return 0;
+
+	return shift;
+}
+
+static inline uint32_t new_data_offset(vdi_start_t *vdi, int same_file,
+                                       uint32_t new_blk_count)
+{
+	uint32_t shift = relocation_shift(vdi, same_file, new_blk_count);
+
+	return   shift
+	       ? vdi->header.offset.data + shift * ext_blk_size(vdi)
+	       : data_offset(vdi, new_blk_count);
+}
+
 static inline uint32_t ext_blk_size(vdi_start_t *vdi)
 {
 	return vdi->header.disk.blk_extra_data + vdi->header.disk.blk_size;
@@ -412,59 +984,137 @@ static inline uint64_t disk_size(vdi_start_t *vdi, uint32_t blk_count)
 	return ((uint64_t)blk_count) * ((uint64_t)vdi->header.disk.blk_size);
 }
 
+/* Returns offset of data of block at position pos (past its extra data). */
+static inline uint64_t block_offset(vdi_start_t *vdi, vdi_bam_entry_t pos)
+{
+	return (uint64_t)vdi->header.offset.data + ext_blk_size64(vdi) * pos +
+	       vdi->header.disk.blk_extra_data;
+}
+
 static inline uint64_t image_data_size(vdi_start_t *vdi,
                                        uint32_t blk_count_alloc)
 {
 	return (uint64_t)ext_blk_size(vdi) * blk_count_alloc;
 }
 
-static inline uint64_t image_size(vdi_start_t *vdi, uint32_t blk_count)
+static inline uint64_t image_size(vdi_start_t *vdi, uint32_t data_off,
+                                  uint32_t blk_count)
 {
 	uint32_t blocks = blk_count;
 
 	if (vdi->header.type == VDI_DYNAMIC)
 		blocks = min_u32(vdi->header.disk.blk_count_alloc, blk_count);
 
-	return data_offset(vdi, blk_count) + image_data_size(vdi, blocks);
+	return data_off + image_data_size(vdi, blocks);
 }
 
-static void rewrite_data(vdi_start_t *vdi, int fin, int fout,
-                         uint32_t new_blk_count)
+static inline vdi_bam_entry_t remap_pos(const remap_t *remap,
+                                        vdi_bam_entry_t pos)
 {
-	uint32_t i;
-	char *buffer;
-	uint64_t start, end;
+	if (pos >= remap->count)
+		return pos;
+	if (remap->map)
+		return remap->map[pos];
+
+	return pos >= remap->shift ? pos - remap->shift : remap->tail + pos;
+}
+
+static int rewrite_data(vdi_start_t *vdi, const vdi_bam_t *bam, int fin,
+                        int fout, uint32_t new_blk_count, int sparse,
+                        remap_t *remap)
+{
+	int res = SUCCESS;
+	uint64_t start, end, tail;
+	uint32_t i, moved;
+	uint32_t kept = 0;
 	uint32_t ebs = ext_blk_size(vdi);
+	vdi_bam_entry_t *map;
 	uint32_t blocks = min_u32(vdi->header.disk.blk_count_alloc, new_blk_count);
-	int32_t delta = data_offset(vdi, new_blk_count) - vdi->header.offset.data;
 	int same_file = (same_file_behind_fds(fin, fout) == SUCCESS);
-
-	lseek(fin, vdi->header.offset.data, SEEK_SET);
-	lseek(fout, data_offset(vdi, new_blk_count), SEEK_SET);
-
-	if (delta || !same_file) {
+	uint32_t shift = relocation_shift(vdi, same_file, new_blk_count);
+	uint32_t new_offset = new_data_offset(vdi, same_file, new_blk_count);
+	int32_t delta = new_offset - vdi->header.offset.data;
+
+	memset(remap, 0, sizeof(*remap));
+	if (shift) {
+		ui->next_step("Relocating blocks");
+		moved = min_u32(shift, blocks);
+		ui->set_step_prog_max(moved);
+		/* Positions below shift go past the last block keeping their
+		 * order, the others are decreased by shift. */
+		remap->count = blocks;
+		remap->shift = shift;
+		remap->tail = max_u32(blocks, shift) - shift;
+		tail = vdi->header.offset.data +
+		       (uint64_t)max_u32(blocks, shift) * (uint64_t)ebs;
+		start = gettimeofday_us();
+		if (!sparse)
+			res = io_copy(fin, vdi->header.offset.data, fout, tail,
+			              (uint64_t)moved * (uint64_t)ebs, ebs);
+		else
+			/* Zero blocks become holes. */
+			res = io_copy_sparse(fin, vdi->header.offset.data, fout,
+			                     tail, moved, ebs, NULL, &kept);
+		if (res != SUCCESS || sync_step(fout, 1) != SUCCESS)
+			return FAILURE;
+		end = max_u64(gettimeofday_us(), start + 1);
+		if (sparse)
+			ui->log("Zero blocks skipped (%u of %u blocks)\n",
+			        moved - kept, moved);
+		ui->log(
+		        "Data relocated (%u of %u blocks "
+		        "in %"PRIu64" ms = ~%"PRIu64" B/us)\n",
+		        moved,
+		        blocks,
+		        (end - start) / 1000,
+		        ((uint64_t)moved * (uint64_t)ebs) / (end - start)
+		       );
+	} else
+	if (same_file && delta > 0 &&
+	    io_insert_range(fout, vdi->header.offset.data, delta) == SUCCESS) {
+		ui->next_step("Inserting space before blocks");
+		ui->set_step_prog_val(1);
+		if (sparse && vdi->header.type == VDI_FIXED)
+			ui->log("NOTE    Zero blocks are left as they are, as no"
+			        " block is rewritten.\n");
+		if (sync_step(fout, 1) != SUCCESS)
+			return FAILURE;
+		ui->log("Data moved by filesystem (%d bytes inserted before %u blocks)\n",
+		        delta, blocks);
+	} else if (delta || !same_file) {
 		ui->next_step(same_file ? "Moving blocks" : "Copying blocks");
 		ui->set_step_prog_max(blocks);
-		buffer = malloc(ebs + delta * (delta > 0));
 		start = gettimeofday_us();
-		if (delta > 0) {
-			read(fin, buffer + ebs, delta);
-			for (i = 1; i <= blocks; i++) {
-				ui->set_step_prog_val(i);
-				memcpy(buffer, buffer + ebs, delta);
-				read(fin, buffer + delta, ebs);
-				write(fout, buffer, ebs);
-			}
-		} else
-			for (i = 1; i <= blocks; i++) {
-				ui->set_step_prog_val(i);
-				read(fin, buffer, ebs);
-				write(fout, buffer, ebs);
+		kept = blocks;
+		if (!sparse) {
+			res = io_copy(fin, vdi->header.offset.data, fout, new_offset,
+			              (uint64_t)blocks * (uint64_t)ebs, ebs);
+		} else if (vdi->header.type == VDI_DYNAMIC && !same_file &&
+		           !bam->streamed) {
+			/* Zero blocks become unallocated ones, the rest are packed. */
+			map = malloc(VDI_BAM_SIZE((size_t)max_u32(blocks, 1)));
+			if (!map) {
+				ui->log("ERROR   Cannot allocate relocation map.\n");
+				return FAILURE;
 			}
-		ui->log("Syncing\n");
-		fsync(fout);
-		end = gettimeofday_us();
-		free(buffer);
+			remap->map = map;
+			remap->count = blocks;
+			res = io_copy_sparse(fin, vdi->header.offset.data, fout, new_offset,
+			                     blocks, ebs, map, &kept);
+			for (i = 0; i < blocks; i++)
+				if (map[i] == IO_ZERO_UNIT)
+					map[i] = VDI_BLK_ZERO;
+		} else {
+			/* Zero blocks become holes. */
+			res = io_copy_sparse(fin, vdi->header.offset.data, fout, new_offset,
+			                     blocks, ebs, NULL, &kept);
+		}
+		if (res != SUCCESS || sync_step(fout, 1) != SUCCESS)
+			return FAILURE;
+		end = max_u64(gettimeofday_us(), start + 1);
+		if (sparse)
+			ui->log("Zero blocks skipped (%u of %u blocks)\n",
+			        blocks - kept, blocks);
 		if (same_file)
 			ui->log(
 			        "Data moved (%u blocks by %u bytes "
@@ -485,11 +1135,18 @@ static void rewrite_data(vdi_start_t *vdi, int fin, int fout,
 	} else {
 		ui->next_step("No need to move blocks");
 		ui->set_step_prog_val(1);
+		if (sparse && vdi->header.type == VDI_FIXED)
+			ui->log("NOTE    Zero blocks are left as they are, as no"
+			        " block is rewritten.\n");
 	}
 
-	vdi->header.offset.data = data_offset(vdi, new_blk_count);
+	vdi->header.offset.data = new_offset;
 	vdi->header.disk.size = disk_size(vdi, new_blk_count);
 	vdi->header.disk.blk_count_alloc = blocks;
+	if (remap->map)
+		vdi->header.disk.blk_count_alloc = kept;
+
+	return res;
 }
 
 static inline void fill_bam_with_unallocated_entries(vdi_bam_entry_t *bam,
@@ -507,119 +1164,1332 @@ static inline void fill_bam_with_consecutive_values(vdi_bam_entry_t *bam,
 		bam[i] = start_val + i;
 }
 
-static void update_block_allocation_map(vdi_start_t *vdi, int fin, int fout,
-                                        uint32_t new_blk_count)
+/* Writes BAM entries of new blocks from first up to last (exclusive) in large
+ * chunks: unallocated entries in dynamic image, consecutive positions in fixed
+ * one. */
+static int write_new_bam_entries(vdi_start_t *vdi, int fd, uint32_t first,
+                                 uint32_t last)
+{
+	uint32_t i, n;
+	uint32_t chunk = min_u32(IO_SCAN_CHUNK / VDI_BAM_ENTRY_SIZE, last - first);
+	vdi_bam_entry_t *buf;
+
+	if (first >= last)
+		return SUCCESS;
+	buf = malloc(VDI_BAM_SIZE((size_t)chunk));
+	if (!buf)
+		return FAILURE;
+	if (vdi->header.type == VDI_DYNAMIC)
+		fill_bam_with_unallocated_entries(buf, chunk);
+	for (i = first; i < last; i += n) {
+		n = min_u32(chunk, last - i);
+		if (vdi->header.type == VDI_FIXED)
+			fill_bam_with_consecutive_values(buf, i, n);
+		if (io_pwrite(fd, buf, VDI_BAM_SIZE((size_t)n),
+		              vdi->header.offset.bam + VDI_BAM_SIZE((uint64_t)i))
+		    != SUCCESS) {
+			free(buf);
+			return FAILURE;
+		}
+	}
+	free(buf);
+
+	return SUCCESS;
+}
+
+/* Fills with zeros area between BAM end and data beginning. */
+static int clear_bam_tail(vdi_start_t *vdi, int fd)
+{
+	uint64_t off = vdi->header.offset.bam +
+	               VDI_BAM_SIZE((uint64_t)vdi->header.disk.blk_count);
+	uint64_t end = vdi->header.offset.data;
+	size_t n;
+	void *zeros;
+
+	if (off >= end)
+		return SUCCESS;
+	zeros = calloc(min_u64(end - off, IO_SCAN_CHUNK), 1);
+	if (!zeros)
+		return FAILURE;
+	for (; off < end; off += n) {
+		n = min_u64(end - off, IO_SCAN_CHUNK);
+		if (io_pwrite(fd, zeros, n, off) != SUCCESS) {
+			free(zeros);
+			return FAILURE;
+		}
+	}
+	free(zeros);
+
+	return SUCCESS;
+}
+
+static int update_block_allocation_map(vdi_start_t *vdi, vdi_bam_t *bam,
+                                       int fin, int fout,
+                                       uint32_t new_blk_count,
+                                       const remap_t *remap,
+                                       vdi_bam_list_t *zeros)
 {
-	uint32_t i, j;
-	char *buffer;
-	ssize_t size;
-	vdi_bam_entry_t fill[FILL_COUNT];
 	uint32_t blk_count = min_u32(vdi->header.disk.blk_count, new_blk_count);
-	uint32_t total_end = (vdi->header.offset.data - vdi->header.offset.bam) /
-	                     VDI_BAM_ENTRY_SIZE;
 	int same_file = (same_file_behind_fds(fin, fout) == SUCCESS);
 
 	ui->next_step("Updating block allocation map");
 
-	/* Copy old BAM if needed. */
-	if (!same_file) {
-		lseek(fin, vdi->header.offset.bam, SEEK_SET);
-		lseek(fout, vdi->header.offset.bam, SEEK_SET);
-		buffer = malloc(_1MB);
-		i = blk_count;
-		while (i) {
-			size = read(fin, buffer,
-			            min_u64(VDI_BAM_SIZE((uint64_t)i), _1MB));
-			write(fout, buffer, size);
-			i -= size / VDI_BAM_ENTRY_SIZE;
-		}
-		free(buffer);
+	/* Write old BAM if needed (with zero blocks unallocated in memory). */
+	if ((remap->count || !same_file || (zeros && !bam->streamed)) &&
+	    write_bam(vdi, fout, bam, blk_count, remap) != SUCCESS) {
+		ui->log("ERROR   Writing block allocation map failed.\n");
+		return FAILURE;
+	}
+	/* Streamed BAM is unallocated in place only, copy gets it now. */
+	if (zeros && bam->streamed && !same_file &&
+	    unallocate_zero_blocks(bam, fout, zeros) != SUCCESS) {
+		ui->log("ERROR   Writing block allocation map failed.\n");
+		return FAILURE;
 	}
 
 	/* Fill new entries. */
 	if (new_blk_count > blk_count) {
-		i = blk_count;
-		lseek(fout, vdi->header.offset.bam + VDI_BAM_SIZE(i), SEEK_SET);
-		j = ALIGN2(i, FILL_COUNT);
-		if (vdi->header.type == VDI_DYNAMIC) {
-			fill_bam_with_unallocated_entries(fill, FILL_COUNT);
-			i += write(fout, fill,
-			           VDI_BAM_SIZE((uint64_t)min_u32(j - i,
-			                                          new_blk_count - i))) /
-			     VDI_BAM_ENTRY_SIZE;
-			for (; i < (new_blk_count & -FILL_COUNT); i += FILL_COUNT)
-				write(fout, fill, VDI_BAM_SIZE(FILL_COUNT));
-			write(fout, fill, VDI_BAM_SIZE(new_blk_count - i));
-		} else if (vdi->header.type == VDI_FIXED) {
-			fill_bam_with_consecutive_values(fill, i, FILL_COUNT);
-			i += write(fout, fill,
-			           VDI_BAM_SIZE((uint64_t)min_u32(j - i,
-			                                          new_blk_count - i))) /
-			     VDI_BAM_ENTRY_SIZE;
-			for (; i < (new_blk_count & -FILL_COUNT); i += FILL_COUNT) {
-				fill_bam_with_consecutive_values(fill, i, FILL_COUNT);
-				write(fout, fill, VDI_BAM_SIZE(FILL_COUNT));
-			}
-			fill_bam_with_consecutive_values(fill, i, new_blk_count - i);
-			write(fout, fill, VDI_BAM_SIZE(new_blk_count - i));
-
-			vdi->header.disk.blk_count_alloc = new_blk_count;
+		if (write_new_bam_entries(vdi, fout, blk_count,
+		                          new_blk_count) != SUCCESS) {
+			ui->log("ERROR   Writing block allocation map failed.\n");
+			return FAILURE;
 		}
+		if (vdi->header.type == VDI_FIXED)
+			vdi->header.disk.blk_count_alloc = new_blk_count;
 	}
 
 	vdi->header.disk.blk_count = new_blk_count;
 
 	/* Fill with 0 area between BAM end and data beginning. */
-	i = new_blk_count;
-	lseek(fout, vdi->header.offset.bam + VDI_BAM_SIZE(i), SEEK_SET);
-	j = ALIGN2(i, FILL_COUNT);
-	memset(fill, 0, VDI_BAM_SIZE(FILL_COUNT));
-	i += write(fout, fill,
-	           VDI_BAM_SIZE((uint64_t)min_u32(j - i, total_end - i))) /
-	     VDI_BAM_ENTRY_SIZE;
-	for (; i < (total_end & -FILL_COUNT); i += FILL_COUNT)
-		write(fout, fill, VDI_BAM_SIZE(FILL_COUNT));
-	write(fout, fill, VDI_BAM_SIZE(total_end - i));
+	if (clear_bam_tail(vdi, fout) != SUCCESS) {
+		ui->log("ERROR   Writing block allocation map failed.\n");
+		return FAILURE;
+	}
 
 	ui->set_step_prog_val(1);
-	ui->log("Syncing\n");
-	fsync(fout);
+
+	return sync_step(fout, 1);
 }
 
-static void update_file_size(vdi_start_t *vdi, int fd)
+static int update_file_size(vdi_start_t *vdi, int fd)
 {
 	ui->next_step("Updating file size");
 	ftruncate(fd,
 	          vdi->header.offset.data +
 	          image_data_size(vdi, vdi->header.disk.blk_count_alloc));
 	ui->set_step_prog_val(1);
-	ui->log("Syncing\n");
-	fsync(fd);
+
+	return sync_step(fd, 0);
 }
 
-static void update_header(vdi_start_t *vdi, int fd)
+static int update_header(vdi_start_t *vdi, int fd)
 {
 	ui->next_step("Updating header");
 	/* VB will fix lchs section */
 	vdi->header.lchs.cylinders = 0;
 	vdi->header.lchs.heads = 0;
 	vdi->header.lchs.sectors = 0;
-	write_start(fd, vdi);
+	if (write_start(fd, vdi) != SUCCESS) {
+		ui->log("ERROR   Writing header failed.\n");
+		return FAILURE;
+	}
 	ui->set_step_prog_val(1);
-	ui->log("Syncing\n");
-	fsync(fd);
+
+	return sync_step(fd, 1);
 }
 
-static int resize(vdi_start_t *vdi, int fin, int fout, uint32_t new_blk_count)
+/* Resizes image. Sparse copy of dynamic image with BAM in memory packs
+ * non-zero blocks on the way, otherwise zero blocks of dynamic image are
+ * found beforehand, unallocated in BAM and (in-place) punched out, leaving
+ * their positions free until compact. */
+static int resize(vdi_start_t *vdi, vdi_bam_t *bam, int fin, int fout,
+                  uint32_t new_blk_count, int sparse, const char *op)
 {
-	ui->start_op("Resize", 4);
-	rewrite_data(vdi, fin, fout, new_blk_count);
-	update_block_allocation_map(vdi, fin, fout, new_blk_count);
-	update_file_size(vdi, fout);
-	update_header(vdi, fout);
+	int res = FAILURE;
+	int same_file = (same_file_behind_fds(fin, fout) == SUCCESS);
+	int unalloc = sparse && vdi->header.type == VDI_DYNAMIC &&
+	              (same_file || bam->streamed);
+	remap_t remap = { NULL };
+	vdi_bam_list_t zeros;
+
+	if (vdi_bam_list_init(&zeros, bam) != SUCCESS)
+		return FAILURE;
+	ui->start_op(op, 4 + unalloc + (unalloc && same_file));
+	if (unalloc &&
+	    look_for_zero_blocks(vdi, bam, fin, fout, &zeros) != SUCCESS)
+		goto out;
+	if (rewrite_data(vdi, bam, fin, fout, new_blk_count, sparse,
+	                 &remap) != SUCCESS)
+		goto out;
+	if (unalloc && same_file &&
+	    punch_zero_blocks(vdi, fout, &remap, &zeros) != SUCCESS)
+		goto out;
+	if (update_block_allocation_map(vdi, bam, fin, fout, new_blk_count,
+	                                &remap, unalloc ? &zeros : NULL)
+	    != SUCCESS ||
+	    update_file_size(vdi, fout) != SUCCESS ||
+	    update_header(vdi, fout) != SUCCESS)
+		goto out;
+	res = SUCCESS;
+
+out:
+	free(remap.map);
+	vdi_bam_list_free(&zeros);
+	if (res != SUCCESS) {
+		ui->log("%s failed.\n", op);
+		return FAILURE;
+	}
 	ui->end_op();
 	ui->log("\n");
 	print_info_from_struct(vdi, 0);
 
 	return SUCCESS;
 }
+
+/** State of write_bam(). */
+typedef struct bam_writer {
+	uint64_t off;
+	int fd;
+	const remap_t *remap;
+	vdi_bam_entry_t *buf;
+} bam_writer_t;
+
+static int write_bam_chunk(const vdi_bam_entry_t *entries, uint32_t first,
+                           uint32_t n, void *ctx)
+{
+	bam_writer_t *w = ctx;
+	uint32_t i;
+
+	for (i = 0; i < n; i++)
+		w->buf[i] = remap_pos(w->remap, entries[i]);
+
+	return io_pwrite(w->fd, w->buf, VDI_BAM_SIZE((size_t)n),
+	                 w->off + VDI_BAM_SIZE((uint64_t)first));
+}
+
+/* Writes first blk_count entries of BAM, translating positions through
+ * remap. */
+static int write_bam(vdi_start_t *vdi, int fd, const vdi_bam_t *bam,
+                     uint32_t blk_count, const remap_t *remap)
+{
+	int res;
+	bam_writer_t w = { vdi->header.offset.bam, fd, remap, NULL };
+
+	w.buf = malloc(IO_SCAN_CHUNK);
+	if (!w.buf)
+		return FAILURE;
+	res = vdi_bam_scan(bam, 0, blk_count, write_bam_chunk, &w);
+	free(w.buf);
+
+	return res;
+}
+
+static int mover_init(mover_t *m, vdi_start_t *vdi, vdi_bam_t *bam,
+                      int fin, int fout)
+{
+	memset(m, 0, sizeof(*m));
+	m->vdi = vdi;
+	m->bam = bam;
+	m->fin = fin;
+	m->fout = fout;
+	m->max_run = min_u64(max_u64(io_opts.window / ext_blk_size64(vdi), 1),
+	                     UINT32_MAX);
+	m->blks = malloc(VDI_BAM_SIZE((size_t)m->max_run));
+	if (!m->blks) {
+		ui->log("ERROR   Cannot allocate moves buffer.\n");
+		return FAILURE;
+	}
+	m->start = gettimeofday_us();
+
+	return SUCCESS;
+}
+
+static int mover_flush(mover_t *m)
+{
+	uint32_t i;
+	uint64_t ebs = ext_blk_size64(m->vdi);
+	uint64_t data = m->vdi->header.offset.data;
+
+	if (!m->run.count)
+		return SUCCESS;
+	if (io_copy(m->fin, data + m->run.src * ebs,
+	            m->fout, data + m->run.dst * ebs,
+	            m->run.count * ebs, 0) != SUCCESS)
+		return FAILURE;
+	for (i = 0; i < m->run.count; i++)
+		if (vdi_bam_set(m->bam, m->fout, m->blks[i],
+		                m->run.dst + i) != SUCCESS) {
+			ui->log("ERROR   Writing block allocation map failed.\n");
+			return FAILURE;
+		}
+	m->moved += m->run.count;
+	m->runs++;
+	m->run.count = 0;
+	ui->set_step_prog_val(m->moved);
+
+	return SUCCESS;
+}
+
+/* Moves block blk from position src to dst, extending pending run if
+ * possible. */
+static int mover_add(mover_t *m, uint32_t src, uint32_t dst, uint32_t blk)
+{
+	if (m->run.count && m->run.count < m->max_run &&
+	    m->run.src + m->run.count == src &&
+	    m->run.dst + m->run.count == dst) {
+		m->blks[m->run.count++] = blk;
+		return SUCCESS;
+	}
+	if (mover_flush(m) != SUCCESS)
+		return FAILURE;
+	m->run.src = src;
+	m->run.dst = dst;
+	m->run.count = 1;
+	m->blks[0] = blk;
+
+	return SUCCESS;
+}
+
+static int mover_finish(mover_t *m, const char *what)
+{
+	uint64_t end;
+
+	if (mover_flush(m) != SUCCESS)
+		return FAILURE;
+	if (!m->moved)
+		ui->set_step_prog_val(1);
+	if (sync_step(m->fout, 1) != SUCCESS)
+		return FAILURE;
+	end = max_u64(gettimeofday_us(), m->start + 1);
+	ui->log(
+	        "Data %s (%u blocks in %u runs "
+	        "in %"PRIu64" ms = ~%"PRIu64" B/us)\n",
+	        what,
+	        m->moved,
+	        m->runs,
+	        (end - m->start) / 1000,
+	        ((uint64_t)m->moved * ext_blk_size64(m->vdi)) / (end - m->start)
+	       );
+
+	return SUCCESS;
+}
+
+static void mover_free(mover_t *m)
+{
+	free(m->blks);
+	m->blks = NULL;
+}
+
+/** State of find_zero_blocks() scan. */
+typedef struct zero_blocks {
+	uint32_t ebs;
+	int zero;               /**< Whether current block is zero so far. */
+	vdi_bam_rev_t *it;
+	int have;               /**< Whether pos and blk came from it. */
+	uint32_t pos, blk;      /**< The lowest allocated block not passed. */
+	vdi_bam_list_t *zeros;
+	uint32_t count;
+} zero_blocks_t;
+
+/* Records zero block found at position pos, if BAM refers to it. */
+static int zero_block_found(zero_blocks_t *zb, uint32_t pos)
+{
+	while (zb->have && zb->pos < pos)
+		zb->have = vdi_bam_rev_next(zb->it, &zb->pos, &zb->blk) == SUCCESS;
+	if (!zb->have || zb->pos != pos)
+		return SUCCESS;
+	if (vdi_bam_list_push(zb->zeros, pos) != SUCCESS ||
+	    vdi_bam_list_push(zb->zeros, zb->blk) != SUCCESS) {
+		ui->log("ERROR   Cannot record zero block.\n");
+		return FAILURE;
+	}
+	zb->count++;
+
+	return SUCCESS;
+}
+
+static int find_zero_blocks_in_chunk(const void *buf, uint64_t off,
+                                     size_t len, void *ctx)
+{
+	zero_blocks_t *zb = ctx;
+	const char *p = buf;
+	uint64_t in_blk;
+	size_t n;
+
+	while (len) {
+		in_blk = off % zb->ebs;
+		n = min_u64(len, zb->ebs - in_blk);
+		if (!in_blk)
+			zb->zero = 1;
+		if (zb->zero && !mem_is_zero(p, n))
+			zb->zero = 0;
+		if (zb->zero && in_blk + n == zb->ebs &&
+		    zero_block_found(zb, off / zb->ebs) != SUCCESS)
+			return FAILURE;
+		p += n;
+		off += n;
+		len -= n;
+	}
+	ui->set_step_prog_val(off / zb->ebs);
+
+	return zb->it->err ? FAILURE : SUCCESS;
+}
+
+/* Finds blocks filled with zeros, which BAM refers to. Blocks are read in
+ * order of positions and matched with allocated blocks given by it. Position
+ * and number of each zero block are appended to zeros. */
+static int find_zero_blocks(vdi_start_t *vdi, int fd, vdi_bam_rev_t *it,
+                            vdi_bam_list_t *zeros, uint32_t *zero_count)
+{
+	uint32_t alloc = vdi->header.disk.blk_count_alloc;
+	zero_blocks_t zb = { .ebs = ext_blk_size(vdi), .it = it, .zeros = zeros };
+
+	if (vdi_bam_rev_rewind(it) != SUCCESS)
+		return FAILURE;
+	zb.have = vdi_bam_rev_next(it, &zb.pos, &zb.blk) == SUCCESS;
+	ui->set_step_prog_max(max_u32(alloc, 1));
+	if (io_scan(fd, vdi->header.offset.data, image_data_size(vdi, alloc),
+	            find_zero_blocks_in_chunk, &zb) != SUCCESS) {
+		if (!it->err)
+			ui->log("ERROR   Reading allocated blocks failed.\n");
+		return FAILURE;
+	}
+	if (!alloc)
+		ui->set_step_prog_val(1);
+	*zero_count = zb.count;
+
+	return it->err ? FAILURE : SUCCESS;
+}
+
+/* Marks blocks given by list of zero blocks (pairs of position and block
+ * number) as unallocated blocks of zeros. */
+static int unallocate_zero_blocks(vdi_bam_t *bam, int fd,
+                                  vdi_bam_list_t *zeros)
+{
+	uint32_t pos, blk;
+
+	vdi_bam_list_rewind(zeros);
+	while (vdi_bam_list_pop(zeros, &pos) == SUCCESS &&
+	       vdi_bam_list_pop(zeros, &blk) == SUCCESS)
+		if (vdi_bam_set(bam, fd, blk, VDI_BLK_ZERO) != SUCCESS)
+			return FAILURE;
+
+	return SUCCESS;
+}
+
+/* Finds zero blocks for sparse resize, which cannot pack blocks. They are
+ * unallocated at once in BAM kept in memory or streamed BAM of the image
+ * being resized in-place (i.e. before any block is overwritten), streamed
+ * BAM of copy gets them once it's written. */
+static int look_for_zero_blocks(vdi_start_t *vdi, vdi_bam_t *bam, int fin,
+                                int fout, vdi_bam_list_t *zeros)
+{
+	int same_file = (same_file_behind_fds(fin, fout) == SUCCESS);
+	int res;
+	uint32_t zero_count = 0;
+	vdi_bam_rev_t it;
+
+	ui->next_step("Looking for zero blocks");
+	if (vdi_bam_rev_open(&it, bam, bam->blk_count) != SUCCESS)
+		return FAILURE;
+	res = find_zero_blocks(vdi, fin, &it, zeros, &zero_count);
+	vdi_bam_rev_close(&it);
+	if (res != SUCCESS)
+		return FAILURE;
+	if ((!bam->streamed || same_file) &&
+	    unallocate_zero_blocks(bam, fout, zeros) != SUCCESS) {
+		ui->log("ERROR   Writing block allocation map failed.\n");
+		return FAILURE;
+	}
+	if (bam->streamed && same_file && sync_step(fout, 1) != SUCCESS)
+		return FAILURE;
+	ui->log("Zero blocks found (%u of %u blocks)\n", zero_count,
+	        vdi->header.disk.blk_count_alloc);
+
+	return SUCCESS;
+}
+
+/* Punches out zero blocks found by look_for_zero_blocks() at their new
+ * positions, coalescing adjacent ones. Filesystem not supporting it leaves
+ * them as they are. */
+static int punch_zero_blocks(vdi_start_t *vdi, int fd, const remap_t *remap,
+                             vdi_bam_list_t *zeros)
+{
+	uint64_t ebs = ext_blk_size64(vdi);
+	uint64_t off, start = 0, len = 0;
+	uint32_t pos, blk;
+	int punched = 1;
+
+	ui->next_step("Punching out zero blocks");
+	vdi_bam_list_rewind(zeros);
+	while (vdi_bam_list_pop(zeros, &pos) == SUCCESS &&
+	       vdi_bam_list_pop(zeros, &blk) == SUCCESS) {
+		off = vdi->header.offset.data + remap_pos(remap, pos) * ebs;
+		if (len && off == start + len) {
+			len += ebs;
+			continue;
+		}
+		if (len && io_punch_hole(fd, start, len) != SUCCESS)
+			punched = 0;
+		start = off;
+		len = ebs;
+	}
+	if (len && io_punch_hole(fd, start, len) != SUCCESS)
+		punched = 0;
+	ui->set_step_prog_val(1);
+	if (!punched)
+		ui->log("NOTE    Space of zero blocks cannot be released by"
+		        " filesystem,\n"
+		        "        compact the image to reclaim it.\n");
+
+	return SUCCESS;
+}
+
+/* Reads position of the next block from skip list holding pairs of position
+ * and block number. */
+static inline int next_skipped(vdi_bam_list_t *skip, uint32_t *pos)
+{
+	uint32_t blk;
+
+	return vdi_bam_list_pop(skip, pos) == SUCCESS &&
+	       vdi_bam_list_pop(skip, &blk) == SUCCESS;
+}
+
+/* Counts blocks given by it (except those in skip list) placed at or past
+ * live position. */
+static int count_moves(vdi_bam_rev_t *it, vdi_bam_list_t *skip,
+                       uint32_t live, uint32_t *moved)
+{
+	int have_skip = 0;
+	uint32_t pos, blk;
+	uint32_t sk = 0;
+
+	*moved = 0;
+	if (vdi_bam_rev_rewind(it) != SUCCESS)
+		return FAILURE;
+	if (skip) {
+		vdi_bam_list_rewind(skip);
+		have_skip = next_skipped(skip, &sk);
+	}
+	while (vdi_bam_rev_next(it, &pos, &blk) == SUCCESS) {
+		while (have_skip && sk < pos)
+			have_skip = next_skipped(skip, &sk);
+		if (have_skip && sk == pos)
+			continue;
+		*moved += pos >= live;
+	}
+
+	return it->err ? FAILURE : SUCCESS;
+}
+
+/* Packs blocks given by it (except those in skip list) into first live
+ * positions. Only blocks lying past the packed area are moved, each into the
+ * lowest hole within it, so the number of moved blocks is minimal and blocks
+ * adjacent before moving stay adjacent. As blocks come in order of positions,
+ * all holes are known before the first block to be moved.
+ * If all is set (e.g. for copying into another file), every block is moved
+ * and blocks keep their order. */
+static int pack_blocks(vdi_start_t *vdi, vdi_bam_t *bam, int fin, int fout,
+                       vdi_bam_rev_t *it, vdi_bam_list_t *skip, uint32_t live,
+                       int all, const char *step, uint32_t moved)
+{
+	int res = FAILURE;
+	int have_skip = 0;
+	int holes_ready = 0;
+	uint32_t pos, blk, dst;
+	uint32_t sk = 0;
+	uint32_t rank = 0;
+	uint32_t next_free = 0;
+	vdi_bam_list_t holes;
+	mover_t m;
+
+	ui->next_step(step);
+	ui->set_step_prog_max(max_u32(moved, 1));
+	if (vdi_bam_list_init(&holes, bam) != SUCCESS)
+		return FAILURE;
+	if (mover_init(&m, vdi, bam, fin, fout) != SUCCESS) {
+		vdi_bam_list_free(&holes);
+		return FAILURE;
+	}
+	if (vdi_bam_rev_rewind(it) != SUCCESS)
+		goto out;
+	if (skip) {
+		vdi_bam_list_rewind(skip);
+		have_skip = next_skipped(skip, &sk);
+	}
+
+	while (vdi_bam_rev_next(it, &pos, &blk) == SUCCESS) {
+		while (have_skip && sk < pos)
+			have_skip = next_skipped(skip, &sk);
+		if (have_skip && sk == pos)
+			continue;
+		if (all) {
+			dst = rank++;
+		} else if (pos < live) {
+			for (; next_free < pos; next_free++)
+				if (vdi_bam_list_push(&holes, next_free) != SUCCESS)
+					goto no_hole;
+			next_free = pos + 1;
+			continue;
+		} else {
+			if (!holes_ready) {
+				for (; next_free < live; next_free++)
+					if (vdi_bam_list_push(&holes, next_free) != SUCCESS)
+						goto no_hole;
+				vdi_bam_list_rewind(&holes);
+				holes_ready = 1;
+			}
+			if (vdi_bam_list_pop(&holes, &dst) != SUCCESS)
+				goto no_hole;
+		}
+		if (mover_add(&m, pos, dst, blk) != SUCCESS)
+			goto out;
+	}
+	if (!it->err)
+		res = mover_finish(&m, all ? "copied" : "moved");
+	goto out;
+
+no_hole:
+	ui->log("ERROR   Cannot find hole for block %u at position %u.\n",
+	        blk, pos);
+out:
+	mover_free(&m);
+	vdi_bam_list_free(&holes);
+
+	return res;
+}
+
+/* Last 3 steps of operations packing blocks: BAM is written (unless it's
+ * streamed and written through already), then file is truncated to live
+ * blocks and header is updated. */
+static int finish_packing(vdi_start_t *vdi, vdi_bam_t *bam, int fout,
+                          uint32_t live)
+{
+	ui->next_step("Updating block allocation map");
+	if (vdi_bam_flush(bam, fout, vdi->header.disk.blk_count) != SUCCESS ||
+	    clear_bam_tail(vdi, fout) != SUCCESS) {
+		ui->log("ERROR   Writing block allocation map failed.\n");
+		return FAILURE;
+	}
+	ui->set_step_prog_val(1);
+	if (sync_step(fout, 1) != SUCCESS)
+		return FAILURE;
+
+	vdi->header.disk.blk_count_alloc = live;
+	if (update_file_size(vdi, fout) != SUCCESS ||
+	    update_header(vdi, fout) != SUCCESS)
+		return FAILURE;
+	ui->end_op();
+	ui->log("\n");
+	print_info_from_struct(vdi, 0);
+
+	return SUCCESS;
+}
+
+static int compact_confirmation(vdi_start_t *vdi, int same_file,
+                                uint32_t zero_count, uint32_t live,
+                                uint32_t moved)
+{
+	uint64_t old_image_size = image_size(vdi, vdi->header.offset.data,
+	                                     vdi->header.disk.blk_count);
+	uint64_t new_image_size = vdi->header.offset.data +
+	                          image_data_size(vdi, live);
+
+	ui->log("\nAllocated blocks\n"
+	        "     %21u block(s)\n"
+	        "filled with zeros\n"
+	        "     %21u block(s)\n"
+	        "%s\n"
+	        "     %21u block(s)\n"
+	        "\n",
+	        vdi->header.disk.blk_count_alloc, zero_count,
+	        same_file ? "to be moved into holes" : "to be copied", moved);
+	ui->log("Image size will change\n"
+	        "from %21"PRIu64" bytes (%15"PRIu64" MB)\n"
+	        "to   %21"PRIu64" bytes (%15"PRIu64" MB)\n"
+	        "\n",
+	        old_image_size, old_image_size / _1MB,
+	        new_image_size, new_image_size / _1MB);
+
+	if (same_file) {
+		ui->log("Compact operation will be performed in-place.\n");
+		ui->log("CAUTION Blocks are moved only into unused space and block\n"
+		        "        allocation map is updated afterwards, but\n"
+		        "        in case of fail DATA LOSS is POSSIBLE!\n");
+	} else {
+		ui->log("Compact operation in fact will create compacted copy of the image.\n");
+		ui->log("NOTE    UUID of the new image will be the same as old one.\n");
+		ui->log("NOTE    Input file is safe and won't be modified.\n");
+	}
+
+	return ui->yesno("Are you sure you want to continue?");
+}
+
+/* Compacts dynamic image. Zero blocks are unallocated first (in-place BAM is
+ * written before any block is overwritten), then blocks lying past the
+ * packed area are moved into holes (or all blocks are copied keeping their
+ * order), BAM is updated and file is truncated. */
+static int compact(vdi_start_t *vdi, vdi_bam_t *bam, int fin, int fout)
+{
+	int res = FAILURE;
+	int same_file = same_file_behind_fds(fin, fout) == SUCCESS;
+	uint32_t live, moved;
+	uint32_t zero_count = 0;
+	vdi_bam_rev_t it;
+	vdi_bam_list_t zeros;
+
+	if (vdi_bam_list_init(&zeros, bam) != SUCCESS)
+		return FAILURE;
+	if (vdi_bam_rev_open(&it, bam, bam->blk_count) != SUCCESS) {
+		vdi_bam_list_free(&zeros);
+		return FAILURE;
+	}
+
+	ui->start_op("Analysis", 1);
+	ui->next_step("Looking for zero blocks");
+	if (find_zero_blocks(vdi, fin, &it, &zeros, &zero_count) != SUCCESS) {
+		ui->end_op();
+		goto out;
+	}
+	ui->end_op();
+
+	live = bam->allocated - zero_count;
+	if (count_moves(&it, &zeros, live, &moved) != SUCCESS)
+		goto out;
+	if (!same_file)
+		moved = live;
+
+	if (same_file && live == vdi->header.disk.blk_count_alloc) {
+		ui->log("\nImage is already compact.\n");
+		res = SUCCESS;
+		goto out;
+	}
+
+	if (compact_confirmation(vdi, same_file, zero_count,
+	                         live, moved) != SUCCESS) {
+		ui->log("Compact aborted.\n");
+		goto out;
+	}
+
+	ui->start_op("Compact", 5);
+	ui->next_step("Unallocating zero blocks");
+	if (!same_file &&
+	    vdi_bam_prepare(bam, fout, bam->blk_count) != SUCCESS)
+		goto bam_fail;
+	if (unallocate_zero_blocks(bam, fout, &zeros) != SUCCESS)
+		goto bam_fail;
+	if (same_file &&
+	    vdi_bam_flush(bam, fout, bam->blk_count) != SUCCESS)
+		goto bam_fail;
+	ui->set_step_prog_val(1);
+	if (sync_step(fout, 1) != SUCCESS)
+		goto fail;
+
+	if (pack_blocks(vdi, bam, fin, fout, &it, &zeros, live, !same_file,
+	                same_file ? "Moving blocks into holes" : "Copying blocks",
+	                moved) != SUCCESS)
+		goto fail;
+
+	if (finish_packing(vdi, bam, fout, live) != SUCCESS)
+		goto fail;
+	res = SUCCESS;
+	goto out;
+
+bam_fail:
+	ui->log("ERROR   Writing block allocation map failed.\n");
+fail:
+	ui->log("Compact failed.\n");
+out:
+	vdi_bam_rev_close(&it);
+	vdi_bam_list_free(&zeros);
+
+	return res;
+}
+
+static int count_allocated_chunk(const vdi_bam_entry_t *entries,
+                                 uint32_t first, uint32_t n, void *ctx)
+{
+	uint32_t *allocated = ctx;
+	map_stats_t st;
+
+	(void)first;
+	map_stats(entries, n, &st);
+	*allocated += n - st.unused - st.zero;
+
+	return SUCCESS;
+}
+
+/* Counts allocated blocks among first blk_count ones. */
+static int count_allocated(const vdi_bam_t *bam, uint32_t blk_count,
+                           uint32_t *allocated)
+{
+	*allocated = 0;
+	if (vdi_bam_scan(bam, 0, blk_count, count_allocated_chunk,
+	                 allocated) != SUCCESS) {
+		ui->log("ERROR   Reading block allocation map failed.\n");
+		return FAILURE;
+	}
+
+	return SUCCESS;
+}
+
+static int shrink_confirmation(vdi_start_t *vdi, int fout, int same_file,
+                               uint32_t new_blk_count, uint32_t discarded,
+                               uint32_t live, uint32_t moved)
+{
+	uint64_t free_bytes = 0;
+	uint64_t new_disk_size = disk_size(vdi, new_blk_count);
+	uint64_t old_image_size = image_size(vdi, vdi->header.offset.data,
+	                                     vdi->header.disk.blk_count);
+	uint64_t new_image_size = vdi->header.offset.data +
+	                          image_data_size(vdi, live);
+	uint64_t req_bytes = same_file ? 0 : new_image_size;
+
+	ui->log("Requested disk resize\n"
+	        "from %21u block(s)\nto   %21u block(s)\n"
+	        "(each block has %10u bytes + %u extra bytes)\n",
+	        vdi->header.disk.blk_count, new_blk_count,
+	        vdi->header.disk.blk_size, vdi->header.disk.blk_extra_data);
+
+	ui->log("\nAllocated blocks beyond new size\n"
+	        "     %21u block(s)\n"
+	        "%s\n"
+	        "     %21u block(s)\n",
+	        discarded,
+	        same_file ? "to be moved into holes" : "to be copied",
+	        moved);
+
+	ui->log("\nDisk size will change\n"
+	        "from %21"PRIu64" bytes (%15"PRIu64" MB)\n"
+	        "to   %21"PRIu64" bytes (%15"PRIu64" MB)\n"
+	        "\n",
+	        vdi->header.disk.size, vdi->header.disk.size / _1MB,
+	        new_disk_size, new_disk_size / _1MB);
+	ui->log("Image size will change\n"
+	        "from %21"PRIu64" bytes (%15"PRIu64" MB)\n"
+	        "to   %21"PRIu64" bytes (%15"PRIu64" MB)\n"
+	        "\n",
+	        old_image_size, old_image_size / _1MB,
+	        new_image_size, new_image_size / _1MB);
+
+	ui->log("Required free space on the volume\n"
+	        "     %21"PRIu64" bytes (%15"PRIu64" MB)\n",
+	        req_bytes, req_bytes / _1MB);
+	get_volume_free_space(fout, &free_bytes);
+	ui->log("Available free space on the volume\n"
+	        "     %21"PRIu64" bytes (%15"PRIu64" MB)\n",
+	        free_bytes, free_bytes / _1MB);
+	if (free_bytes < req_bytes)
+		ui->log("which seems not enough to perform the resize operation!\n");
+	ui->log("\n");
+
+	if (same_file) {
+		ui->log("Resize operation will be performed in-place.\n");
+		ui->log("CAUTION Only %u block(s) placed beyond new end of data\n"
+		        "        will be moved into holes.\n"
+		        "        In case of fail DATA LOSS is POSSIBLE!\n",
+		        moved);
+		ui->log("WARNING Shrinking disk in-place means\n"
+		        "        IRRETRIEVABLY LOSING DATA KEPT BEYOND NEW SIZE!\n");
+	} else {
+		ui->log("Resize operation in fact will create resized copy of the image.\n");
+		ui->log("NOTE    UUID of the new image will be the same as old one.\n");
+		ui->log("NOTE    Input file is safe and won't be modified.\n");
+	}
+	if (discarded)
+		ui->log("WARNING %u allocated block(s) beyond new size will be DISCARDED!\n",
+		        discarded);
+
+	return ui->yesno("Are you sure you want to continue?");
+}
+
+/* Shrinks dynamic image below its last allocated block or below position of
+ * the last block. BAM entries past new size are dropped and blocks are packed
+ * like in compact(), so in-place only blocks placed beyond new end of data
+ * are moved. Holes may be taken from dropped blocks before BAM is updated,
+ * but these are lost anyway. */
+static int shrink(vdi_start_t *vdi, vdi_bam_t *bam, int fin, int fout,
+                  uint32_t new_blk_count)
+{
+	int res = FAILURE;
+	int same_file = same_file_behind_fds(fin, fout) == SUCCESS;
+	uint32_t live, moved;
+	vdi_bam_rev_t it;
+
+	if (count_allocated(bam, new_blk_count, &live) != SUCCESS ||
+	    vdi_bam_rev_open(&it, bam, new_blk_count) != SUCCESS)
+		return FAILURE;
+	if (count_moves(&it, NULL, live, &moved) != SUCCESS)
+		goto out;
+	if (!same_file)
+		moved = live;
+
+	if (shrink_confirmation(vdi, fout, same_file, new_blk_count,
+	                        bam->allocated - live, live, moved) != SUCCESS) {
+		ui->log("Resize aborted.\n");
+		goto out;
+	}
+
+	ui->start_op("Resize", 4);
+	if (!same_file &&
+	    vdi_bam_prepare(bam, fout, new_blk_count) != SUCCESS) {
+		ui->log("ERROR   Writing block allocation map failed.\n");
+		goto fail;
+	}
+	if (pack_blocks(vdi, bam, fin, fout, &it, NULL, live, !same_file,
+	                same_file ? "Relocating blocks" : "Copying blocks",
+	                moved) != SUCCESS)
+		goto fail;
+
+	vdi->header.disk.blk_count = new_blk_count;
+	vdi->header.disk.size = disk_size(vdi, new_blk_count);
+	if (finish_packing(vdi, bam, fout, live) != SUCCESS)
+		goto fail;
+	res = SUCCESS;
+	goto out;
+
+fail:
+	ui->log("Resize failed.\n");
+out:
+	vdi_bam_rev_close(&it);
+
+	return res;
+}
+
+/** State of fragmentation() scan. */
+typedef struct frag {
+	uint32_t live;
+	uint32_t breaks;
+	uint32_t prev;
+} frag_t;
+
+static int fragmentation_chunk(const vdi_bam_entry_t *entries, uint32_t first,
+                               uint32_t n, void *ctx)
+{
+	frag_t *f = ctx;
+	uint32_t i;
+
+	(void)first;
+	for (i = 0; i < n; i++) {
+		if (!VDI_BLK_IS_ALLOCATED(entries[i]))
+			continue;
+		if (f->live++ && entries[i] != f->prev + 1)
+			f->breaks++;
+		f->prev = entries[i];
+	}
+
+	return SUCCESS;
+}
+
+/* Counts allocated blocks (in BAM order) not placed right after the previous
+ * allocated block, i.e. places where sequential reading of the disk has to
+ * seek. */
+static int fragmentation(const vdi_bam_t *bam, uint32_t *breaks,
+                         uint32_t *live)
+{
+	frag_t f = { 0, 0, 0 };
+
+	if (vdi_bam_scan(bam, 0, bam->blk_count, fragmentation_chunk,
+	                 &f) != SUCCESS) {
+		ui->log("ERROR   Reading block allocation map failed.\n");
+		return FAILURE;
+	}
+	*breaks = f.breaks;
+	if (live)
+		*live = f.live;
+
+	return SUCCESS;
+}
+
+static inline void print_fragmentation(const char *when, uint32_t breaks,
+                                       uint32_t live)
+{
+	ui->log("Fragmentation %s\n"
+	        "     %21u of %u block(s) not following previous one"
+	        " (%u.%u%%)\n",
+	        when, breaks, live,
+	        (uint32_t)(breaks * 100ULL / max_u32(live, 1)),
+	        (uint32_t)(breaks * 1000ULL / max_u32(live, 1) % 10));
+}
+
+/** State of plan_defrag() scan. */
+typedef struct defrag_plan {
+	vdi_bam_array_t *target;
+	vdi_bam_array_t *source;
+	uint32_t pos_count;
+	uint32_t rank;      /**< New position of the next block. */
+	uint32_t misplaced;
+} defrag_plan_t;
+
+static int plan_defrag_chunk(const vdi_bam_entry_t *entries, uint32_t first,
+                             uint32_t n, void *ctx)
+{
+	defrag_plan_t *dp = ctx;
+	vdi_bam_entry_t old = VDI_BLK_NONE;
+	uint32_t i, pos;
+
+	for (i = 0; i < n; i++) {
+		pos = entries[i];
+		if (!VDI_BLK_IS_ALLOCATED(pos))
+			continue;
+		if (pos < dp->pos_count &&
+		    vdi_bam_array_get(dp->target, pos, &old) != SUCCESS)
+			return FAILURE;
+		if (pos >= dp->pos_count || old != VDI_BLK_NONE) {
+			ui->log("ERROR   Block allocation map is corrupted "
+			        "(block %u at position %u).\n", first + i, pos);
+			return FAILURE;
+		}
+		if (vdi_bam_array_set(dp->target, pos, dp->rank) != SUCCESS ||
+		    vdi_bam_array_set(dp->source, dp->rank, pos) != SUCCESS)
+			return FAILURE;
+		dp->misplaced += pos != dp->rank;
+		dp->rank++;
+	}
+
+	return SUCCESS;
+}
+
+/* Plans placing live allocated blocks in BAM order at first positions.
+ *
+ * target receives new position of block at each position (VDI_BLK_NONE for
+ * unreferenced ones) and source position of block to be placed at each of
+ * live first positions. Both are kept in temporary files if BAM is
+ * streamed.
+ */
+static int plan_defrag(const vdi_bam_t *bam, uint32_t live,
+                       vdi_bam_array_t *target, vdi_bam_array_t *source,
+                       uint32_t *misplaced)
+{
+	defrag_plan_t dp = { target, source, bam->pos_count, 0, 0 };
+
+	if (vdi_bam_array_init(target, bam, bam->pos_count) != SUCCESS ||
+	    vdi_bam_array_init(source, bam, live) != SUCCESS)
+		return FAILURE;
+	if (vdi_bam_scan(bam, 0, bam->blk_count, plan_defrag_chunk,
+	                 &dp) != SUCCESS)
+		return FAILURE;
+	*misplaced = dp.misplaced;
+
+	return SUCCESS;
+}
+
+/** State of renumber_blocks() scan. */
+typedef struct renumber {
+	vdi_bam_t *bam;
+	int fd;
+	uint32_t rank;      /**< New position of the next block. */
+} renumber_t;
+
+static int renumber_chunk(const vdi_bam_entry_t *entries, uint32_t first,
+                          uint32_t n, void *ctx)
+{
+	renumber_t *r = ctx;
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		if (!VDI_BLK_IS_ALLOCATED(entries[i]))
+			continue;
+		if (entries[i] != r->rank &&
+		    vdi_bam_set(r->bam, r->fd, first + i, r->rank) != SUCCESS)
+			return FAILURE;
+		r->rank++;
+	}
+
+	return SUCCESS;
+}
+
+/* Points allocated blocks to positions given by their order in BAM, i.e.
+ * where permute_blocks() has put them. */
+static int renumber_blocks(vdi_bam_t *bam, int fd)
+{
+	renumber_t r = { bam, fd, 0 };
+
+	if (vdi_bam_scan(bam, 0, bam->blk_count, renumber_chunk,
+	                 &r) != SUCCESS) {
+		ui->log("ERROR   Writing block allocation map failed.\n");
+		return FAILURE;
+	}
+
+	return SUCCESS;
+}
+
+static int move_block(vdi_start_t *vdi, int fin, int fout, void *buf,
+                      uint32_t from, uint32_t to)
+{
+	uint32_t ebs = ext_blk_size(vdi);
+	uint64_t data = vdi->header.offset.data;
+
+	if (io_pread(fin, buf, ebs, data + (uint64_t)from * ebs) != SUCCESS ||
+	    io_pwrite(fout, buf, ebs, data + (uint64_t)to * ebs) != SUCCESS) {
+		ui->log("ERROR   Moving block from position %u to %u failed.\n",
+		        from, to);
+		return FAILURE;
+	}
+	ui_add_step_bytes(ebs);
+
+	return SUCCESS;
+}
+
+/* Moves blocks in-place to positions given by plan_defrag(), following
+ * chains and cycles of the permutation, so every block is read and written
+ * once. Chains start at free positions and end at positions past live
+ * blocks, what remains are cycles, which need one block of scratch buffer.
+ * target keeps state of positions on the way: VDI_BLK_NONE marks free one
+ * and block already in place points to its own position. */
+static int permute_blocks(vdi_start_t *vdi, int fin, int fout,
+                          vdi_bam_array_t *target, vdi_bam_array_t *source,
+                          uint32_t live, uint32_t misplaced)
+{
+	int res = FAILURE;
+	uint32_t pos, cur, src, to;
+	uint32_t done = 0;
+	uint32_t ebs = ext_blk_size(vdi);
+	uint64_t data = vdi->header.offset.data;
+	uint64_t start, end;
+	char *buf = NULL, *scratch = NULL;
+
+	ui->next_step("Reordering blocks");
+
+	buf = io_buf_alloc(ebs);
+	scratch = io_buf_alloc(ebs);
+	if (!buf || !scratch) {
+		ui->log("ERROR   Cannot allocate reordering buffers.\n");
+		goto out;
+	}
+	ui->set_step_prog_max(max_u32(misplaced, 1));
+	start = gettimeofday_us();
+
+	/* Chains. */
+	for (pos = 0; pos < live; pos++) {
+		if (vdi_bam_array_get(target, pos, &to) != SUCCESS)
+			goto out;
+		if (to != VDI_BLK_NONE)
+			continue;
+		for (cur = pos; ; cur = src) {
+			if (vdi_bam_array_get(source, cur, &src) != SUCCESS ||
+			    move_block(vdi, fin, fout, buf, src, cur) != SUCCESS ||
+			    vdi_bam_array_set(target, cur, cur) != SUCCESS ||
+			    vdi_bam_array_set(target, src, VDI_BLK_NONE) != SUCCESS)
+				goto out;
+			ui->set_step_prog_val(++done);
+			if (src >= live)
+				break;
+		}
+	}
+
+	/* Cycles. */
+	for (pos = 0; pos < live; pos++) {
+		if (vdi_bam_array_get(target, pos, &to) != SUCCESS)
+			goto out;
+		if (to == pos || to == VDI_BLK_NONE)
+			continue;
+		if (io_pread(fin, scratch, ebs, data + (uint64_t)pos * ebs) != SUCCESS) {
+			ui->log("ERROR   Reading block at position %u failed.\n", pos);
+			goto out;
+		}
+		for (cur = pos; ; cur = src) {
+			if (vdi_bam_array_get(source, cur, &src) != SUCCESS)
+				goto out;
+			if (src == pos)
+				break;
+			if (move_block(vdi, fin, fout, buf, src, cur) != SUCCESS ||
+			    vdi_bam_array_set(target, cur, cur) != SUCCESS)
+				goto out;
+			ui->set_step_prog_val(++done);
+		}
+		if (io_pwrite(fout, scratch, ebs, data + (uint64_t)cur * ebs) != SUCCESS) {
+			ui->log("ERROR   Writing block at position %u failed.\n", cur);
+			goto out;
+		}
+		if (vdi_bam_array_set(target, cur, cur) != SUCCESS)
+			goto out;
+		ui->set_step_prog_val(++done);
+	}
+
+	if (!misplaced)
+		ui->set_step_prog_val(1);
+	if (sync_step(fout, 1) != SUCCESS)
+		goto out;
+	end = max_u64(gettimeofday_us(), start + 1);
+	ui->log(
+	        "Data reordered (%u blocks "
+	        "in %"PRIu64" ms = ~%"PRIu64" B/us)\n",
+	        misplaced,
+	        (end - start) / 1000,
+	        ((uint64_t)misplaced * (uint64_t)ebs) / (end - start)
+	       );
+	res = SUCCESS;
+
+out:
+	io_buf_free(scratch, ebs);
+	io_buf_free(buf, ebs);
+
+	return res;
+}
+
+/** State of copy_in_order(). */
+typedef struct order_copy {
+	mover_t m;
+	uint32_t rank;      /**< Position of the next block. */
+	uint32_t pos_count;
+} order_copy_t;
+
+static int copy_in_order_chunk(const vdi_bam_entry_t *entries, uint32_t first,
+                               uint32_t n, void *ctx)
+{
+	order_copy_t *oc = ctx;
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		if (!VDI_BLK_IS_ALLOCATED(entries[i]))
+			continue;
+		if (entries[i] >= oc->pos_count) {
+			ui->log("ERROR   Block allocation map is corrupted "
+			        "(block %u at position %u).\n", first + i, entries[i]);
+			return FAILURE;
+		}
+		if (mover_add(&oc->m, entries[i], oc->rank++, first + i) != SUCCESS)
+			return FAILURE;
+	}
+
+	return SUCCESS;
+}
+
+/* Copies allocated blocks into another file in BAM order, coalescing runs of
+ * blocks adjacent in both files. BAM is read in chunks, so it doesn't have
+ * to be kept in memory. */
+static int copy_in_order(vdi_start_t *vdi, vdi_bam_t *bam, int fin, int fout,
+                         uint32_t live)
+{
+	int res;
+	order_copy_t oc = { .pos_count = bam->pos_count };
+
+	ui->next_step("Copying blocks");
+	ui->set_step_prog_max(max_u32(live, 1));
+	if (mover_init(&oc.m, vdi, bam, fin, fout) != SUCCESS)
+		return FAILURE;
+	res = vdi_bam_scan(bam, 0, bam->blk_count, copy_in_order_chunk, &oc);
+	if (res == SUCCESS)
+		res = mover_finish(&oc.m, "copied");
+	mover_free(&oc.m);
+
+	return res;
+}
+
+static int defrag_confirmation(vdi_start_t *vdi, int same_file,
+                               uint32_t breaks, uint32_t live,
+                               uint32_t misplaced)
+{
+	uint64_t old_image_size = image_size(vdi, vdi->header.offset.data,
+	                                     vdi->header.disk.blk_count);
+	uint64_t new_image_size = vdi->header.offset.data +
+	                          image_data_size(vdi, live);
+
+	ui->log("\n");
+	print_fragmentation("before", breaks, live);
+	if (same_file)
+		ui->log("Blocks to be moved\n"
+		        "     %21u block(s)\n",
+		        misplaced);
+	ui->log("\nImage size will change\n"
+	        "from %21"PRIu64" bytes (%15"PRIu64" MB)\n"
+	        "to   %21"PRIu64" bytes (%15"PRIu64" MB)\n"
+	        "\n",
+	        old_image_size, old_image_size / _1MB,
+	        new_image_size, new_image_size / _1MB);
+
+	if (same_file) {
+		ui->log("Defragment operation will be performed in-place.\n");
+		ui->log("WARNING Blocks are swapped through memory and block\n"
+		        "        allocation map is updated at the end.\n"
+		        "        In case of fail DATA LOSS is highly POSSIBLE!\n"
+		        "        Think twice before continuing!\n");
+	} else {
+		ui->log("Defragment operation in fact will create defragmented copy"
+		        " of the image.\n");
+		ui->log("NOTE    UUID of the new image will be the same as old one.\n");
+		ui->log("NOTE    Input file is safe and won't be modified.\n");
+	}
+
+	return ui->yesno("Are you sure you want to continue?");
+}
+
+/* Places allocated blocks of dynamic image in BAM order, so sequential reads
+ * of the disk are sequential reads of the image. In-place blocks are
+ * permuted following source of each position. */
+static int defrag(vdi_start_t *vdi, vdi_bam_t *bam, int fin, int fout)
+{
+	int res = FAILURE;
+	int same_file = same_file_behind_fds(fin, fout) == SUCCESS;
+	uint32_t live, breaks;
+	uint32_t misplaced = 0;
+	uint32_t alloc = vdi->header.disk.blk_count_alloc;
+	vdi_bam_array_t target, source;
+	vdi_bam_rev_t it;
+
+	memset(&target, 0, sizeof(target));
+	memset(&source, 0, sizeof(source));
+	if (fragmentation(bam, &breaks, &live) != SUCCESS)
+		return FAILURE;
+
+	if (same_file) {
+		if (plan_defrag(bam, live, &target, &source,
+		                &misplaced) != SUCCESS)
+			goto out;
+		if (!misplaced && live == alloc) {
+			ui->log("\n");
+			print_fragmentation("", breaks, live);
+			ui->log("Image is not fragmented.\n");
+			res = SUCCESS;
+			goto out;
+		}
+	} else {
+		/* Sorting positions verifies that they are distinct. */
+		if (vdi_bam_rev_open(&it, bam, bam->blk_count) != SUCCESS)
+			return FAILURE;
+		res = count_moves(&it, NULL, 0, &live);
+		vdi_bam_rev_close(&it);
+		if (res != SUCCESS)
+			return FAILURE;
+		res = FAILURE;
+	}
+
+	if (defrag_confirmation(vdi, same_file, breaks, live,
+	                        misplaced) != SUCCESS) {
+		ui->log("Defragment aborted.\n");
+		goto out;
+	}
+
+	ui->start_op("Defragment", 4);
+	if (same_file) {
+		if (permute_blocks(vdi, fin, fout, &target, &source, live,
+		                   misplaced) != SUCCESS ||
+		    renumber_blocks(bam, fout) != SUCCESS)
+			goto fail;
+	} else if (vdi_bam_prepare(bam, fout, bam->blk_count) != SUCCESS) {
+		ui->log("ERROR   Writing block allocation map failed.\n");
+		goto fail;
+	} else if (copy_in_order(vdi, bam, fin, fout, live) != SUCCESS) {
+		goto fail;
+	}
+	if (finish_packing(vdi, bam, fout, live) != SUCCESS)
+		goto fail;
+	ui->log("\n");
+	/* Copy has blocks in BAM order by construction (and streamed BAM was
+	 * written through to another file). */
+	if (!same_file)
+		print_fragmentation("after", 0, live);
+	else if (fragmentation(bam, &breaks, NULL) == SUCCESS)
+		print_fragmentation("after", breaks, live);
+	res = SUCCESS;
+	goto out;
+
+fail:
+	ui->log("Defragment failed.\n");
+out:
+	vdi_bam_array_free(&source);
+	vdi_bam_array_free(&target);
+
+	return res;
+}
@@ -34,6 +34,10 @@
  * That's why vidma preserves BAM offset and enforces 1 megabyte alignment for
  * data offset, but only if movement of allocated blocks is unavoidable.
  * Forgive my waste.
+ *
+ * Growing dynamic image in-place doesn't shift all allocated blocks though.
+ * Only blocks occupying space needed by BAM are moved past the last block
+ * and their BAM entries are updated.
  */
 
 #ifndef VDI_H
@@ -0,0 +1,717 @@
+/*
+ * Copyright (C) 2013 Przemyslaw Pawelczyk <przemoc@gmail.com>
+ *
+ * This software is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ * See <http://www.gnu.org/licenses/gpl-2.0.txt>.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "io.h"
+#include "simd.h"
+#include "ui.h"
+#include "vdi_bam.h"
+
+/* ==== Defines and Macros ================================================== */
+
+/** Entries passed at once by vdi_bam_scan(). */
+#define SCAN_ENTRIES (IO_SCAN_CHUNK / VDI_BAM_ENTRY_SIZE)
+/** Minimal capacity of sort buffer (in entries). */
+#define MIN_SORT_ENTRIES 65536
+/** Minimal capacity of buffer of a run being merged (in entries). */
+#define MIN_RUN_ENTRIES 512
+
+/* ==== Exposed variables =================================================== */
+
+uint64_t vdi_bam_mem_limit = 0;
+
+/* ==== Non-exposed types ================================================== */
+
+/** State of vdi_bam_scan() reading streamed BAM. */
+typedef struct scan_ctx {
+	vdi_bam_scan_cb_t cb;
+	void *ctx;
+	uint32_t first;
+} scan_ctx_t;
+
+/* ==== Non-exposed functions definitions =================================== */
+
+static inline void reset_stats(vdi_bam_t *bam)
+{
+	bam->allocated = 0;
+	bam->zero = 0;
+	bam->last_no = 0;
+	bam->last_pos = 0;
+}
+
+/* Accumulates statistics of n entries starting with entry no. base. */
+static void gather_stats(vdi_bam_t *bam, const vdi_bam_entry_t *entries,
+                         uint32_t base, uint32_t n)
+{
+	map_stats_t st;
+
+	map_stats(entries, n, &st);
+	bam->zero += st.zero;
+	bam->allocated += n - st.unused - st.zero;
+	if (st.last)
+		bam->last_no = base + st.last - 1;
+	if (bam->last_pos < st.max)
+		bam->last_pos = st.max;
+}
+
+static int load_chunk(const void *buf, uint64_t off, size_t len, void *ctx)
+{
+	vdi_bam_t *bam = ctx;
+	uint32_t base = off / VDI_BAM_ENTRY_SIZE;
+
+	if (bam->v2p) {
+		memcpy(bam->v2p + base, buf, len);
+		buf = bam->v2p + base;
+	}
+	gather_stats(bam, buf, base, len / VDI_BAM_ENTRY_SIZE);
+
+	return SUCCESS;
+}
+
+static int scan_chunk(const void *buf, uint64_t off, size_t len, void *ctx)
+{
+	scan_ctx_t *sc = ctx;
+
+	return sc->cb(buf, sc->first + off / VDI_BAM_ENTRY_SIZE,
+	              len / VDI_BAM_ENTRY_SIZE, sc->ctx);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Sorts entries collected in sort buffer and writes them as a new run. */
+static int flush_run(vdi_bam_rev_t *it)
+{
+	vdi_bam_run_t *runs;
+	uint64_t off = 0;
+
+	qsort(it->sorted, it->len, sizeof(*it->sorted), cmp_u64);
+	if (!it->tmp) {
+		it->tmp = tmpfile();
+		if (!it->tmp) {
+			ui->log("ERROR   Cannot create temporary file.\n");
+			return FAILURE;
+		}
+	}
+	runs = realloc(it->runs, (it->run_count + 1) * sizeof(*runs));
+	if (!runs) {
+		ui->log("ERROR   Cannot allocate list of sorted runs.\n");
+		return FAILURE;
+	}
+	it->runs = runs;
+	if (it->run_count)
+		off = runs[it->run_count - 1].off + runs[it->run_count - 1].len;
+	if (io_pwrite(fileno(it->tmp), it->sorted, it->len * sizeof(*it->sorted),
+	              off * sizeof(*it->sorted)) != SUCCESS) {
+		ui->log("ERROR   Writing temporary file failed.\n");
+		return FAILURE;
+	}
+	memset(&runs[it->run_count], 0, sizeof(*runs));
+	runs[it->run_count].off = off;
+	runs[it->run_count].len = it->len;
+	it->run_count++;
+	it->len = 0;
+
+	return SUCCESS;
+}
+
+static int collect_chunk(const vdi_bam_entry_t *entries, uint32_t first,
+                         uint32_t n, void *ctx)
+{
+	vdi_bam_rev_t *it = ctx;
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		if (!VDI_BLK_IS_ALLOCATED(entries[i]))
+			continue;
+		if (it->len == it->cap && flush_run(it) != SUCCESS)
+			return FAILURE;
+		it->sorted[it->len++] = (uint64_t)entries[i] << 32 | (first + i);
+	}
+
+	return SUCCESS;
+}
+
+static int refill_run(vdi_bam_rev_t *it, vdi_bam_run_t *run)
+{
+	uint64_t n = min_u64(it->cap, run->len - run->read);
+
+	if (io_pread(fileno(it->tmp), run->buf, n * sizeof(*run->buf),
+	             (run->off + run->read) * sizeof(*run->buf)) != SUCCESS) {
+		ui->log("ERROR   Reading temporary file failed.\n");
+		return FAILURE;
+	}
+	run->read += n;
+	run->fill = n;
+	run->idx = 0;
+
+	return SUCCESS;
+}
+
+static inline uint64_t run_key(const vdi_bam_rev_t *it, uint32_t r)
+{
+	return it->runs[r].buf[it->runs[r].idx];
+}
+
+static void sift_down(vdi_bam_rev_t *it, uint32_t i)
+{
+	uint32_t c, tmp;
+
+	for (; (c = 2 * i + 1) < it->heap_len; i = c) {
+		if (c + 1 < it->heap_len &&
+		    run_key(it, it->heap[c + 1]) < run_key(it, it->heap[c]))
+			c++;
+		if (run_key(it, it->heap[i]) <= run_key(it, it->heap[c]))
+			break;
+		tmp = it->heap[i];
+		it->heap[i] = it->heap[c];
+		it->heap[c] = tmp;
+	}
+}
+
+/* Replaces sort buffer with buffers of runs to be merged. */
+static int setup_merge(vdi_bam_rev_t *it)
+{
+	uint32_t r;
+
+	if (it->len && flush_run(it) != SUCCESS)
+		return FAILURE;
+	free(it->sorted);
+	it->sorted = NULL;
+	it->cap = max_u64(it->cap / it->run_count, MIN_RUN_ENTRIES);
+	it->heap = malloc(it->run_count * sizeof(*it->heap));
+	if (!it->heap)
+		goto oom;
+	for (r = 0; r < it->run_count; r++) {
+		it->runs[r].buf = malloc(it->cap * sizeof(*it->runs[r].buf));
+		if (!it->runs[r].buf)
+			goto oom;
+	}
+
+	return SUCCESS;
+
+oom:
+	ui->log("ERROR   Cannot allocate merge buffers.\n");
+	return FAILURE;
+}
+
+static int corrupted(vdi_bam_rev_t *it, uint32_t pos, uint32_t blk)
+{
+	ui->log("ERROR   Block allocation map is corrupted "
+	        "(block %u at position %u).\n", blk, pos);
+	it->err = 1;
+
+	return FAILURE;
+}
+
+/* ==== Exposed functions definitions ======================================= */
+
+int vdi_bam_load(vdi_bam_t *bam, vdi_start_t *vdi, int fd)
+{
+	uint32_t blk_count = vdi->header.disk.blk_count;
+
+	memset(bam, 0, sizeof(*bam));
+	pthread_mutex_init(&bam->lock, NULL);
+	bam->blk_count = blk_count;
+	bam->pos_count = vdi->header.disk.blk_count_alloc;
+	bam->fd = fd;
+	bam->off = vdi->header.offset.bam;
+
+	if (!vdi_bam_mem_limit ||
+	    VDI_BAM_SIZE((uint64_t)blk_count + bam->pos_count)
+	    <= vdi_bam_mem_limit)
+		bam->v2p = malloc(VDI_BAM_SIZE((size_t)max_u32(blk_count, 1)));
+	if (!bam->v2p) {
+		ui->log("NOTE    Block allocation map is streamed from disk.\n");
+		bam->streamed = 1;
+	}
+	if (io_scan(fd, bam->off, VDI_BAM_SIZE((uint64_t)blk_count),
+	            load_chunk, bam) != SUCCESS) {
+		ui->log("ERROR   Reading block allocation map failed.\n");
+		vdi_bam_free(bam);
+		return FAILURE;
+	}
+
+	return SUCCESS;
+}
+
+int vdi_bam_index(vdi_bam_t *bam)
+{
+	uint32_t i, pos;
+
+	free(bam->p2v);
+	bam->p2v = malloc(VDI_BAM_SIZE((size_t)max_u32(bam->pos_count, 1)));
+	if (!bam->p2v) {
+		ui->log("ERROR   Cannot allocate reverse block allocation map.\n");
+		return FAILURE;
+	}
+	memset(bam->p2v, 0xff, VDI_BAM_SIZE((size_t)bam->pos_count));
+
+	for (i = 0; i < bam->blk_count; i++) {
+		pos = bam->v2p[i];
+		if (!VDI_BLK_IS_ALLOCATED(pos))
+			continue;
+		if (pos >= bam->pos_count || bam->p2v[pos] != VDI_BLK_NONE) {
+			ui->log("ERROR   Block allocation map is corrupted "
+			        "(block %u at position %u).\n", i, pos);
+			free(bam->p2v);
+			bam->p2v = NULL;
+			return FAILURE;
+		}
+		bam->p2v[pos] = i;
+	}
+
+	return SUCCESS;
+}
+
+int vdi_bam_scan(const vdi_bam_t *bam, uint32_t first, uint32_t count,
+                 vdi_bam_scan_cb_t cb, void *ctx)
+{
+	uint64_t i;
+	uint64_t end = (uint64_t)first + count;
+	uint32_t n;
+	scan_ctx_t sc = { cb, ctx, first };
+
+	if (bam->streamed)
+		return io_scan(bam->fd, bam->off + VDI_BAM_SIZE((uint64_t)first),
+		               VDI_BAM_SIZE((uint64_t)count), scan_chunk, &sc);
+
+	for (i = first; i < end; i += n) {
+		n = min_u64(SCAN_ENTRIES, end - i);
+		if (cb(bam->v2p + i, i, n, ctx) != SUCCESS)
+			return FAILURE;
+	}
+
+	return SUCCESS;
+}
+
+int vdi_bam_get(vdi_bam_t *bam, uint32_t blk, vdi_bam_entry_t *pos)
+{
+	uint32_t page = blk / VDI_BAM_PAGE_ENTRIES;
+	uint32_t slot = page % VDI_BAM_PAGES;
+	vdi_bam_entry_t *entries;
+	uint32_t first, n;
+	int res = SUCCESS;
+
+	if (!bam->streamed) {
+		*pos = bam->v2p[blk];
+		return SUCCESS;
+	}
+
+	pthread_mutex_lock(&bam->lock);
+	if (!bam->pages) {
+		bam->pages = malloc(VDI_BAM_SIZE((size_t)VDI_BAM_PAGES *
+		                                 VDI_BAM_PAGE_ENTRIES));
+		bam->page_no = malloc(VDI_BAM_PAGES * sizeof(*bam->page_no));
+		if (!bam->pages || !bam->page_no) {
+			free(bam->pages);
+			free(bam->page_no);
+			bam->pages = NULL;
+			bam->page_no = NULL;
+			pthread_mutex_unlock(&bam->lock);
+			/* Not caching then. */
+			return io_pread(bam->fd, pos, VDI_BAM_ENTRY_SIZE,
+			                bam->off + VDI_BAM_SIZE((uint64_t)blk));
+		}
+		memset(bam->page_no, 0xff, VDI_BAM_PAGES * sizeof(*bam->page_no));
+	}
+	entries = bam->pages + (size_t)slot * VDI_BAM_PAGE_ENTRIES;
+	if (bam->page_no[slot] != page) {
+		first = page * VDI_BAM_PAGE_ENTRIES;
+		n = min_u32(VDI_BAM_PAGE_ENTRIES, bam->blk_count - first);
+		res = io_pread(bam->fd, entries, VDI_BAM_SIZE((size_t)n),
+		               bam->off + VDI_BAM_SIZE((uint64_t)first));
+		bam->page_no[slot] = res == SUCCESS ? page : VDI_BLK_NONE;
+	}
+	if (res == SUCCESS)
+		*pos = entries[blk % VDI_BAM_PAGE_ENTRIES];
+	pthread_mutex_unlock(&bam->lock);
+
+	return res;
+}
+
+int vdi_bam_set(vdi_bam_t *bam, int fd, uint32_t blk, vdi_bam_entry_t pos)
+{
+	vdi_bam_entry_t old;
+	uint32_t page = blk / VDI_BAM_PAGE_ENTRIES;
+	uint32_t slot = page % VDI_BAM_PAGES;
+
+	if (bam->streamed) {
+		pthread_mutex_lock(&bam->lock);
+		if (fd == bam->fd && bam->pages && bam->page_no[slot] == page)
+			bam->pages[(size_t)slot * VDI_BAM_PAGE_ENTRIES +
+			           blk % VDI_BAM_PAGE_ENTRIES] = pos;
+		pthread_mutex_unlock(&bam->lock);
+		return io_pwrite(fd, &pos, VDI_BAM_ENTRY_SIZE,
+		                 bam->off + VDI_BAM_SIZE((uint64_t)blk));
+	}
+
+	old = bam->v2p[blk];
+	if (bam->p2v && VDI_BLK_IS_ALLOCATED(old) && old < bam->pos_count &&
+	    bam->p2v[old] == blk)
+		bam->p2v[old] = VDI_BLK_NONE;
+	if (bam->p2v && VDI_BLK_IS_ALLOCATED(pos) && pos < bam->pos_count)
+		bam->p2v[pos] = blk;
+	bam->v2p[blk] = pos;
+
+	return SUCCESS;
+}
+
+int vdi_bam_prepare(vdi_bam_t *bam, int fd, uint32_t count)
+{
+	if (!bam->streamed || same_file_behind_fds(bam->fd, fd) == SUCCESS)
+		return SUCCESS;
+
+	return io_copy(bam->fd, bam->off, fd, bam->off,
+	               VDI_BAM_SIZE((uint64_t)count), 0);
+}
+
+int vdi_bam_flush(vdi_bam_t *bam, int fd, uint32_t count)
+{
+	if (bam->streamed)
+		return SUCCESS;
+
+	return io_pwrite(fd, bam->v2p, VDI_BAM_SIZE((size_t)count), bam->off);
+}
+
+int vdi_bam_rev_open(vdi_bam_rev_t *it, vdi_bam_t *bam, uint32_t blk_limit)
+{
+	memset(it, 0, sizeof(*it));
+	it->bam = bam;
+	it->blk_limit = min_u32(blk_limit, bam->blk_count);
+
+	if (!bam->streamed)
+		return bam->p2v ? SUCCESS : vdi_bam_index(bam);
+
+	it->cap = max_u64(vdi_bam_mem_limit / sizeof(*it->sorted),
+	                  MIN_SORT_ENTRIES);
+	it->cap = min_u64(it->cap, max_u32(bam->allocated, 1));
+	it->sorted = malloc(it->cap * sizeof(*it->sorted));
+	if (!it->sorted) {
+		ui->log("ERROR   Cannot allocate sort buffer.\n");
+		return FAILURE;
+	}
+	if (vdi_bam_scan(bam, 0, it->blk_limit, collect_chunk, it) != SUCCESS ||
+	    (it->tmp && setup_merge(it) != SUCCESS)) {
+		ui->log("ERROR   Sorting block allocation map failed.\n");
+		vdi_bam_rev_close(it);
+		return FAILURE;
+	}
+	if (!it->tmp)
+		qsort(it->sorted, it->len, sizeof(*it->sorted), cmp_u64);
+
+	if (vdi_bam_rev_rewind(it) != SUCCESS) {
+		vdi_bam_rev_close(it);
+		return FAILURE;
+	}
+
+	return SUCCESS;
+}
+
+int vdi_bam_rev_next(vdi_bam_rev_t *it, uint32_t *pos, uint32_t *blk)
+{
+	uint64_t key;
+	uint32_t r;
+	vdi_bam_t *bam = it->bam;
+
+	if (it->err)
+		return FAILURE;
+
+	if (!bam->streamed) {
+		while (it->pos < bam->pos_count) {
+			*pos = it->pos++;
+			*blk = bam->p2v[*pos];
+			if (*blk != VDI_BLK_NONE && *blk < it->blk_limit)
+				return SUCCESS;
+		}
+		return FAILURE;
+	}
+
+	if (!it->tmp) {
+		if (it->idx >= it->len)
+			return FAILURE;
+		key = it->sorted[it->idx++];
+	} else {
+		if (!it->heap_len)
+			return FAILURE;
+		r = it->heap[0];
+		key = run_key(it, r);
+		if (++it->runs[r].idx == it->runs[r].fill) {
+			if (it->runs[r].read < it->runs[r].len) {
+				if (refill_run(it, &it->runs[r]) != SUCCESS) {
+					it->err = 1;
+					return FAILURE;
+				}
+			} else {
+				it->heap[0] = it->heap[--it->heap_len];
+			}
+		}
+		sift_down(it, 0);
+	}
+
+	*pos = key >> 32;
+	*blk = (uint32_t)key;
+	if (*pos >= bam->pos_count || (it->started && *pos == it->prev))
+		return corrupted(it, *pos, *blk);
+	it->prev = *pos;
+	it->started = 1;
+
+	return SUCCESS;
+}
+
+int vdi_bam_rev_rewind(vdi_bam_rev_t *it)
+{
+	uint32_t r;
+
+	it->pos = 0;
+	it->idx = 0;
+	it->started = 0;
+	it->err = 0;
+	it->heap_len = 0;
+	for (r = 0; r < it->run_count; r++) {
+		it->runs[r].read = 0;
+		if (refill_run(it, &it->runs[r]) != SUCCESS)
+			return FAILURE;
+		it->heap[it->heap_len++] = r;
+	}
+	for (r = it->heap_len / 2; r-- > 0; )
+		sift_down(it, r);
+
+	return SUCCESS;
+}
+
+void vdi_bam_rev_close(vdi_bam_rev_t *it)
+{
+	uint32_t r;
+
+	for (r = 0; r < it->run_count; r++)
+		free(it->runs[r].buf);
+	free(it->runs);
+	free(it->heap);
+	free(it->sorted);
+	if (it->tmp)
+		fclose(it->tmp);
+	memset(it, 0, sizeof(*it));
+}
+
+int vdi_bam_list_init(vdi_bam_list_t *list, const vdi_bam_t *bam)
+{
+	memset(list, 0, sizeof(*list));
+	if (!bam->streamed)
+		return SUCCESS;
+	list->tmp = tmpfile();
+	if (!list->tmp) {
+		ui->log("ERROR   Cannot create temporary file.\n");
+		return FAILURE;
+	}
+
+	return SUCCESS;
+}
+
+int vdi_bam_list_push(vdi_bam_list_t *list, uint32_t val)
+{
+	uint32_t *buf;
+
+	if (list->tmp)
+		return fwrite(&val, sizeof(val), 1, list->tmp) == 1
+		       ? SUCCESS : FAILURE;
+
+	if (list->len == list->cap) {
+		buf = realloc(list->buf, max_u64(2 * list->cap, 1024) * sizeof(val));
+		if (!buf)
+			return FAILURE;
+		list->buf = buf;
+		list->cap = max_u64(2 * list->cap, 1024);
+	}
+	list->buf[list->len++] = val;
+
+	return SUCCESS;
+}
+
+void vdi_bam_list_rewind(vdi_bam_list_t *list)
+{
+	if (list->tmp)
+		rewind(list->tmp);
+	list->idx = 0;
+}
+
+int vdi_bam_list_pop(vdi_bam_list_t *list, uint32_t *val)
+{
+	if (list->tmp)
+		return fread(val, sizeof(*val), 1, list->tmp) == 1
+		       ? SUCCESS : FAILURE;
+	if (list->idx >= list->len)
+		return FAILURE;
+	*val = list->buf[list->idx++];
+
+	return SUCCESS;
+}
+
+void vdi_bam_list_free(vdi_bam_list_t *list)
+{
+	free(list->buf);
+	if (list->tmp)
+		fclose(list->tmp);
+	memset(list, 0, sizeof(*list));
+}
+
+/* Entries are kept in temporary file inverted, so parts never written (and
+ * read as zeros) are VDI_BLK_NONE. */
+static void invert_page(vdi_bam_entry_t *entries)
+{
+	uint32_t i;
+
+	for (i = 0; i < VDI_BAM_PAGE_ENTRIES; i++)
+		entries[i] = ~entries[i];
+}
+
+/* Gets entry idx of array kept in temporary file, caching its page (and
+ * writing back the page evicted from the cache). */
+static int array_entry(vdi_bam_array_t *arr, uint32_t idx,
+                       vdi_bam_entry_t **entry)
+{
+	uint32_t page = idx / VDI_BAM_PAGE_ENTRIES;
+	uint32_t slot = page % VDI_BAM_PAGES;
+	size_t size = VDI_BAM_SIZE((size_t)VDI_BAM_PAGE_ENTRIES);
+	vdi_bam_entry_t *entries = arr->buf + (size_t)slot * VDI_BAM_PAGE_ENTRIES;
+
+	if (arr->page_no[slot] != page) {
+		if (arr->dirty[slot]) {
+			invert_page(entries);
+			if (io_pwrite(fileno(arr->tmp), entries, size,
+			              (uint64_t)arr->page_no[slot] * size) != SUCCESS) {
+				ui->log("ERROR   Writing temporary file failed.\n");
+				return FAILURE;
+			}
+			arr->dirty[slot] = 0;
+		}
+		arr->page_no[slot] = VDI_BLK_NONE;
+		if (io_pread(fileno(arr->tmp), entries, size,
+		             (uint64_t)page * size) != SUCCESS) {
+			ui->log("ERROR   Reading temporary file failed.\n");
+			return FAILURE;
+		}
+		invert_page(entries);
+		arr->page_no[slot] = page;
+	}
+	*entry = entries + idx % VDI_BAM_PAGE_ENTRIES;
+
+	return SUCCESS;
+}
+
+int vdi_bam_array_init(vdi_bam_array_t *arr, const vdi_bam_t *bam,
+                       uint32_t len)
+{
+	uint64_t pages = ((uint64_t)len + VDI_BAM_PAGE_ENTRIES - 1) /
+	                 VDI_BAM_PAGE_ENTRIES;
+
+	memset(arr, 0, sizeof(*arr));
+	arr->len = len;
+	if (!bam->streamed) {
+		arr->buf = malloc(VDI_BAM_SIZE((size_t)max_u32(len, 1)));
+		if (!arr->buf) {
+			ui->log("ERROR   Cannot allocate %"PRIu64" MB of memory.\n",
+			        (VDI_BAM_SIZE((uint64_t)len) + _1MB - 1) / _1MB);
+			return FAILURE;
+		}
+		memset(arr->buf, 0xff, VDI_BAM_SIZE((size_t)len));
+		return SUCCESS;
+	}
+
+	arr->buf = malloc(VDI_BAM_SIZE((size_t)VDI_BAM_PAGES *
+	                               VDI_BAM_PAGE_ENTRIES));
+	arr->page_no = malloc(VDI_BAM_PAGES * sizeof(*arr->page_no));
+	arr->dirty = calloc(VDI_BAM_PAGES, sizeof(*arr->dirty));
+	if (!arr->buf || !arr->page_no || !arr->dirty) {
+		ui->log("ERROR   Cannot allocate cache of temporary file.\n");
+		vdi_bam_array_free(arr);
+		return FAILURE;
+	}
+	memset(arr->page_no, 0xff, VDI_BAM_PAGES * sizeof(*arr->page_no));
+	arr->tmp = tmpfile();
+	if (!arr->tmp ||
+	    ftruncate(fileno(arr->tmp),
+	              pages * VDI_BAM_SIZE((uint64_t)VDI_BAM_PAGE_ENTRIES))) {
+		ui->log("ERROR   Cannot create temporary file.\n");
+		vdi_bam_array_free(arr);
+		return FAILURE;
+	}
+
+	return SUCCESS;
+}
+
+int vdi_bam_array_get(vdi_bam_array_t *arr, uint32_t idx,
+                      vdi_bam_entry_t *val)
+{
+	vdi_bam_entry_t *entry;
+
+	if (!arr->tmp) {
+		*val = arr->buf[idx];
+		return SUCCESS;
+	}
+	if (array_entry(arr, idx, &entry) != SUCCESS)
+		return FAILURE;
+	*val = *entry;
+
+	return SUCCESS;
+}
+
+int vdi_bam_array_set(vdi_bam_array_t *arr, uint32_t idx,
+                      vdi_bam_entry_t val)
+{
+	vdi_bam_entry_t *entry;
+
+	if (!arr->tmp) {
+		arr->buf[idx] = val;
+		return SUCCESS;
+	}
+	if (array_entry(arr, idx, &entry) != SUCCESS)
+		return FAILURE;
+	*entry = val;
+	arr->dirty[(idx / VDI_BAM_PAGE_ENTRIES) % VDI_BAM_PAGES] = 1;
+
+	return SUCCESS;
+}
+
+void vdi_bam_array_free(vdi_bam_array_t *arr)
+{
+	free(arr->buf);
+	free(arr->page_no);
+	free(arr->dirty);
+	if (arr->tmp)
+		fclose(arr->tmp);
+	memset(arr, 0, sizeof(*arr));
+}
+
+void vdi_bam_free(vdi_bam_t *bam)
+{
+	free(bam->p2v);
+	free(bam->v2p);
+	free(bam->pages);
+	free(bam->page_no);
+	bam->p2v = NULL;
+	bam->v2p = NULL;
+	bam->pages = NULL;
+	bam->page_no = NULL;
+	pthread_mutex_destroy(&bam->lock);
+}
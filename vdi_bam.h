@@ -0,0 +1,269 @@
+/*
+ * Copyright (C) 2013 Przemyslaw Pawelczyk <przemoc@gmail.com>
+ *
+ * This software is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ * See <http://www.gnu.org/licenses/gpl-2.0.txt>.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/** \file vdi_bam.h
+ * VDI block allocation map.
+ *
+ * BAM is read once per operation and then shared by everything that needs
+ * it, so neither analysis nor relocation has to scan it on disk again.
+ * Statistics are gathered while loading. Reverse map (positions to blocks)
+ * is built only on demand, as it's needed only when blocks are rearranged.
+ *
+ * If BAM together with its reverse map doesn't fit in \a vdi_bam_mem_limit,
+ * then it's streamed: entries stay on disk and are read in chunks whenever
+ * they're needed, updates are written through and reverse map is produced
+ * by external sort, i.e. sorted runs kept in temporary file are merged.
+ * Lookups of single entries in streamed BAM go through small cache of its
+ * pages, so reading guest data doesn't hit the disk for every block.
+ */
+
+#ifndef VDI_BAM_H
+#define VDI_BAM_H
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include "common.h"
+#include "vdi.h"
+
+/** Checks whether BAM entry points to allocated block. */
+#define VDI_BLK_IS_ALLOCATED(entry) ((entry) < VDI_BLK_ZERO)
+
+/** Entries in cached page of streamed BAM. */
+#define VDI_BAM_PAGE_ENTRIES 1024
+/** Cached pages of streamed BAM. */
+#define VDI_BAM_PAGES 64
+
+/** Memory (in bytes) BAM may take, 0 means no limit. */
+extern uint64_t vdi_bam_mem_limit;
+
+/** BAM of an image. */
+typedef struct vdi_bam {
+	vdi_bam_entry_t *v2p;   /**< Positions of blocks (BAM entries),
+	                             NULL if streamed. */
+	vdi_bam_entry_t *p2v;   /**< Blocks at positions (VDI_BLK_NONE if free),
+	                             NULL until vdi_bam_index() is called. */
+	uint32_t blk_count;     /**< Number of blocks (entries). */
+	uint32_t pos_count;     /**< Number of positions (allocated blocks). */
+	uint32_t allocated;     /**< Entries pointing to allocated blocks. */
+	uint32_t zero;          /**< Entries of unallocated blocks of zeros. */
+	uint32_t last_no;       /**< Last entry other than unallocated one. */
+	uint32_t last_pos;      /**< Highest position of allocated block. */
+	int streamed;           /**< Whether entries are kept on disk only. */
+	int fd;                 /**< File BAM was read from. */
+	uint64_t off;           /**< Offset of BAM in file. */
+	vdi_bam_entry_t *pages; /**< Cached pages of streamed BAM,
+	                             NULL until vdi_bam_get() needs them. */
+	uint32_t *page_no;      /**< Numbers of cached pages. */
+	pthread_mutex_t lock;   /**< Guards cached pages. */
+} vdi_bam_t;
+
+/** Callback receiving consecutive chunks of entries from vdi_bam_scan().
+ *
+ * \param entries entries
+ * \param first number of the first entry
+ * \param n number of entries
+ * \param ctx context given to vdi_bam_scan()
+ * \return \a SUCCESS to continue or \a FAILURE to stop scanning
+ */
+typedef int (*vdi_bam_scan_cb_t)(const vdi_bam_entry_t *entries,
+                                 uint32_t first, uint32_t n, void *ctx);
+
+/** Sorted run of reverse map entries in temporary file. */
+typedef struct vdi_bam_run {
+	uint64_t off;           /**< Offset of the run (in entries). */
+	uint64_t len;           /**< Number of entries in the run. */
+	uint64_t read;          /**< Entries already read into buffer. */
+	uint64_t *buf;          /**< Buffer for entries being merged. */
+	uint32_t idx;           /**< Next entry in buffer. */
+	uint32_t fill;          /**< Entries in buffer. */
+} vdi_bam_run_t;
+
+/** Iterator over allocated blocks in order of their positions. */
+typedef struct vdi_bam_rev {
+	vdi_bam_t *bam;
+	uint32_t blk_limit;     /**< Blocks from this one on are skipped. */
+	uint32_t pos;           /**< Next position (if not streamed). */
+	uint32_t prev;          /**< Previously returned position. */
+	int started;            /**< Whether anything was returned. */
+	int err;                /**< Whether iteration stopped on error. */
+	uint64_t *sorted;       /**< Sort buffer, keys are position << 32 | block. */
+	uint64_t cap;           /**< Capacity of sort buffer. */
+	uint64_t len;           /**< Entries in sort buffer. */
+	uint64_t idx;           /**< Next entry (if there are no runs). */
+	FILE *tmp;              /**< Temporary file keeping runs. */
+	vdi_bam_run_t *runs;    /**< Runs being merged. */
+	uint32_t run_count;
+	uint32_t *heap;         /**< Runs ordered by their next entry. */
+	uint32_t heap_len;
+} vdi_bam_rev_t;
+
+/** List of values read back in order of appending, kept in memory or in
+ * temporary file (if BAM is streamed). */
+typedef struct vdi_bam_list {
+	uint32_t *buf;
+	size_t len, cap, idx;
+	FILE *tmp;
+} vdi_bam_list_t;
+
+/** Array of entries indexed by block or position, kept in memory or in
+ * temporary file behind small cache of its pages (if BAM is streamed). */
+typedef struct vdi_bam_array {
+	vdi_bam_entry_t *buf;   /**< Entries or cached pages. */
+	uint32_t *page_no;      /**< Numbers of cached pages. */
+	uint8_t *dirty;         /**< Whether cached pages need writing back. */
+	uint32_t len;
+	FILE *tmp;
+} vdi_bam_array_t;
+
+/** Reads BAM of \p vdi from \p fd and gathers its statistics.
+ *
+ * BAM is streamed if it (with reverse map) exceeds \a vdi_bam_mem_limit.
+ *
+ * \return \a SUCCESS or \a FAILURE
+ */
+int vdi_bam_load(vdi_bam_t *bam, vdi_start_t *vdi, int fd);
+
+/** Builds reverse map of BAM kept in memory, verifying that every allocated
+ * block has distinct position below \a pos_count.
+ *
+ * \return \a SUCCESS or \a FAILURE (if BAM is corrupted or memory is short)
+ */
+int vdi_bam_index(vdi_bam_t *bam);
+
+/** Passes \p count entries starting with \p first to \p cb in chunks.
+ *
+ * \return \a SUCCESS or \a FAILURE (read error or callback failure)
+ */
+int vdi_bam_scan(const vdi_bam_t *bam, uint32_t first, uint32_t count,
+                 vdi_bam_scan_cb_t cb, void *ctx);
+
+/** Sets position of block \p blk. Streamed BAM is updated directly in \p fd,
+ * otherwise only in memory (see vdi_bam_flush()).
+ *
+ * \return \a SUCCESS or \a FAILURE
+ */
+int vdi_bam_set(vdi_bam_t *bam, int fd, uint32_t blk, vdi_bam_entry_t pos);
+
+/** Gets position of block \p blk (or VDI_BLK_NONE/VDI_BLK_ZERO) into
+ * \p pos. Unlike vdi_bam_lookup() it works for streamed BAM too and it may
+ * be called by many threads at once.
+ *
+ * \return \a SUCCESS or \a FAILURE (read error)
+ */
+int vdi_bam_get(vdi_bam_t *bam, uint32_t blk, vdi_bam_entry_t *pos);
+
+/** Prepares first \p count entries in \p fd for updates by vdi_bam_set(),
+ * i.e. copies streamed BAM there, if \p fd is another file.
+ *
+ * \return \a SUCCESS or \a FAILURE
+ */
+int vdi_bam_prepare(vdi_bam_t *bam, int fd, uint32_t count);
+
+/** Writes first \p count entries kept in memory to \p fd (nothing to do if
+ * BAM is streamed).
+ *
+ * \return \a SUCCESS or \a FAILURE
+ */
+int vdi_bam_flush(vdi_bam_t *bam, int fd, uint32_t count);
+
+/** Starts iteration over allocated blocks below \p blk_limit in order of
+ * their positions, verifying on the way that positions are distinct and
+ * below \a pos_count. Streamed BAM is sorted at this point.
+ *
+ * \return \a SUCCESS or \a FAILURE
+ */
+int vdi_bam_rev_open(vdi_bam_rev_t *it, vdi_bam_t *bam, uint32_t blk_limit);
+
+/** Gets next block and its position.
+ *
+ * \return \a SUCCESS or \a FAILURE (at the end or on error, see \a err)
+ */
+int vdi_bam_rev_next(vdi_bam_rev_t *it, uint32_t *pos, uint32_t *blk);
+
+/** Restarts iteration (without sorting again).
+ *
+ * \return \a SUCCESS or \a FAILURE
+ */
+int vdi_bam_rev_rewind(vdi_bam_rev_t *it);
+
+/** Frees resources held by iterator. */
+void vdi_bam_rev_close(vdi_bam_rev_t *it);
+
+/** Initializes empty list, kept in temporary file if \p bam is streamed.
+ *
+ * \return \a SUCCESS or \a FAILURE
+ */
+int vdi_bam_list_init(vdi_bam_list_t *list, const vdi_bam_t *bam);
+
+/** Appends \p val to list.
+ *
+ * \return \a SUCCESS or \a FAILURE
+ */
+int vdi_bam_list_push(vdi_bam_list_t *list, uint32_t val);
+
+/** Starts reading list from its beginning. */
+void vdi_bam_list_rewind(vdi_bam_list_t *list);
+
+/** Reads next value from list.
+ *
+ * \return \a SUCCESS or \a FAILURE (at the end)
+ */
+int vdi_bam_list_pop(vdi_bam_list_t *list, uint32_t *val);
+
+/** Frees resources held by list. */
+void vdi_bam_list_free(vdi_bam_list_t *list);
+
+/** Initializes array of \p len entries set to VDI_BLK_NONE, kept in
+ * temporary file if \p bam is streamed.
+ *
+ * \return \a SUCCESS or \a FAILURE
+ */
+int vdi_bam_array_init(vdi_bam_array_t *arr, const vdi_bam_t *bam,
+                       uint32_t len);
+
+/** Gets entry \p idx of array into \p val.
+ *
+ * \return \a SUCCESS or \a FAILURE (temporary file error)
+ */
+int vdi_bam_array_get(vdi_bam_array_t *arr, uint32_t idx,
+                      vdi_bam_entry_t *val);
+
+/** Sets entry \p idx of array to \p val.
+ *
+ * \return \a SUCCESS or \a FAILURE (temporary file error)
+ */
+int vdi_bam_array_set(vdi_bam_array_t *arr, uint32_t idx,
+                      vdi_bam_entry_t val);
+
+/** Frees resources held by array. */
+void vdi_bam_array_free(vdi_bam_array_t *arr);
+
+/** Frees memory held by \p bam. */
+void vdi_bam_free(vdi_bam_t *bam);
+
+/** Returns position of block \p blk or VDI_BLK_NONE/VDI_BLK_ZERO
+ * (BAM cannot be streamed). */
+static inline vdi_bam_entry_t vdi_bam_lookup(const vdi_bam_t *bam,
+                                             uint32_t blk)
+{
+	return bam->v2p[blk];
+}
+
+/** Returns block at position \p pos or VDI_BLK_NONE (requires index). */
+static inline uint32_t vdi_bam_block_at(const vdi_bam_t *bam, uint32_t pos)
+{
+	return bam->p2v[pos];
+}
+
+#endif /* VDI_BAM_H */
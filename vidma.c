@@ -0,0 +1,462 @@
+/*
+ * Copyright (C) 2013 Przemyslaw Pawelczyk <przemoc@gmail.com>
+ *
+ * This software is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ * See <http://www.gnu.org/licenses/gpl-2.0.txt>.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "io.h"
+#include "ui.h"
+#include "vd.h"
+#include "vdi.h"
+#include "vdi_bam.h"
+#include "vidma.h"
+
+/* ==== Defines and Macros ================================================== */
+
+/** Longest line passed to log callback (longer ones are split). */
+#define LINE_SIZE 1024
+
+/** Opened image. UI operations are first, so when they are called through
+ * \a ui pointing at them, they find their image. */
+struct vidma_image {
+	ui_ops_t ops;
+	vidma_callbacks_t cb;
+	vd_type_t *type;
+	vd_t vd;
+	char *path;
+	const char *op;     /**< Title of current operation. */
+	int steps;
+	int step;
+	uint64_t max;       /**< Highest progress value of current step. */
+	char line[LINE_SIZE];
+	size_t line_len;    /**< Length of line waiting for newline. */
+};
+
+struct vidma_task {
+	pthread_t thread;
+	vidma_image_t *img;
+	int op;
+	uint32_t new_msize;
+	char *output;
+	int result;
+	int done;
+};
+
+static vd_type_t *types[] = {
+	&vd_vdi,
+	NULL
+};
+
+/** Durability levels of I/O engine by \a vidma_durability. */
+static const int durabilities[] = {
+	[VIDMA_DURABILITY_NONE]    = IO_DURABILITY_NONE,
+	[VIDMA_DURABILITY_ORDERED] = IO_DURABILITY_ORDERED,
+	[VIDMA_DURABILITY_FULL]    = IO_DURABILITY_FULL,
+};
+
+/* ==== Exposed functions prototypes ======================================== */
+
+static int lib_log(const char *format, ...);
+static int lib_yesno(const char *format, ...);
+static int lib_start_op(const char *title, int steps_no);
+static int lib_end_op();
+static int lib_next_step(const char *name);
+static int lib_set_step_prog_max(uint64_t max);
+static int lib_set_step_prog_val(uint64_t val);
+
+static const ui_ops_t ui_lib = {
+	.log               = lib_log,
+	.yesno             = lib_yesno,
+	.start_op          = lib_start_op,
+	.end_op            = lib_end_op,
+	.next_step         = lib_next_step,
+	.set_step_prog_max = lib_set_step_prog_max,
+	.set_step_prog_val = lib_set_step_prog_val,
+};
+
+/* ==== Non-exposed functions definitions =================================== */
+
+/* Returns image, on behalf of which current thread works. */
+static inline vidma_image_t *current()
+{
+	return (vidma_image_t *)ui;
+}
+
+static void flush_line(vidma_image_t *img)
+{
+	if (!img->line_len)
+		return;
+	img->line[img->line_len] = '\0';
+	if (img->cb.log)
+		img->cb.log(img->cb.ctx, img->line);
+	img->line_len = 0;
+}
+
+/* Passes complete lines of \p text to log callback. */
+static void add_text(vidma_image_t *img, const char *text)
+{
+	for (; *text; text++) {
+		if (*text == '\n' || img->line_len == LINE_SIZE - 1) {
+			flush_line(img);
+			if (*text == '\n')
+				continue;
+		}
+		img->line[img->line_len++] = *text;
+	}
+}
+
+/* Lets aligned I/O of fd bypass page cache (called with UI operations of
+ * image). */
+static void open_direct(int fd, const char *path)
+{
+	if (io_open_direct(fd, path) != SUCCESS)
+		ui->log("NOTE    Page cache cannot be bypassed for %s, data will be"
+		        " dropped from it instead.\n", path);
+}
+
+/* Runs \p op on \p img with UI operations of the image. */
+static int run(vidma_image_t *img, int op, uint32_t new_msize,
+               const char *output)
+{
+	ui_ops_t *prev = ui;
+	vd_ops_t *ops = &img->type->ops;
+	int fout, res = FAILURE;
+
+	ui = &img->ops;
+	fout = open(output ? output : img->path, O_CREAT | O_WRONLY | O_BINARY,
+	            S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH);
+	if (fout < 0) {
+		ui->log("ERROR   Cannot open %s: %s\n", output ? output : img->path,
+		        strerror(errno));
+	} else {
+		if (io_opts.direct)
+			open_direct(fout, output ? output : img->path);
+		if (op == VIDMA_RESIZE)
+			res = ops->resize_vd(&img->vd, fout, new_msize);
+		else if (op == VIDMA_COMPACT && ops->compact_vd)
+			res = ops->compact_vd(&img->vd, fout);
+		else if (op == VIDMA_DEFRAG && ops->defrag_vd)
+			res = ops->defrag_vd(&img->vd, fout);
+		else
+			ui->log("ERROR   Operation is not supported for this format.\n");
+		io_close_direct_of(fout);
+		close(fout);
+	}
+	flush_line(img);
+	ui = prev;
+
+	return res;
+}
+
+static void *task_run(void *arg)
+{
+	vidma_task_t *task = arg;
+
+	task->result = run(task->img, task->op, task->new_msize, task->output);
+	__atomic_store_n(&task->done, 1, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+/* ==== Exposed functions definitions ======================================= */
+
+static int lib_log(const char *format, ...)
+{
+	va_list ap;
+	char buf[4096];
+	int ret;
+
+	va_start(ap, format);
+	ret = vsnprintf(buf, sizeof(buf), format, ap);
+	va_end(ap);
+	add_text(current(), buf);
+
+	return ret;
+}
+
+static int lib_yesno(const char *format, ...)
+{
+	vidma_image_t *img = current();
+	va_list ap;
+	char buf[4096];
+
+	va_start(ap, format);
+	vsnprintf(buf, sizeof(buf), format, ap);
+	va_end(ap);
+	flush_line(img);
+
+	if (!img->cb.confirm)
+		return SUCCESS;
+
+	return img->cb.confirm(img->cb.ctx, buf) ? SUCCESS : FAILURE;
+}
+
+static int lib_start_op(const char *title, int steps_no)
+{
+	vidma_image_t *img = current();
+
+	img->op = title;
+	img->steps = steps_no;
+	img->step = 0;
+
+	return 0;
+}
+
+static int lib_end_op()
+{
+	vidma_image_t *img = current();
+
+	flush_line(img);
+	img->op = NULL;
+	img->steps = 0;
+	img->step = 0;
+
+	return 0;
+}
+
+static int lib_next_step(const char *name)
+{
+	vidma_image_t *img = current();
+
+	flush_line(img);
+	img->step++;
+	img->max = 1;
+	if (img->cb.step)
+		img->cb.step(img->cb.ctx, img->op, img->step, img->steps, name);
+
+	return 0;
+}
+
+static int lib_set_step_prog_max(uint64_t max)
+{
+	current()->max = max;
+
+	return 0;
+}
+
+static int lib_set_step_prog_val(uint64_t val)
+{
+	vidma_image_t *img = current();
+
+	if (img->cb.progress)
+		img->cb.progress(img->cb.ctx, val, img->max);
+
+	return 0;
+}
+
+int vidma_set_option(int opt, uint64_t val)
+{
+	switch (opt) {
+	case VIDMA_OPT_DURABILITY:
+		if (val > VIDMA_DURABILITY_FULL)
+			return VIDMA_FAILURE;
+		io_opts.durability = durabilities[val];
+		break;
+	case VIDMA_OPT_THREADS:
+		if (!val || val > IO_MAX_THREADS)
+			return VIDMA_FAILURE;
+		io_opts.threads = val;
+		break;
+	case VIDMA_OPT_DIRECT:
+		io_opts.direct = !!val;
+		break;
+	case VIDMA_OPT_BANDWIDTH:
+		io_opts.bandwidth = val;
+		break;
+	case VIDMA_OPT_MEMORY:
+		vdi_bam_mem_limit = val;
+		break;
+	default:
+		return VIDMA_FAILURE;
+	}
+
+	return VIDMA_SUCCESS;
+}
+
+vidma_image_t *vidma_open(const char *path, const vidma_callbacks_t *cb)
+{
+	vidma_image_t *img = calloc(1, sizeof(*img));
+	ui_ops_t *prev = ui;
+	vd_type_t **type;
+
+	if (!img)
+		return NULL;
+	img->ops = ui_lib;
+	if (cb)
+		img->cb = *cb;
+	img->path = strdup(path);
+	img->vd.fd = open(path, O_RDWR | O_BINARY);
+	if (img->vd.fd < 0 && (errno == EACCES || errno == EROFS))
+		img->vd.fd = open(path, O_RDONLY | O_BINARY);
+	if (!img->path || img->vd.fd < 0) {
+		if (img->vd.fd >= 0)
+			close(img->vd.fd);
+		free(img->path);
+		free(img);
+		return NULL;
+	}
+
+	ui = &img->ops;
+	for (type = types; *type; type++)
+		if ((*type)->ops.detect(img->vd.fd) == SUCCESS)
+			break;
+	if (!*type || !(*type)->ops.open) {
+		ui->log("ERROR   Unrecognized file format.\n");
+	} else if ((*type)->ops.open(&img->vd) == SUCCESS) {
+		img->type = *type;
+		if (io_opts.direct)
+			open_direct(img->vd.fd, path);
+	}
+	flush_line(img);
+	ui = prev;
+
+	if (!img->type) {
+		close(img->vd.fd);
+		free(img->path);
+		free(img);
+		return NULL;
+	}
+
+	return img;
+}
+
+void vidma_close(vidma_image_t *img)
+{
+	if (!img)
+		return;
+	img->type->ops.close(&img->vd);
+	io_close_direct_of(img->vd.fd);
+	close(img->vd.fd);
+	free(img->path);
+	free(img);
+}
+
+int vidma_info(vidma_image_t *img, vidma_info_t *info)
+{
+	ui_ops_t *prev = ui;
+	vd_info_t vi;
+	int res;
+
+	ui = &img->ops;
+	res = img->type->ops.get_info(&img->vd, &vi);
+	flush_line(img);
+	ui = prev;
+	if (res != SUCCESS)
+		return VIDMA_FAILURE;
+
+	info->format = img->type->name;
+	info->variant = vi.variant;
+	info->disk_size = vi.disk_size;
+	info->data_offset = vi.data_offset;
+	info->blk_size = vi.blk_size;
+	info->blk_extra = vi.blk_extra;
+	info->blk_count = vi.blk_count;
+	info->blk_alloc = vi.blk_alloc;
+	info->blk_zero = vi.blk_zero;
+
+	return VIDMA_SUCCESS;
+}
+
+int vidma_resize(vidma_image_t *img, uint32_t new_msize, const char *output)
+{
+	return run(img, VIDMA_RESIZE, new_msize, output);
+}
+
+int vidma_compact(vidma_image_t *img, const char *output)
+{
+	return run(img, VIDMA_COMPACT, 0, output);
+}
+
+int vidma_defrag(vidma_image_t *img, const char *output)
+{
+	return run(img, VIDMA_DEFRAG, 0, output);
+}
+
+int vidma_read(vidma_image_t *img, void *buf, size_t len, uint64_t off)
+{
+	ui_ops_t *prev = ui;
+	int res = FAILURE;
+
+	ui = &img->ops;
+	if (img->type->ops.read_at)
+		res = img->type->ops.read_at(&img->vd, buf, len, off);
+	else
+		ui->log("ERROR   Operation is not supported for this format.\n");
+	flush_line(img);
+	ui = prev;
+
+	return res;
+}
+
+int vidma_write(vidma_image_t *img, const void *buf, size_t len,
+                uint64_t off)
+{
+	ui_ops_t *prev = ui;
+	int res = FAILURE;
+
+	ui = &img->ops;
+	if (img->type->ops.write_at)
+		res = img->type->ops.write_at(&img->vd, buf, len, off);
+	else
+		ui->log("ERROR   Operation is not supported for this format.\n");
+	flush_line(img);
+	ui = prev;
+
+	return res;
+}
+
+vidma_task_t *vidma_start(vidma_image_t *img, int op, uint32_t new_msize,
+                          const char *output)
+{
+	vidma_task_t *task = calloc(1, sizeof(*task));
+
+	if (!task)
+		return NULL;
+	task->img = img;
+	task->op = op;
+	task->new_msize = new_msize;
+	task->output = output ? strdup(output) : NULL;
+	if ((output && !task->output) ||
+	    pthread_create(&task->thread, NULL, task_run, task)) {
+		free(task->output);
+		free(task);
+		return NULL;
+	}
+
+	return task;
+}
+
+int vidma_task_done(vidma_task_t *task)
+{
+	return __atomic_load_n(&task->done, __ATOMIC_ACQUIRE);
+}
+
+int vidma_task_wait(vidma_task_t *task)
+{
+	int res;
+
+	pthread_join(task->thread, NULL);
+	res = task->result;
+	free(task->output);
+	free(task);
+
+	return res;
+}
@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2013 Przemyslaw Pawelczyk <przemoc@gmail.com>
+ *
+ * This software is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2.
+ * See <http://www.gnu.org/licenses/gpl-2.0.txt>.
+ *
+ * This software is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/** \file vidma.h
+ * libvidma - vidma as a library.
+ *
+ * Image is opened once and its header and block allocation map are kept in
+ * the handle, so they are read only when the first operation needs them and
+ * again after an operation has modified them. Messages, questions and
+ * progress go to callbacks given when image is opened instead of terminal.
+ *
+ * Guest data can be read and written directly, without starting a virtual
+ * machine. Image is opened for writing if possible, so it can be patched.
+ *
+ * Operations block until they are done, but any of them can be started in
+ * a background thread with vidma_start(), so caller can poll or wait for
+ * it. Operations on different images may run at once, operations on the
+ * same image must not. Options set by vidma_set_option() and I/O statistics
+ * are shared by the whole process.
+ */
+
+#ifndef VIDMA_H
+#define VIDMA_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+/** Result of successful call. */
+#define VIDMA_SUCCESS 0
+/** Result of failed call. */
+#define VIDMA_FAILURE 1
+
+/** Opened image (opaque). */
+typedef struct vidma_image vidma_image_t;
+
+/** Operation running in background (opaque). */
+typedef struct vidma_task vidma_task_t;
+
+/** Operations that can be started with vidma_start(). */
+enum vidma_op {
+	VIDMA_RESIZE = 0,
+	VIDMA_COMPACT,
+	VIDMA_DEFRAG,
+};
+
+/** Options set by vidma_set_option(). */
+enum vidma_option {
+	VIDMA_OPT_DURABILITY = 0,
+	/**< Syncing done by operations, one of \a vidma_durability
+	 * (default: \a VIDMA_DURABILITY_FULL). */
+	VIDMA_OPT_THREADS,
+	/**< Threads copying blocks to another file (default: 1). */
+	VIDMA_OPT_DIRECT,
+	/**< Non-zero to bypass page cache (O_DIRECT) for images opened and
+	 * files written afterwards (default: 0). */
+	VIDMA_OPT_BANDWIDTH,
+	/**< Bytes read plus written per second by the whole process, 0 means
+	 * no limit (default: 0). */
+	VIDMA_OPT_MEMORY,
+	/**< Bytes block allocation map of image may take in memory, larger one
+	 * is streamed from disk, 0 means no limit (default: 0). Data buffers are
+	 * not counted. */
+};
+
+/** Values of \a VIDMA_OPT_DURABILITY. */
+enum vidma_durability {
+	VIDMA_DURABILITY_NONE = 0,  /**< Nothing is synced explicitly. */
+	VIDMA_DURABILITY_ORDERED,   /**< Data only and only where later writes
+	                                 depend on it. */
+	VIDMA_DURABILITY_FULL,      /**< Everything at the end of every step. */
+};
+
+/** Callbacks receiving what CLI would show. All of them are optional. */
+typedef struct vidma_callbacks {
+
+	/* log(void *ctx, const char *line) */
+	void (*log)(void *, const char *);
+	/**< Receives every line logged (without trailing newline). */
+
+	/* confirm(void *ctx, const char *question) */
+	int (*confirm)(void *, const char *);
+	/**< Answers question asked before anything is modified (non-zero means
+	 * yes). Without this callback every question is answered with yes. */
+
+	/* step(void *ctx, const char *op, int step, int steps, const char *name) */
+	void (*step)(void *, const char *, int, int, const char *);
+	/**< Informs about operation advancing to next step. */
+
+	/* progress(void *ctx, uint64_t val, uint64_t max) */
+	void (*progress)(void *, uint64_t, uint64_t);
+	/**< Informs about progress of current step. It's called often and may
+	 * be called from I/O threads, so it should be cheap and thread-safe. */
+
+	void *ctx;
+	/**< Context passed to every callback. */
+
+} vidma_callbacks_t;
+
+/** Basic information about image. */
+typedef struct vidma_info {
+	const char *format;         /**< Name of format. */
+	const char *variant;        /**< Variant of format (e.g. "dynamic"). */
+	uint64_t disk_size;         /**< Size of virtual disk. */
+	uint64_t data_offset;       /**< Offset of the first block in file. */
+	uint32_t blk_size;          /**< Size of block. */
+	uint32_t blk_extra;         /**< Extra data of every block. */
+	uint32_t blk_count;         /**< Number of blocks. */
+	uint32_t blk_alloc;         /**< Number of allocated blocks. */
+	uint32_t blk_zero;          /**< Number of unallocated zero blocks. */
+} vidma_info_t;
+
+/** Sets option \p opt (\a vidma_option) to \p val. Options apply to the
+ * whole process, so they should be set while no operation is running.
+ *
+ * \return \a VIDMA_SUCCESS or \a VIDMA_FAILURE (unknown option or
+ *         incorrect value)
+ */
+int vidma_set_option(int opt, uint64_t val);
+
+/** Opens image at \p path, reporting through \p cb (may be NULL).
+ *
+ * \return image or NULL if it cannot be opened or its format is unknown
+ */
+vidma_image_t *vidma_open(const char *path, const vidma_callbacks_t *cb);
+
+/** Closes image. */
+void vidma_close(vidma_image_t *img);
+
+/** Fills \p info with basic information about \p img.
+ *
+ * \return \a VIDMA_SUCCESS or \a VIDMA_FAILURE
+ */
+int vidma_info(vidma_image_t *img, vidma_info_t *info);
+
+/** Resizes \p img to \p new_msize megabytes, writing it to \p output (or in
+ * place if \p output is NULL).
+ *
+ * \return \a VIDMA_SUCCESS or \a VIDMA_FAILURE
+ */
+int vidma_resize(vidma_image_t *img, uint32_t new_msize, const char *output);
+
+/** Compacts \p img, writing it to \p output (or in place if \p output is
+ * NULL).
+ *
+ * \return \a VIDMA_SUCCESS or \a VIDMA_FAILURE
+ */
+int vidma_compact(vidma_image_t *img, const char *output);
+
+/** Defragments \p img, writing it to \p output (or in place if \p output
+ * is NULL).
+ *
+ * \return \a VIDMA_SUCCESS or \a VIDMA_FAILURE
+ */
+int vidma_defrag(vidma_image_t *img, const char *output);
+
+/** Reads \p len bytes of guest data at \p off (in bytes of virtual disk)
+ * into \p buf. Unallocated blocks read as zeros.
+ *
+ * \return \a VIDMA_SUCCESS or \a VIDMA_FAILURE
+ */
+int vidma_read(vidma_image_t *img, void *buf, size_t len, uint64_t off);
+
+/** Writes \p len bytes of guest data from \p buf at \p off (in bytes of
+ * virtual disk), allocating blocks of dynamic image if needed.
+ *
+ * \return \a VIDMA_SUCCESS or \a VIDMA_FAILURE
+ */
+int vidma_write(vidma_image_t *img, const void *buf, size_t len,
+                uint64_t off);
+
+/** Starts \p op (\a vidma_op) on \p img in background thread.
+ * \p new_msize is used by \a VIDMA_RESIZE only.
+ *
+ * \return task or NULL if thread cannot be started
+ */
+vidma_task_t *vidma_start(vidma_image_t *img, int op, uint32_t new_msize,
+                          const char *output);
+
+/** Tells whether \p task has finished (never blocks).
+ *
+ * \return non-zero if it has
+ */
+int vidma_task_done(vidma_task_t *task);
+
+/** Waits for \p task to finish and frees it.
+ *
+ * \return result of operation
+ */
+int vidma_task_wait(vidma_task_t *task);
+
+#endif /* VIDMA_H */